@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _BENCH_GENERATOR_H
+#define _BENCH_GENERATOR_H
+
+#include <tll/scheme.h>
+#include <tll/scheme/util.h>
+#include <tll/util/memoryview.h>
+
+#include <bson/bson.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string_view>
+#include <vector>
+
+namespace bench {
+
+/// Shape of generated messages
+struct GeneratorSettings
+{
+	/// Length range of strings, both for pointer strings and fixed byte strings (truncated to field size)
+	size_t string_min = 4;
+	size_t string_max = 32;
+	/// Probability of each element of fixed array to be filled
+	double array_fill = 0.5;
+	/// Maximum size of pointer list and probability of each element to be present
+	size_t list_max = 8;
+	double list_fill = 0.5;
+	/// Weight of union branch N is skew^N, 1 gives uniform distribution
+	double union_skew = 1;
+	/// Nesting depth of sub-messages, deeper lists are left empty
+	unsigned depth = 4;
+	/// Probability that keys of generated BSON document are shuffled
+	double shuffle = 0;
+};
+
+/**
+ * Generator of random but valid messages for any scheme
+ *
+ * Scalars get random values, enums and bits only defined ones, decimal128 fields integer values
+ * with zero exponent. Same seed gives same sequence of messages.
+ */
+class Generator
+{
+	using Field = tll::scheme::Field;
+	using Message = tll::scheme::Message;
+
+	std::mt19937_64 _rng;
+
+ public:
+	GeneratorSettings settings;
+
+	explicit Generator(const GeneratorSettings &s = {}, uint64_t seed = 0) : _rng(seed), settings(s) {}
+
+	/// Fill ``msg`` with new message stored in ``buf``
+	void generate(const Message * message, std::vector<char> &buf, tll_msg_t &msg)
+	{
+		buf.resize(0);
+		buf.resize(message->size);
+		fill(message, tll::make_view(buf), 0);
+
+		msg = {};
+		msg.msgid = message->msgid;
+		msg.data = buf.data();
+		msg.size = buf.size();
+	}
+
+	/**
+	 * Copy of BSON document with keys of sub-documents shuffled with settings.shuffle probability,
+	 * array elements keep their order
+	 */
+	std::vector<uint8_t> shuffle(const void * data, size_t size)
+	{
+		bson_t in, out = BSON_INITIALIZER;
+		if (!bson_init_static(&in, (const uint8_t *) data, size))
+			return {};
+		shuffle(&in, &out, false);
+		std::vector<uint8_t> r(bson_get_data(&out), bson_get_data(&out) + out.len);
+		bson_destroy(&out);
+		return r;
+	}
+
+ private:
+	bool chance(double p) { return std::bernoulli_distribution(std::clamp(p, 0., 1.))(_rng); }
+
+	template <typename T>
+	T uniform(T min, T max)
+	{
+		if constexpr (std::is_floating_point_v<T>)
+			return std::uniform_real_distribution<T>(min, max)(_rng);
+		else
+			return std::uniform_int_distribution<T>(min, max)(_rng);
+	}
+
+	size_t count(size_t max, double fill)
+	{
+		if (!max)
+			return 0;
+		return std::binomial_distribution<size_t>(max, std::clamp(fill, 0., 1.))(_rng);
+	}
+
+	void string(char * data, size_t size)
+	{
+		for (auto i = 0u; i < size; i++)
+			data[i] = 'a' + uniform(0, 25);
+	}
+
+	template <typename Buf>
+	void fill(const Message * message, Buf data, unsigned depth)
+	{
+		for (auto f = message->fields; f; f = f->next)
+			fill(f, data.view(f->offset), depth);
+	}
+
+	/// Random seconds in 2000..2030 converted to field resolution
+	long long time_value(const Field * field)
+	{
+		auto s = uniform<long long>(946684800, 1893456000);
+		switch (field->time_resolution) {
+		case TLL_SCHEME_TIME_NS: return s * 1000000000;
+		case TLL_SCHEME_TIME_US: return s * 1000000;
+		case TLL_SCHEME_TIME_MS: return s * 1000;
+		case TLL_SCHEME_TIME_SECOND: return s;
+		case TLL_SCHEME_TIME_MINUTE: return s / 60;
+		case TLL_SCHEME_TIME_HOUR: return s / 3600;
+		case TLL_SCHEME_TIME_DAY: return s / 86400;
+		}
+		return s;
+	}
+
+	template <typename T, typename Buf>
+	void fill_int(const Field * field, Buf data)
+	{
+		// uniform_int_distribution is not defined for 8 bit types
+		using W = std::conditional_t<std::is_signed_v<T>, long long, unsigned long long>;
+		W v = 0;
+		if (field->sub_type == Field::Enum) {
+			std::vector<long long> values;
+			for (auto e = field->type_enum->values; e; e = e->next)
+				values.push_back(e->value);
+			if (values.size())
+				v = values[uniform<size_t>(0, values.size() - 1)];
+		} else if (field->sub_type == Field::Bits) {
+			for (auto b = field->bitfields; b; b = b->next) {
+				if (b->size < 64 && b->offset + b->size <= sizeof(T) * 8)
+					v |= uniform<unsigned long long>(0, (1ull << b->size) - 1) << b->offset;
+			}
+		} else if (field->sub_type == Field::TimePoint && sizeof(T) >= 4) {
+			v = std::min<long long>(time_value(field), std::numeric_limits<T>::max());
+		} else
+			v = uniform<W>(std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+		*data.template dataT<T>() = (T) v;
+	}
+
+	template <typename Buf>
+	void fill(const Field * field, Buf data, unsigned depth)
+	{
+		switch (field->type) {
+		case Field::Int8: return fill_int<int8_t>(field, data);
+		case Field::Int16: return fill_int<int16_t>(field, data);
+		case Field::Int32: return fill_int<int32_t>(field, data);
+		case Field::Int64: return fill_int<int64_t>(field, data);
+		case Field::UInt8: return fill_int<uint8_t>(field, data);
+		case Field::UInt16: return fill_int<uint16_t>(field, data);
+		case Field::UInt32: return fill_int<uint32_t>(field, data);
+		case Field::UInt64: return fill_int<uint64_t>(field, data);
+		case Field::Double:
+			*data.template dataT<double>() = std::round(uniform(-1e6, 1e6) * 1000) / 1000;
+			return;
+		case Field::Decimal128: {
+			// Integer coefficient with zero exponent, biased exponent 6176 is stored in bits 49..62
+			uint64_t words[2] = { uniform<uint64_t>(0, 1000000000), 0x3040000000000000ull };
+			memcpy(data.data(), words, sizeof(words));
+			return;
+		}
+		case Field::Bytes: {
+			if (field->sub_type != Field::ByteString) {
+				for (auto i = 0u; i < field->size; i++)
+					*data.view(i).template dataT<uint8_t>() = uniform(0, 255);
+				return;
+			}
+			auto len = std::min(uniform(settings.string_min, std::max(settings.string_min, settings.string_max)), field->size);
+			string(data.template dataT<char>(), len);
+			return;
+		}
+		case Field::Array: {
+			auto size = count(field->count, settings.array_fill);
+			tll::scheme::write_size(field->count_ptr, data.view(field->count_ptr->offset), size);
+			auto af = field->type_array;
+			for (auto i = 0u; i < size; i++)
+				fill(af, data.view(af->offset + i * af->size), depth + 1);
+			return;
+		}
+		case Field::Pointer: {
+			tll::scheme::generic_offset_ptr_t ptr = {};
+			if (field->sub_type == Field::ByteString) {
+				auto len = uniform(settings.string_min, std::max(settings.string_min, settings.string_max));
+				ptr.size = len + 1;
+				ptr.entity = 1;
+				if (tll::scheme::alloc_pointer(field, data, ptr))
+					return;
+				string(data.view(ptr.offset).template dataT<char>(), len);
+				return;
+			}
+			if (depth >= settings.depth)
+				return;
+			ptr.size = count(settings.list_max, settings.list_fill);
+			if (!ptr.size)
+				return;
+			auto af = field->type_ptr;
+			ptr.entity = af->size;
+			if (tll::scheme::alloc_pointer(field, data, ptr))
+				return;
+			for (auto i = 0u; i < ptr.size; i++)
+				fill(af, data.view(ptr.offset + i * ptr.entity), depth + 1);
+			return;
+		}
+		case Field::Message:
+			if (depth < settings.depth)
+				fill(field->type_msg, data, depth + 1);
+			return;
+		case Field::Union: {
+			auto ud = field->type_union;
+			if (!ud->fields_size)
+				return;
+			std::vector<double> weights;
+			for (auto i = 0u; i < ud->fields_size; i++)
+				weights.push_back(std::pow(settings.union_skew, i));
+			auto idx = std::discrete_distribution<size_t>(weights.begin(), weights.end())(_rng);
+			tll::scheme::write_size(ud->type_ptr, data.view(ud->type_ptr->offset), idx);
+			auto uf = ud->fields + idx;
+			fill(uf, data.view(uf->offset), depth + 1);
+			return;
+		}
+		}
+	}
+
+	void shuffle(const bson_t * in, bson_t * out, bool array)
+	{
+		bson_iter_t iter;
+		std::vector<bson_iter_t> items;
+		if (!bson_iter_init(&iter, in))
+			return;
+		while (bson_iter_next(&iter))
+			items.push_back(iter);
+		if (!array && chance(settings.shuffle))
+			std::shuffle(items.begin(), items.end(), _rng);
+		for (auto & i : items) {
+			auto type = bson_iter_type(&i);
+			if (type != BSON_TYPE_DOCUMENT && type != BSON_TYPE_ARRAY) {
+				bson_append_iter(out, nullptr, 0, &i);
+				continue;
+			}
+			const uint8_t * data;
+			uint32_t len;
+			bson_t sub, child;
+			if (type == BSON_TYPE_DOCUMENT) {
+				bson_iter_document(&i, &len, &data);
+				bson_append_document_begin(out, bson_iter_key(&i), -1, &child);
+			} else {
+				bson_iter_array(&i, &len, &data);
+				bson_append_array_begin(out, bson_iter_key(&i), -1, &child);
+			}
+			if (bson_init_static(&sub, data, len))
+				shuffle(&sub, &child, type == BSON_TYPE_ARRAY);
+			if (type == BSON_TYPE_DOCUMENT)
+				bson_append_document_end(out, &child);
+			else
+				bson_append_array_end(out, &child);
+		}
+	}
+};
+
+} // namespace bench
+
+#endif//_BENCH_GENERATOR_H
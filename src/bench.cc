@@ -1,7 +1,15 @@
 // SPDX-License-Identifier: MIT
 
+#include "bench-generator.h"
 #include "bench-scheme.h"
 
+#include "tll/bson/api.h"
+#include "tll/bson/encoder.h"
+#include "tll/bson/inplace.h"
+#include "tll/bson/json.h"
+#include "tll/bson/libbson.h"
+#include "tll/bson/view.h"
+
 #include <tll/channel.h>
 #include <tll/channel/base.h>
 #include <tll/channel/module.h>
@@ -9,6 +17,9 @@
 #include <tll/util/bench.h>
 #include <tll/util/time.h>
 
+#include <limits>
+#include <numeric>
+
 extern "C" tll_channel_module_t * tll_channel_module();
 
 static constexpr auto count = 100000u;
@@ -26,6 +37,49 @@ class Echo : public tll::channel::Base<Echo>
 
 TLL_DEFINE_IMPL(Echo);
 
+/// Channel that owns output buffer and supports in-place writes, posted data is copied into it
+class Ring : public tll::channel::Base<Ring>, public tll::bson::inplace::Writer
+{
+	std::vector<char> _buffer = std::vector<char>(64 * 1024);
+
+ public:
+	static constexpr std::string_view channel_protocol() { return "ring"; }
+	static constexpr auto process_policy() { return tll::channel::Base<Ring>::ProcessPolicy::Never; }
+
+	/// Last written message, valid until next write
+	tll::const_memory last = {};
+	size_t posts = 0;
+	size_t commits = 0;
+
+	int _post(const tll_msg_t *msg, int flags)
+	{
+		if (msg->size > _buffer.size())
+			return EMSGSIZE;
+		memcpy(_buffer.data(), msg->data, msg->size);
+		last = { _buffer.data(), msg->size };
+		posts++;
+		return 0;
+	}
+
+	tll::memory reserve(size_t size) override
+	{
+		if (size > _buffer.size())
+			return {};
+		return { _buffer.data(), size };
+	}
+
+	int commit(const tll_msg_t *msg, int flags) override
+	{
+		if (msg->data != _buffer.data() || msg->size > _buffer.size())
+			return EINVAL;
+		last = { msg->data, msg->size };
+		commits++;
+		return 0;
+	}
+};
+
+TLL_DEFINE_IMPL(Ring);
+
 template <typename Buf>
 void fill_simple(tll_msg_t &msg, Buf &buf)
 {
@@ -63,7 +117,779 @@ void fill_simple(tll_msg_t &msg, Buf &buf)
 	msg.msgid = simple.meta_id();
 }
 
-void bench(tll::channel::Context &ctx, std::string_view proto, std::string_view encoder = "")
+template <typename Buf>
+void fill_sparse(tll_msg_t &msg, Buf &buf)
+{
+	auto simple = Simple::bind(buf);
+	simple.view().resize(0);
+	simple.view().resize(simple.meta_size());
+
+	auto header = simple.get_header();
+	header.set_id0(100);
+	header.set_ts0(time_point_cast<duration<int64_t, std::micro>>(tll::time::now()));
+	header.set_string0("short");
+
+	simple.set_f0(tll::util::FixedPoint<int64_t, 8>(123.123));
+
+	msg.data = simple.view().data();
+	msg.size = simple.view().size();
+	msg.msgid = simple.meta_id();
+}
+
+void report_size(std::string_view name, const tll::Scheme * scheme, const tll_msg_t &msg)
+{
+	using namespace tll::bson;
+	auto message = scheme->lookup(msg.msgid);
+
+	cppbson::Encoder enc;
+	enc.init();
+
+	util::Settings settings;
+	settings.type_key = "_tll_name";
+	settings.seq_key = "_tll_seq";
+	auto dense = enc.encode(settings, message, &msg);
+	settings.sparse = true;
+	auto sparse = enc.encode(settings, message, &msg);
+	if (!dense || !sparse)
+		return;
+	fmt::print("{} message: {} bytes dense, {} bytes sparse, {:.1f}% saved\n", name, dense->size, sparse->size, 100. - 100. * sparse->size / dense->size);
+}
+
+/// Document with lots of unknown keys
+std::vector<uint8_t> hostile_unknown(size_t count)
+{
+	bson_t b = BSON_INITIALIZER;
+	bson_append_utf8(&b, "_tll_name", -1, "Nested", -1);
+	for (auto i = 0u; i < count; i++) {
+		auto key = fmt::format("k{}", i);
+		bson_append_int32(&b, key.data(), key.size(), i);
+	}
+	std::vector<uint8_t> r(bson_get_data(&b), bson_get_data(&b) + b.len);
+	bson_destroy(&b);
+	return r;
+}
+
+/// Document with huge list of empty elements, each one is expanded into full Sub message
+std::vector<uint8_t> hostile_list(size_t count)
+{
+	bson_t b = BSON_INITIALIZER, list, sub;
+	bson_append_utf8(&b, "_tll_name", -1, "Nested", -1);
+	bson_append_array_begin(&b, "sub", -1, &list);
+	for (auto i = 0u; i < count; i++) {
+		auto key = fmt::format("{}", i);
+		bson_append_document_begin(&list, key.data(), key.size(), &sub);
+		bson_append_document_end(&list, &sub);
+	}
+	bson_append_array_end(&b, &list);
+	std::vector<uint8_t> r(bson_get_data(&b), bson_get_data(&b) + b.len);
+	bson_destroy(&b);
+	return r;
+}
+
+/// Document with long string in pointer field
+std::vector<uint8_t> hostile_string(size_t size)
+{
+	bson_t b = BSON_INITIALIZER, trailer;
+	std::string str(size, 'x');
+	bson_append_utf8(&b, "_tll_name", -1, "Nested", -1);
+	bson_append_document_begin(&b, "trailer", -1, &trailer);
+	bson_append_utf8(&trailer, "message", -1, str.data(), str.size());
+	bson_append_document_end(&b, &trailer);
+	std::vector<uint8_t> r(bson_get_data(&b), bson_get_data(&b) + b.len);
+	bson_destroy(&b);
+	return r;
+}
+
+void bench_decode(std::string_view name, const tll::scheme::Message * message, const std::vector<uint8_t> &data, const tll::bson::util::Limits &limits)
+{
+	using namespace tll::bson;
+	libbson::Decoder dec;
+	dec.limits = limits;
+	util::Settings settings;
+	settings.type_key = "_tll_name";
+	std::vector<char> buf;
+	auto decode = [&]() {
+		bson_iter_t iter;
+		buf.resize(0);
+		buf.resize(message->size);
+		dec.limits_reset(message->size);
+		if (!bson_iter_init_from_data(&iter, data.data(), data.size()) || !bson_iter_next(&iter))
+			return EINVAL;
+		return dec.decode(&iter, message, tll::make_view(buf), settings) ? 0 : EINVAL;
+	};
+	tll::bench::timeit(100, name, decode);
+}
+
+/// Encode and decode through standalone API into caller memory
+void bench_api(const tll::Scheme * scheme)
+{
+	std::vector<char> buf;
+	tll_msg_t msg = {};
+	fill_simple(msg, buf);
+
+	tll::bson::util::Settings settings;
+	settings.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!codec.init(scheme, settings))
+		return;
+
+	auto size = codec.encoded_size(msg.msgid, msg.seq, msg.data, msg.size);
+	if (!size)
+		return;
+	std::vector<char> encoded(*size);
+	auto encode = [&]() { return codec.encode(msg.msgid, msg.seq, msg.data, msg.size, encoded.data(), encoded.size()) == size ? 0 : EINVAL; };
+	tll::bench::timeit(count, "api encode", encode);
+
+	auto dsize = codec.decoded_size(encoded.data(), encoded.size());
+	if (!dsize)
+		return;
+	std::vector<char> decoded(*dsize);
+	auto decode = [&]() { return codec.decode(encoded.data(), encoded.size(), decoded.data(), decoded.size()) == dsize ? 0 : EINVAL; };
+	tll::bench::timeit(count, "api decode", decode);
+}
+
+/// Read few fields with lazy view, compare with full decode in bench_api
+void bench_view(const tll::Scheme * scheme)
+{
+	std::vector<char> buf;
+	tll_msg_t msg = {};
+	fill_simple(msg, buf);
+
+	tll::bson::util::Settings settings;
+	settings.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!codec.init(scheme, settings))
+		return;
+	auto size = codec.encoded_size(msg.msgid, msg.seq, msg.data, msg.size);
+	if (!size)
+		return;
+	auto encoded = codec.spill();
+
+	auto message = codec.info()->lookup(msg.msgid);
+	auto header = message->fields;
+	auto id0 = header->type_msg->fields;
+	const tll::scheme::Field * string0 = nullptr, * f0 = nullptr;
+	for (auto f = message->fields; f; f = f->next) {
+		if (f->name == std::string_view("string0"))
+			string0 = f;
+		else if (f->name == std::string_view("f0"))
+			f0 = f;
+	}
+
+	tll::bson::view::Document doc;
+	auto read = [&]() {
+		auto m = doc.init(settings, *codec.info(), encoded.data(), encoded.size());
+		if (!m)
+			return EINVAL;
+		auto h = m->get_message(header);
+		if (!h || !h->get<int32_t>(id0) || !m->get_string(string0) || !m->get<int64_t>(f0))
+			return EINVAL;
+		return 0;
+	};
+	tll::bench::timeit(count, "view 3 fields", read);
+}
+
+/// Direct BSON to Extended JSON transcoding compared with decode followed by json+ encoding
+void bench_json(tll::channel::Context &ctx, const tll::Scheme * scheme)
+{
+	std::vector<char> buf;
+	tll_msg_t msg = {};
+	fill_simple(msg, buf);
+
+	tll::bson::util::Settings settings;
+	settings.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!codec.init(scheme, settings))
+		return;
+	auto size = codec.encoded_size(msg.msgid, msg.seq, msg.data, msg.size);
+	if (!size)
+		return;
+	auto encoded = codec.spill();
+
+	tll::bson::json::Transcoder json;
+	auto relaxed = [&]() { return json.transcode(settings, codec.info(), encoded.data(), encoded.size()) ? 0 : EINVAL; };
+	tll::bench::timeit(count, "json relaxed", relaxed);
+	auto plain = [&]() { return json.transcode(encoded.data(), encoded.size()) ? 0 : EINVAL; };
+	tll::bench::timeit(count, "json relaxed no scheme", plain);
+	json.mode = tll::bson::json::Transcoder::Mode::Canonical;
+	auto canonical = [&]() { return json.transcode(encoded.data(), encoded.size()) ? 0 : EINVAL; };
+	tll::bench::timeit(count, "json canonical", canonical);
+
+	tll::Channel::Url url;
+	url.proto("json+null");
+	url.set("scheme", scheme_string);
+	url.set("name", "json");
+	auto c = ctx.channel(url);
+	if (!c)
+		return;
+	c->open();
+	if (c->state() != tll::state::Active)
+		return;
+
+	auto dsize = codec.decoded_size(encoded.data(), encoded.size());
+	if (!dsize)
+		return;
+	std::vector<char> decoded(*dsize);
+	auto decode = [&]() {
+		tll::bson::Codec::Meta meta;
+		auto r = codec.decode(encoded.data(), encoded.size(), decoded.data(), decoded.size(), &meta);
+		if (r != dsize)
+			return EINVAL;
+		tll_msg_t m = {};
+		m.msgid = meta.msgid;
+		m.data = decoded.data();
+		m.size = *r;
+		return c->post(&m);
+	};
+	tll::bench::timeit(count, "decode + json+", decode);
+}
+
+using Params = std::vector<std::pair<std::string_view, std::string_view>>;
+
+/// Parse generator settings from key=value arguments, return message name filter
+std::optional<std::string> parse_generator(int argc, char *argv[], bench::GeneratorSettings &s)
+{
+	std::string message;
+	for (auto i = 2; i < argc; i++) {
+		std::string_view arg = argv[i];
+		auto sep = arg.find('=');
+		if (sep == arg.npos) {
+			fmt::print(stderr, "Invalid argument '{}', expected key=value\n", arg);
+			return std::nullopt;
+		}
+		auto key = arg.substr(0, sep);
+		std::string value(arg.substr(sep + 1));
+		if (key == "message")
+			message = value;
+		else if (key == "string.min")
+			s.string_min = std::stoul(value);
+		else if (key == "string.max")
+			s.string_max = std::stoul(value);
+		else if (key == "array.fill")
+			s.array_fill = std::stod(value);
+		else if (key == "list.max")
+			s.list_max = std::stoul(value);
+		else if (key == "list.fill")
+			s.list_fill = std::stod(value);
+		else if (key == "union.skew")
+			s.union_skew = std::stod(value);
+		else if (key == "depth")
+			s.depth = std::stoul(value);
+		else if (key == "shuffle")
+			s.shuffle = std::stod(value);
+		else {
+			fmt::print(stderr, "Unknown generator parameter '{}'\n", key);
+			return std::nullopt;
+		}
+	}
+	return message;
+}
+
+/// Encode and decode generated messages of each message in the scheme, samples are used round robin
+void bench_generated(tll::channel::Context &ctx, std::string_view url, const bench::GeneratorSettings &settings, std::string_view filter)
+{
+	constexpr size_t samples = 64;
+
+	tll::scheme::ConstSchemePtr scheme(ctx.scheme_load(url));
+	if (!scheme) {
+		fmt::print(stderr, "Failed to load scheme {}\n", url);
+		return;
+	}
+
+	bench::Generator gen(settings);
+	tll::bson::util::Settings bs;
+	bs.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!codec.init(scheme.get(), bs)) {
+		fmt::print(stderr, "Failed to bind scheme: {}\n", codec.error());
+		return;
+	}
+
+	for (auto message = scheme->messages; message; message = message->next) {
+		if (message->msgid == 0 || (filter.size() && filter != message->name))
+			continue;
+
+		std::vector<std::vector<char>> data(samples);
+		std::vector<tll_msg_t> msgs(samples);
+		std::vector<std::vector<uint8_t>> docs(samples);
+		size_t bytes = 0;
+		for (auto i = 0u; i < samples; i++) {
+			gen.generate(message, data[i], msgs[i]);
+			auto size = codec.encoded_size(msgs[i].msgid, 0, msgs[i].data, msgs[i].size);
+			if (!size) {
+				fmt::print(stderr, "Failed to encode generated {}: {}\n", message->name, codec.error());
+				return;
+			}
+			docs[i] = gen.shuffle(codec.spill().data(), *size);
+			bytes += *size;
+		}
+		fmt::print("{}: {} bytes of raw data, {} bytes of BSON on average\n", message->name,
+			std::accumulate(msgs.begin(), msgs.end(), size_t(0), [](auto s, auto & m) { return s + m.size; }) / samples,
+			bytes / samples);
+
+		for (auto encoder : { "libbson", "cppbson" }) {
+			tll::Channel::Url curl;
+			curl.proto("bson+null");
+			curl.set("scheme", url);
+			curl.set("name", "codec");
+			curl.set("encoder", encoder);
+			auto c = ctx.channel(curl);
+			if (!c)
+				return;
+			c->open();
+			if (c->state() != tll::state::Active)
+				return;
+			size_t idx = 0;
+			auto post = [&]() { return c->post(&msgs[idx++ % samples]); };
+			tll::bench::timeit(count, fmt::format("{} encode {}", message->name, encoder), post);
+		}
+
+		std::vector<char> buf;
+		size_t idx = 0;
+		auto decode = [&]() {
+			auto & doc = docs[idx++ % samples];
+			auto r = codec.decode(doc.data(), doc.size(), buf.data(), buf.size());
+			if (r && *r > buf.size()) {
+				buf.resize(*r);
+				r = codec.decode(doc.data(), doc.size(), buf.data(), buf.size());
+			}
+			return r ? 0 : EINVAL;
+		};
+		tll::bench::timeit(count, fmt::format("{} decode", message->name), decode);
+	}
+}
+
+/// Check that in-place writes produce the same bytes as regular post, both when document fits and when it does not
+bool check_inplace(tll::channel::Context &ctx)
+{
+	std::vector<char> buf;
+	tll_msg_t msg = {};
+	fill_simple(msg, buf);
+
+	auto open = [&ctx](std::string_view name, const Params &params) -> std::pair<std::unique_ptr<tll::Channel>, Ring *> {
+		tll::Channel::Url url;
+		url.proto("bson+ring");
+		url.set("scheme", scheme_string);
+		url.set("name", name);
+		url.set("encoder", "cppbson");
+		for (auto & [k, v] : params)
+			url.set(k, v);
+		auto c = ctx.channel(url);
+		if (!c)
+			return {};
+		c->open();
+		auto children = tll_channel_children(c.get());
+		if (c->state() != tll::state::Active || !children)
+			return {};
+		auto ring = static_cast<Ring *>(children->channel->data);
+		return { std::move(c), ring };
+	};
+
+	auto [copy, copy_ring] = open("check-copy", {{"inplace", "no"}});
+	if (!copy || copy->post(&msg)) {
+		fmt::print("In-place check: failed to post reference message\n");
+		return false;
+	}
+	std::string_view expected(static_cast<const char *>(copy_ring->last.data), copy_ring->last.size);
+
+	// Default reservation fits the document, small one is spilled and posted
+	for (auto & [size, inplace] : { std::pair<std::string, bool> {"4096", true}, {"64", false} }) {
+		auto [c, ring] = open("check-inplace", {{"inplace.size", size}});
+		if (!c || c->post(&msg)) {
+			fmt::print("In-place check: failed to post message, reserve {}\n", size);
+			return false;
+		}
+		std::string_view result(static_cast<const char *>(ring->last.data), ring->last.size);
+		if (result != expected) {
+			fmt::print("In-place check: reserve {}: data differs from regular post, {} bytes, expected {}\n", size, result.size(), expected.size());
+			return false;
+		}
+		if (ring->commits != (inplace ? 1u : 0u) || ring->posts != (inplace ? 0u : 1u)) {
+			fmt::print("In-place check: reserve {}: {} commits and {} posts\n", size, ring->commits, ring->posts);
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Compare scalar value from lazy view with fully decoded one, getter is called with value of requested type
+template <typename Get>
+bool check_view_scalar(const tll::scheme::Field * field, const void * expected, Get get)
+{
+	auto cmp = [&](auto tag) {
+		auto v = get(tag);
+		return v && !memcmp(&*v, expected, sizeof(tag));
+	};
+	switch (field->size) {
+	case 1: return cmp(uint8_t {});
+	case 2: return cmp(uint16_t {});
+	case 4: return cmp(uint32_t {});
+	case 8: return cmp(uint64_t {});
+	case 16: return cmp(bson_decimal128_t {});
+	default: return true;
+	}
+}
+
+template <typename View>
+bool check_view_message(tll::bson::view::Message &m, const tll::scheme::Message * message, View data);
+
+/// Compare list elements from lazy view with fully decoded list of ``size`` elements
+template <typename View>
+bool check_view_list(tll::bson::view::List &l, const tll::scheme::Field * field, size_t size, size_t entity, View data)
+{
+	using Field = tll::scheme::Field;
+	if (l.size() != size)
+		return false;
+	for (auto i = 0u; i < size; i++) {
+		auto item = data.view(i * entity);
+		if (field->type == Field::Message) {
+			auto sub = l.get_message(i);
+			if (!sub || !check_view_message(*sub, field->type_msg, item))
+				return false;
+		} else if (!check_view_scalar(field, item.data(), [&](auto tag) { return l.get<decltype(tag)>(i); }))
+			return false;
+	}
+	return true;
+}
+
+template <typename View>
+bool check_view_field(tll::bson::view::Message &m, const tll::scheme::Field * field, View data)
+{
+	using Field = tll::scheme::Field;
+	switch (field->type) {
+	case Field::Message: {
+		auto sub = m.get_message(field);
+		return sub && check_view_message(*sub, field->type_msg, data);
+	}
+	case Field::Pointer: {
+		auto ptr = tll::scheme::read_pointer(field, data);
+		if (!ptr)
+			return false;
+		if (field->sub_type == Field::ByteString) {
+			auto s = m.get_string(field);
+			std::string_view expected(data.view(ptr->offset).data(), ptr->size ? ptr->size - 1 : 0);
+			return s && *s == expected;
+		}
+		auto l = m.get_list(field);
+		return l && check_view_list(*l, field->type_ptr, ptr->size, ptr->entity, data.view(ptr->offset));
+	}
+	case Field::Array: {
+		auto l = m.get_list(field);
+		auto size = tll::scheme::read_size(field->count_ptr, data.view(field->count_ptr->offset));
+		auto af = field->type_array;
+		return l && check_view_list(*l, af, size, af->size, data.view(af->offset));
+	}
+	case Field::Bytes:
+	case Field::Union:
+		return true;
+	default:
+		return check_view_scalar(field, data.data(), [&](auto tag) { return m.get<decltype(tag)>(field); });
+	}
+}
+
+template <typename View>
+bool check_view_message(tll::bson::view::Message &m, const tll::scheme::Message * message, View data)
+{
+	for (auto f = message->fields; f; f = f->next) {
+		if (!check_view_field(m, f, data.view(f->offset))) {
+			fmt::print("View check: field '{}.{}' differs from full decode\n", message->name, f->name);
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Check that lazy view getters return the same values as full decode
+bool check_view()
+{
+	static constexpr std::string_view scheme_view = R"(yamls://
+- name: Inner
+  fields:
+    - {name: a, type: int32}
+    - {name: s, type: string}
+- name: Data
+  id: 10
+  enums:
+    Side: {type: int8, enum: {Buy: 1, Sell: 2}}
+  fields:
+    - {name: side, type: Side}
+    - {name: price, type: int64, options.type: fixed3}
+    - {name: dprice, type: int32, options.type: fixed2}
+    - {name: ts, type: int64, options.type: time_point, options.resolution: ns}
+    - {name: missing, type: int32}
+    - {name: d, type: double}
+    - {name: dec, type: decimal128}
+    - {name: s, type: string}
+    - {name: ilist, type: '*int32'}
+    - {name: sides, type: '*Side'}
+    - {name: arr, type: 'int16[4]'}
+    - {name: inner, type: Inner}
+    - {name: empty, type: Inner}
+    - {name: inners, type: '*Inner'}
+    - {name: tag, type: byte4}
+    - {name: name, type: byte8, options.type: string}
+)";
+	tll::scheme::ConstSchemePtr scheme(tll::Scheme::load(scheme_view));
+	tll::bson::util::Settings settings;
+	settings.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!scheme || !codec.init(scheme.get(), settings)) {
+		fmt::print("View check: failed to init codec\n");
+		return false;
+	}
+
+	bson_t doc = BSON_INITIALIZER, child, item;
+	bson_decimal128_t price, dec;
+	bson_decimal128_from_string("123.456", &price);
+	bson_decimal128_from_string("-1.5E+10", &dec);
+	bson_append_utf8(&doc, "_tll_name", -1, "Data", -1);
+	bson_append_utf8(&doc, "side", -1, "Sell", -1);
+	bson_append_decimal128(&doc, "price", -1, &price);
+	bson_append_double(&doc, "dprice", -1, 10.25);
+	bson_append_date_time(&doc, "ts", -1, 1700000000123);
+	bson_append_int32(&doc, "ts_ns", -1, 456789);
+	bson_append_int32(&doc, "d", -1, 7);
+	bson_append_decimal128(&doc, "dec", -1, &dec);
+	bson_append_utf8(&doc, "s", -1, "string", -1);
+	bson_append_array_begin(&doc, "ilist", -1, &child);
+	bson_append_int32(&child, "0", -1, 1);
+	bson_append_int64(&child, "1", -1, -2);
+	bson_append_array_end(&doc, &child);
+	bson_append_array_begin(&doc, "sides", -1, &child);
+	bson_append_utf8(&child, "0", -1, "Buy", -1);
+	bson_append_int32(&child, "1", -1, 2);
+	bson_append_array_end(&doc, &child);
+	bson_append_array_begin(&doc, "arr", -1, &child);
+	bson_append_int32(&child, "0", -1, 10);
+	bson_append_int32(&child, "1", -1, 20);
+	bson_append_int32(&child, "2", -1, 30);
+	bson_append_array_end(&doc, &child);
+	bson_append_document_begin(&doc, "inner", -1, &child);
+	bson_append_int32(&child, "a", -1, 100);
+	bson_append_utf8(&child, "s", -1, "inner", -1);
+	bson_append_document_end(&doc, &child);
+	bson_append_array_begin(&doc, "inners", -1, &child);
+	for (auto i = 0; i < 2; i++) {
+		bson_append_document_begin(&child, i ? "1" : "0", -1, &item);
+		bson_append_int32(&item, "a", -1, i + 1);
+		bson_append_document_end(&child, &item);
+	}
+	bson_append_array_end(&doc, &child);
+
+	auto data = bson_get_data(&doc);
+	auto size = doc.len;
+	bool result = [&]() {
+		auto dsize = codec.decoded_size(data, size);
+		if (!dsize) {
+			fmt::print("View check: full decode failed\n");
+			return false;
+		}
+		std::vector<char> decoded(*dsize);
+		if (codec.decode(data, size, decoded.data(), decoded.size()) != dsize) {
+			fmt::print("View check: full decode failed\n");
+			return false;
+		}
+
+		tll::bson::view::Document view;
+		auto m = view.init(settings, *codec.info(), data, size);
+		if (!m) {
+			fmt::print("View check: failed to init view: {}\n", view.error());
+			return false;
+		}
+		auto message = m->message();
+		if (!check_view_message(*m, message, tll::make_view(decoded))) {
+			fmt::print("View check: last error: {}\n", view.error());
+			return false;
+		}
+		if (m->has(m->lookup("missing")) || m->has(m->lookup("empty")) || !m->has(m->lookup("ts"))) {
+			fmt::print("View check: invalid key presence\n");
+			return false;
+		}
+		// Values that are compared only with full decode above could be equally wrong in both
+		if (m->get<int8_t>("side") != 2 || m->get<int64_t>("price") != 123456 || m->get<int32_t>("dprice") != 1025 ||
+				m->get<int64_t>("ts") != 1700000000123456789ll || m->get<double>("d") != 7.) {
+			fmt::print("View check: unexpected scalar value\n");
+			return false;
+		}
+		return true;
+	}();
+	bson_destroy(&doc);
+	if (!result)
+		return false;
+
+	// String values that are rejected by full decode are rejected by view too
+	const std::pair<std::string_view, std::string_view> invalid[] = {
+		{"tag", "long binary"},
+		{"name", "binary for string"},
+		{"name", "too long string"},
+	};
+	for (auto & [key, value] : invalid) {
+		bson_init(&doc);
+		bson_append_utf8(&doc, "_tll_name", -1, "Data", -1);
+		if (value.substr(0, 4) == "too ")
+			bson_append_utf8(&doc, key.data(), key.size(), value.data(), value.size());
+		else
+			bson_append_binary(&doc, key.data(), key.size(), BSON_SUBTYPE_BINARY, (const uint8_t *) value.data(), value.size());
+		std::vector<char> decoded(4096);
+		const bool decoded_ok = codec.decode(bson_get_data(&doc), doc.len, decoded.data(), decoded.size()).has_value();
+		tll::bson::view::Document view;
+		auto m = view.init(settings, *codec.info(), bson_get_data(&doc), doc.len);
+		const bool view_ok = m && m->get_string(key).has_value();
+		bson_destroy(&doc);
+		if (decoded_ok || view_ok) {
+			fmt::print("View check: invalid {} value '{}' accepted: decode {}, view {}\n", key, value, decoded_ok, view_ok);
+			return false;
+		}
+	}
+	return true;
+}
+
+/// Reference JSON string escaping, byte by byte
+std::string json_escape(std::string_view s)
+{
+	std::string r = "\"";
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\')
+			r += fmt::format("\\{}", (char) c);
+		else if (c == '\n')
+			r += "\\n";
+		else if (c == '\t')
+			r += "\\t";
+		else if (c < 0x20)
+			r += fmt::format("\\u{:04x}", c);
+		else
+			r += (char) c;
+	}
+	return r + "\"";
+}
+
+/// Check Extended JSON output: escaping, canonical and relaxed numbers and dates, binary values and scheme hints
+bool check_json()
+{
+	tll::bson::json::Transcoder json;
+	auto check = [&json](std::string_view name, const bson_t * doc, std::string_view expected, const tll::bson::util::Settings &settings = tll::bson::util::Settings::defaults(), const tll::bson::SchemeInfo * info = nullptr) {
+		auto r = json.transcode(settings, info, bson_get_data(doc), doc->len);
+		if (!r) {
+			fmt::print("JSON check: {}: transcode failed: {}\n", name, json.error());
+			return false;
+		}
+		if (*r != expected) {
+			fmt::print("JSON check: {}: got {}, expected {}\n", name, *r, expected);
+			return false;
+		}
+		return true;
+	};
+
+	// Special byte at each position around 8 byte blocks of SWAR scan
+	for (auto c : std::string_view("\"\\\x01\n\t\x1f\x7f\x80\xff", 9)) {
+		for (auto pos = 0u; pos < 18; pos++) {
+			std::string str = std::string(pos, 'a') + c + std::string(17 - pos, ' ');
+			bson_t doc = BSON_INITIALIZER;
+			bson_append_utf8(&doc, "s", -1, str.data(), str.size());
+			auto r = check(fmt::format("escape 0x{:02x} at {}", (unsigned char) c, pos), &doc, fmt::format("{{\"s\":{}}}", json_escape(str)));
+			bson_destroy(&doc);
+			if (!r)
+				return false;
+		}
+	}
+
+	bson_t doc = BSON_INITIALIZER;
+	bson_append_int32(&doc, "i", -1, 5);
+	bson_append_int64(&doc, "l", -1, -7);
+	bson_append_double(&doc, "d", -1, 1.5);
+	bson_append_double(&doc, "w", -1, 2);
+	bson_append_double(&doc, "n", -1, std::numeric_limits<double>::quiet_NaN());
+	bson_append_double(&doc, "p", -1, std::numeric_limits<double>::infinity());
+	bson_append_double(&doc, "m", -1, -std::numeric_limits<double>::infinity());
+	bson_append_double(&doc, "z", -1, -0.);
+	bson_append_date_time(&doc, "t", -1, 1700000000123);
+	bson_append_date_time(&doc, "t0", -1, -1);
+	bson_append_date_time(&doc, "t1", -1, 253402300800000);
+	static constexpr std::string_view special = R"("n":{"$numberDouble":"NaN"},"p":{"$numberDouble":"Infinity"},"m":{"$numberDouble":"-Infinity"},"z":{"$numberDouble":"-0.0"})";
+	static constexpr std::string_view outside = R"("t0":{"$date":{"$numberLong":"-1"}},"t1":{"$date":{"$numberLong":"253402300800000"}})";
+	bool r = check("relaxed numbers", &doc, fmt::format(R"({{"i":5,"l":-7,"d":1.5,"w":2.0,{},"t":{{"$date":"2023-11-14T22:13:20.123Z"}},{}}})", special, outside));
+	json.mode = tll::bson::json::Transcoder::Mode::Canonical;
+	r = r && check("canonical numbers", &doc, fmt::format(R"({{"i":{{"$numberInt":"5"}},"l":{{"$numberLong":"-7"}},"d":{{"$numberDouble":"1.5"}},"w":{{"$numberDouble":"2.0"}},{},"t":{{"$date":{{"$numberLong":"1700000000123"}}}},{}}})", special, outside));
+	json.mode = tll::bson::json::Transcoder::Mode::Relaxed;
+	bson_destroy(&doc);
+	if (!r)
+		return false;
+
+	bson_oid_t oid;
+	bson_oid_init_from_string(&oid, "0123456789abcdef01234567");
+	bson_init(&doc);
+	bson_append_binary(&doc, "b", -1, BSON_SUBTYPE_BINARY, (const uint8_t *) "\x00\x01\x02\xff", 4);
+	bson_append_binary(&doc, "u", -1, BSON_SUBTYPE_USER, (const uint8_t *) "hello", 5);
+	bson_append_binary(&doc, "t", -1, BSON_SUBTYPE_BINARY, (const uint8_t *) "abc", 3);
+	bson_append_binary(&doc, "e", -1, BSON_SUBTYPE_BINARY, (const uint8_t *) "", 0);
+	bson_append_oid(&doc, "o", -1, &oid);
+	r = check("binary", &doc, R"({"b":{"$binary":{"base64":"AAEC/w==","subType":"00"}},"u":{"$binary":{"base64":"aGVsbG8=","subType":"80"}},)"
+		R"("t":{"$binary":{"base64":"YWJj","subType":"00"}},"e":{"$binary":{"base64":"","subType":"00"}},"o":{"$oid":"0123456789abcdef01234567"}})");
+	bson_destroy(&doc);
+	if (!r)
+		return false;
+
+	// Nesting is limited by default, recursion depth is bounded for hostile documents
+	{
+		std::vector<bson_t> levels(tll::bson::json::Transcoder::default_depth + 2);
+		bson_init(&levels[0]);
+		for (auto i = 1u; i < levels.size(); i++)
+			bson_append_document_begin(&levels[i - 1], "x", -1, &levels[i]);
+		for (auto i = levels.size() - 1; i > 0; i--)
+			bson_append_document_end(&levels[i - 1], &levels[i]);
+		auto deep = json.transcode(bson_get_data(&levels[0]), levels[0].len);
+		json.limits.depth = 0;
+		auto unlimited = json.transcode(bson_get_data(&levels[0]), levels[0].len);
+		json.limits.depth = tll::bson::json::Transcoder::default_depth;
+		bson_destroy(&levels[0]);
+		if (deep || !unlimited) {
+			fmt::print("JSON check: depth limit is not applied by default\n");
+			return false;
+		}
+	}
+
+	static constexpr std::string_view scheme_hints = R"(yamls://
+- name: Data
+  id: 10
+  enums:
+    Side: {type: int8, enum: {Buy: 1, Sell: 2}}
+  fields:
+    - {name: side, type: Side}
+    - {name: other, type: Side}
+    - {name: price, type: int64, options.type: fixed3}
+    - {name: negative, type: int32, options.type: fixed2}
+    - {name: dprice, type: int64, options.type: fixed2}
+    - {name: ts, type: int64, options.type: time_point, options.resolution: ms}
+)";
+	tll::scheme::ConstSchemePtr scheme(tll::Scheme::load(scheme_hints));
+	tll::bson::util::Settings settings;
+	settings.type_key = "_tll_name";
+	tll::bson::Codec codec;
+	if (!scheme || !codec.init(scheme.get(), settings)) {
+		fmt::print("JSON check: failed to init codec\n");
+		return false;
+	}
+	bson_decimal128_t dec;
+	bson_decimal128_from_string("12.5", &dec);
+	bson_init(&doc);
+	bson_append_utf8(&doc, "_tll_name", -1, "Data", -1);
+	bson_append_int32(&doc, "side", -1, 2);
+	bson_append_int32(&doc, "other", -1, 7);
+	bson_append_int64(&doc, "price", -1, 123456);
+	bson_append_int32(&doc, "negative", -1, -5);
+	bson_append_decimal128(&doc, "dprice", -1, &dec);
+	bson_append_int64(&doc, "ts", -1, 1700000000123);
+	bson_append_int32(&doc, "unknown", -1, 2);
+	r = check("hints", &doc, R"({"_tll_name":"Data","side":"Sell","other":7,"price":123.456,"negative":-0.05,"dprice":12.50,)"
+		R"("ts":{"$date":"2023-11-14T22:13:20.123Z"},"unknown":2})", settings, codec.info());
+	json.mode = tll::bson::json::Transcoder::Mode::Canonical;
+	r = r && check("canonical ignores hints", &doc, R"({"_tll_name":"Data","side":{"$numberInt":"2"},"other":{"$numberInt":"7"},"price":{"$numberLong":"123456"},)"
+		R"("negative":{"$numberInt":"-5"},"dprice":{"$numberDecimal":"12.5"},"ts":{"$numberLong":"1700000000123"},"unknown":{"$numberInt":"2"}})", settings, codec.info());
+	bson_destroy(&doc);
+	return r;
+}
+
+void bench(tll::channel::Context &ctx, std::string_view proto, std::string_view encoder = "", std::string_view suffix = "", const Params &params = {})
 {
 	std::vector<char> buf;
 	tll_msg_t msg = {};
@@ -76,6 +902,8 @@ void bench(tll::channel::Context &ctx, std::string_view proto, std::string_view
 		else
 			name = "   " + name;
 	}
+	if (suffix.size())
+		name = fmt::format("{} {}", name, suffix);
 
 	tll::Channel::Url url;
 	url.proto(proto);
@@ -83,6 +911,8 @@ void bench(tll::channel::Context &ctx, std::string_view proto, std::string_view
 	url.set("name", "codec");
 	if (encoder.size())
 		url.set("encoder", encoder);
+	for (auto & [k, v] : params)
+		url.set(k, v);
 
 	auto c = ctx.channel(url);
 	if (!c)
@@ -95,13 +925,15 @@ void bench(tll::channel::Context &ctx, std::string_view proto, std::string_view
 	tll::bench::timeit(count, name, tll_channel_post, c.get(), &msg, 0);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
 	tll::Logger::set("tll", tll::Logger::Warning, true);
 
 	tll::Config ctxcfg;
 	auto ctx = tll::channel::Context(ctxcfg);
 	ctx.reg(&Echo::impl);
+	ctx.reg(&Ring::impl);
+	tll::bson::inplace::reg(&Ring::impl, [](tll_channel_t * c) -> tll::bson::inplace::Writer * { return static_cast<Ring *>(c->data); });
 
 	auto m = tll_channel_module();
 	if (m->init)
@@ -111,6 +943,29 @@ int main()
 			ctx.reg(*i);
 	}
 
+	{
+		tll::scheme::ConstSchemePtr scheme(tll::Scheme::load(scheme_string));
+		std::vector<char> buf;
+		tll_msg_t msg = {};
+		fill_simple(msg, buf);
+		report_size("Full", scheme.get(), msg);
+		fill_sparse(msg, buf);
+		report_size("Sparse", scheme.get(), msg);
+	}
+
+	if (argc > 1) {
+		bench::GeneratorSettings settings;
+		auto filter = parse_generator(argc, argv, settings);
+		if (!filter)
+			return 1;
+		tll::bench::prewarm(100ms);
+		bench_generated(ctx, argv[1], settings, *filter);
+		return 0;
+	}
+
+	if (!check_inplace(ctx) || !check_view() || !check_json())
+		return 1;
+
 	tll::bench::prewarm(100ms);
 	bench(ctx, "null");
 	bench(ctx, "echo");
@@ -120,4 +975,43 @@ int main()
 	bench(ctx, "bson+echo", "libbson");
 	bench(ctx, "bson+echo", "cppbson");
 	bench(ctx, "json+echo");
+
+	bench(ctx, "bson+ring", "cppbson", "inplace");
+	bench(ctx, "bson+ring", "cppbson", "copy", {{"inplace", "no"}});
+
+	const Params opmsg = {{"framing", "op-msg"}, {"op-msg.collection", "bench"}};
+	bench(ctx, "bson+null", "libbson", "op-msg", opmsg);
+	bench(ctx, "bson+null", "cppbson", "op-msg", opmsg);
+
+	const Params columnar = {{"columnar", "yes"}};
+	bench(ctx, "bson+null", "cppbson", "columnar", columnar);
+
+	const Params sparse = {{"sparse", "yes"}};
+	bench(ctx, "bson+null", "libbson", "sparse", sparse);
+	bench(ctx, "bson+null", "cppbson", "sparse", sparse);
+
+	{
+		tll::scheme::ConstSchemePtr scheme(tll::Scheme::load(scheme_string));
+		bench_api(scheme.get());
+		bench_view(scheme.get());
+		bench_json(ctx, scheme.get());
+	}
+
+	{
+		tll::scheme::ConstSchemePtr scheme(tll::Scheme::load(scheme_string));
+		auto message = scheme->lookup(20);
+		tll::bson::util::Limits limits;
+		limits.array = 1000;
+		limits.bytes = 1024 * 1024;
+		limits.unknown = 100;
+		const std::pair<std::string_view, std::vector<uint8_t>> hostile[] = {
+			{"unknown keys", hostile_unknown(100000)},
+			{"huge list", hostile_list(100000)},
+			{"long string", hostile_string(8 * 1024 * 1024)},
+		};
+		for (auto & [name, data] : hostile) {
+			bench_decode(fmt::format("decode {}", name), message, data, {});
+			bench_decode(fmt::format("decode {} limited", name), message, data, limits);
+		}
+	}
 }
@@ -5,58 +5,314 @@
 
 #include <tll/scheme/util.h>
 #include <tll/util/memoryview.h>
+#include <tll/util/size.h>
+#include <tll/util/time.h>
 
 #include <bson/bson.h>
 
 #include "tll/bson/util.h"
+#include "tll/bson/delta.h"
 #include "tll/bson/libbson.h"
 #include "tll/bson/encoder.h"
+#include "tll/bson/filter.h"
+#include "tll/bson/info.h"
+#include "tll/bson/inplace.h"
+#include "tll/bson/opmsg.h"
+#include "tll/bson/pool.h"
+#include "tll/bson/route.h"
+#include "tll/bson/stream.h"
 
 using namespace tll::bson;
 
 constexpr auto format_as(bson_type_t v) noexcept { return static_cast<int>(v); }
 
+/**
+ * Encoder and decoder of single documents
+ *
+ * Channel uses one instance inline and each offload worker owns another one, instances share only
+ * settings and bound scheme. Settings are not changed while channel is active, bound scheme is
+ * replaced on scheme reload with rebind().
+ */
+struct Document
+{
+	enum class Encoder { Lib, CPP, Auto };
+	/// Decode error classes, counted separately
+	using Reason = libbson::Decoder::Reason;
+
+	const util::Settings * settings = &util::Settings::defaults();
+	const SchemeInfo * info = nullptr;
+	/// Routing fields of bound scheme, replaced together with it
+	const Route * route = nullptr;
+	Encoder encoder = Encoder::Lib;
+
+	/// Per message timing of both encoders for encoder=auto
+	struct AutoStat
+	{
+		const tll::scheme::Message * message = nullptr;
+		/// Pinned encoder, Auto while measuring
+		Encoder choice = Encoder::Auto;
+		unsigned count = 0;
+		/// Total encode time of libbson and cppbson encoders
+		std::array<long long, 2> ns = {};
+		/// Number of messages encoded with pinned encoder
+		size_t pinned = 0;
+	};
+
+	/// Number of timed encodes with each encoder before pinning the faster one
+	unsigned auto_samples = 64;
+	/// Repeat measurement after this number of messages, 0 keeps choice forever
+	size_t auto_period = 0;
+	/// Indexed by MessageInfo::number, sized on first use
+	std::vector<AutoStat> auto_stat;
+	/// Set when encoder choice is made, cleared by the owner after reporting it
+	const AutoStat * auto_pinned = nullptr;
+
+	cppbson::Encoder enc_cpp;
+	libbson::Encoder enc_lib;
+	libbson::Decoder dec;
+	bson_t bson = BSON_INITIALIZER;
+	bson_iter_t iter;
+	std::vector<char> buffer;
+
+	/// Last error, either own or error of encoder or decoder
+	ErrorStack error;
+	const ErrorStack * error_source = &error;
+	Reason reason = Reason::Invalid;
+
+	Document() = default;
+	Document(const Document &) = delete;
+	Document & operator = (const Document &) = delete;
+	~Document() { bson_destroy(&bson); }
+
+	/// Initialize selected encoders
+	void init()
+	{
+		if (encoder != Encoder::CPP)
+			enc_lib.init();
+		if (encoder != Encoder::Lib)
+			enc_cpp.init();
+	}
+
+	/// Switch to new bound scheme, drop state that refers to old one
+	void rebind(const SchemeInfo * i)
+	{
+		info = i;
+		auto_stat.clear();
+		auto_pinned = nullptr;
+	}
+
+	/// Encode message, fill routing metadata of ``out`` if it is not nullptr
+	std::optional<tll::const_memory> encode(const tll_msg_t *msg, tll_msg_t * out = nullptr);
+	std::optional<tll::const_memory> encode(Encoder e, const tll::scheme::Message * message, const tll_msg_t *msg);
+	std::optional<tll::const_memory> encode_auto(const tll::scheme::Message * message, const tll_msg_t *msg);
+	std::optional<tll::const_memory> decode(const tll_msg_t *msg, tll_msg_t * out);
+
+	/// Encode with cppbson encoder into resizable view, return document size
+	template <typename View>
+	std::optional<size_t> encode_into(const tll_msg_t *msg, View view, tll_msg_t * out)
+	{
+		auto message = info->lookup(msg->msgid);
+		if (!message)
+			return fail(Reason::Unknown, "Message {} not found", msg->msgid);
+		enc_cpp.error_clear();
+		if (auto r = enc_cpp.encode(*settings, message, msg, view); r) {
+			if (route)
+				route->apply(message, tll::make_view(*msg), out);
+			return r;
+		}
+		return fail_encoder(enc_cpp);
+	}
+
+	template <typename... Args>
+	std::nullopt_t fail(Reason r, ErrorStack::format_string<Args...> format, Args && ... args)
+	{
+		reason = r;
+		error_source = &error;
+		return error.fail(std::nullopt, format, std::forward<Args>(args)...);
+	}
+
+	/// Record error of the decoder
+	std::nullopt_t fail_decoder()
+	{
+		reason = dec.limit_exceeded ? Reason::Limit : Reason::Decode;
+		error_source = &dec;
+		return std::nullopt;
+	}
+
+	/// Record error of one of encoders
+	std::nullopt_t fail_encoder(const ErrorStack &enc)
+	{
+		reason = Reason::Invalid;
+		error_source = &enc;
+		return std::nullopt;
+	}
+};
+
+/// Error message with location, if there is any
+static std::string format_error(const ErrorStack &e)
+{
+	if (e.error_stack.empty())
+		return e.error();
+	return fmt::format("at {}: {}", e.format_stack(), e.error());
+}
+
 class BSON : public tll::channel::Codec<BSON>
 {
 	using Base = tll::channel::Codec<BSON>;
 
 	util::Settings _settings;
+	std::shared_ptr<const SchemeInfo> _info;
+	/// Fields for msg->addr and msg->time, compiled for current scheme
+	std::shared_ptr<const Route> _route;
+
+	using Encoder = Document::Encoder;
+	using Reason = Document::Reason;
+	using Delta = util::Settings::Delta;
+	enum class Framing { None, OpMsg } _framing = Framing::None;
+
+	Document _doc;
 
-	enum class Encoder { Lib, CPP } _enc_type = Encoder::Lib;
+	opmsg::Batch _batch;
+	size_t _batch_count = 0;
+	size_t _batch_bytes = 0;
+	long long _batch_seq = 0;
+	tll::duration _batch_linger = {};
+	tll::time_point _batch_start = {};
 
-	bson_t _bson_dec = BSON_INITIALIZER;
-	cppbson::Encoder _enc_cpp;
-	libbson::Encoder _enc_lib;
-	libbson::Decoder _dec;
-	bson_iter_t _bson_iter;
+	bool _columnar = false;
+	size_t _columnar_count = 0;
+	tll::duration _columnar_linger = {};
+	tll::time_point _columnar_start = {};
+	const tll::scheme::Message * _columnar_message = nullptr;
+	std::vector<char> _columnar_data;
+	std::vector<size_t> _columnar_offsets;
+	std::vector<tll_msg_t> _columnar_rows;
+	std::vector<std::vector<char>> _columnar_dec;
+	std::vector<long long> _columnar_seq;
+
+	bool _stream = false;
+	libbson::StreamDecoder _stream_dec;
+
+	/// Change-only encoding state of posted and received messages
+	delta::State _delta_enc;
+	delta::State _delta_dec;
+	/// Send full message after this number of deltas, 0 disables periodic snapshots
+	unsigned _delta_snapshot = 0;
+	std::vector<char> _delta_buf;
+	std::vector<char> _delta_msg;
+	long long _delta_snapshots = 0;
+	long long _delta_updates = 0;
+
+	/// Predicate checked on received documents before decode
+	filter::Filter _filter;
+	long long _filter_dropped = 0;
+
+	enum class OnError { Fail, Drop, Log } _on_error = OnError::Fail;
+	static constexpr std::string_view _reason_names[] = { "invalid", "unknown", "decode", "limit" };
+	std::array<long long, std::size(_reason_names)> _error_count = {};
+	tll::duration _error_interval = {};
+	tll::time_point _error_last = {};
+	size_t _error_suppressed = 0;
+
+	/// Offloaded encode or decode job
+	struct Job
+	{
+		bool encode = false;
+		/// Bound scheme and its routing fields at submit time, kept alive until job is collected
+		const SchemeInfo * info = nullptr;
+		const Route * route = nullptr;
+		tll_msg_t msg = {};
+		/// Copy of posted or received data, caller memory is not valid after post or callback returns
+		std::vector<char> input;
+		/// Result, size is in msg.size. Swapped with buffer of decoder or cppbson encoder, libbson result is copied
+		std::vector<char> output;
+		bool ok = false;
+		Reason reason = Reason::Invalid;
+		ErrorStack error;
+		/// Encoder choice made by worker on this job, reported when job is collected
+		std::optional<Document::AutoStat> pinned;
+	};
+
+	/// Offload worker with its own encoders and decoder
+	struct Worker
+	{
+		Document doc;
+
+		void operator () (Job &job);
+	};
+
+	unsigned _workers = 0;
+	size_t _workers_depth = 0;
+	WorkerPool<Job, Worker> _pool;
+	bool _collecting = false;
+	/// Channel was closed from callback of collected job, pool is already stopped
+	bool _collect_closed = false;
+
+	/// Child writer for in-place encoding, only for cppbson encoder
+	bool _inplace_enable = true;
+	size_t _inplace_size = 0;
+	inplace::Writer * _inplace = nullptr;
+	std::vector<char> _inplace_spill;
+	/// Number of documents that did not fit into reserved memory
+	long long _inplace_fallback = 0;
+
+	/// Scheme reload, new scheme is bound in background thread and published with release store
+	std::thread _reload_thread;
+	std::atomic<bool> _reload_ready = false;
+	tll::scheme::ConstSchemePtr _reload_scheme;
+	std::shared_ptr<const SchemeInfo> _reload_info;
+	std::string _reload_error;
+	long long _reload_count = 0;
+	/// Replaced bound scheme still used by offloaded jobs
+	struct Retired
+	{
+		/// Number of jobs submitted before replace
+		size_t submitted = 0;
+		std::shared_ptr<const SchemeInfo> info;
+		std::shared_ptr<const Route> route;
+	};
+	std::vector<Retired> _retired;
+
+	bool _pending = false;
 
  public:
 	static constexpr std::string_view channel_protocol() { return "bson+"; }
 
-	int _init(const tll::Channel::Url &, tll::Channel *parent);
-
-	void _free()
+	static constexpr std::string_view scheme_control_string()
 	{
-		bson_destroy(&_bson_dec);
+		return R"(yamls://
+- name: SchemeReload
+  id: 10
+  fields:
+    - {name: url, type: string}
+- name: SchemeChanged
+  id: 11
+  fields: []
+)";
 	}
 
+	int _init(const tll::Channel::Url &, tll::Channel *parent);
+
 	const tll_msg_t * _encode(const tll_msg_t *msg)
 	{
 		tll_msg_copy_info(&_msg_enc, msg);
-		auto r = _bson_encode(msg, &_msg_enc);
+		auto r = _doc.encode(msg, &_msg_enc);
+		if (_doc.auto_pinned)
+			_auto_report();
 		if (!r)
-			return _log.fail(nullptr, "Failed to encode BSON");
+			return _log.fail(nullptr, "Failed to encode BSON message {}: {}", msg->msgid, format_error(*_doc.error_source));
 		_msg_enc.data = r->data;
 		_msg_enc.size = r->size;
 		return &_msg_enc;
 	}
 
+	/// Decode message, error is stored and reported by _decode_error
 	const tll_msg_t * _decode(const tll_msg_t *msg)
 	{
 		tll_msg_copy_info(&_msg_dec, msg);
-		auto r = _bson_decode(msg, &_msg_dec);
+		auto r = _doc.decode(msg, &_msg_dec);
 		if (!r)
-			return _log.fail(nullptr, "Failed to decode BSON");
+			return nullptr;
 		_msg_dec.data = r->data;
 		_msg_dec.size = r->size;
 		return &_msg_dec;
@@ -66,33 +322,306 @@ class BSON : public tll::channel::Codec<BSON>
 	{
 		if (_init_scheme(_child->scheme()))
 			return _log.fail(EINVAL, "Failed to initialize scheme");
+		_batch.reset();
+		_columnar_rows.clear();
+		_stream_dec.init(&_settings, _info.get());
+		_inplace = nullptr;
+		if (_inplace_enable && _doc.encoder == Encoder::CPP && !_workers && !_columnar && _framing == Framing::None && _settings.delta == Delta::None) {
+			_inplace = inplace::lookup(_child->c());
+			if (_inplace)
+				_log.debug("Child supports in-place writes, encode directly into its memory");
+		}
+		if (_workers) {
+			_pool.start(_workers, _workers_depth, [this](Worker &w, unsigned) {
+				w.doc.settings = &_settings;
+				w.doc.info = _info.get();
+				w.doc.route = _route.get();
+				w.doc.encoder = _doc.encoder;
+				w.doc.auto_samples = _doc.auto_samples;
+				w.doc.auto_period = _doc.auto_period;
+				w.doc.dec.limits = _doc.dec.limits;
+				w.doc.init();
+			});
+		}
 		return Base::_on_active();
 	}
 
+	int _close(bool force)
+	{
+		if (!force) {
+			if (_collecting) {
+				// Closed from callback of collected job, it is owned by outer collect loop that
+				// stops after callback returns, remaining jobs are delivered here
+				_collect_closed = true;
+				for (size_t i = 1; auto job = _pool.wait(i); i++)
+					(void) _offload_deliver(job);
+			} else {
+				while (_pool.wait())
+					(void) _offload_collect();
+			}
+			_columnar_flush();
+			_batch_flush();
+		}
+		_pool.stop();
+		_retired.clear();
+		_delta_enc.clear();
+		_delta_dec.clear();
+		if (_reload_thread.joinable())
+			_reload_thread.join();
+		_reload_ready = false;
+		_reload_info.reset();
+		_reload_scheme.reset();
+		_batch.reset();
+		_columnar_rows.clear();
+		_pending_update();
+		return Base::_close(force);
+	}
+
+	int _post(const tll_msg_t *msg, int flags)
+	{
+		if (msg->type != TLL_MESSAGE_DATA) {
+			if (msg->type == TLL_MESSAGE_CONTROL && _reload_message(msg))
+				return _reload(msg);
+			return Base::_post(msg, flags);
+		}
+		if (_columnar)
+			return _post_columnar(msg, flags);
+		if (_framing == Framing::OpMsg)
+			return _post_batch(msg, flags);
+		if (_workers)
+			return _offload(msg, true);
+		if (_settings.delta != Delta::None)
+			return _post_delta(msg, flags);
+		if (_inplace)
+			return _post_inplace(msg, flags);
+		return Base::_post(msg, flags);
+	}
+
+	int _on_data(const tll_msg_t *msg)
+	{
+		if (_framing == Framing::OpMsg)
+			return _on_reply(msg);
+		if (_columnar)
+			return _on_columnar(msg);
+		if (_stream)
+			return _on_stream(msg);
+		if (!_filter.empty() && !_filter.match(_settings, msg->data, msg->size)) {
+			_filter_dropped++;
+			return 0;
+		}
+		if (_workers)
+			return _offload(msg, false);
+		if (_settings.delta != Delta::None)
+			return _on_delta(msg);
+		return _on_document(msg);
+	}
+
+	int _on_document(const tll_msg_t *msg)
+	{
+		auto m = _decode(msg);
+		if (!m)
+			return _decode_error();
+		_callback_data(m);
+		return 0;
+	}
+
+	int _process(long timeout, int flags);
+
 	int _init_scheme(const tll::scheme::Scheme *s);
-	std::optional<tll::const_memory> _bson_encode(const tll_msg_t *msg, tll_msg_t * out);
-	std::optional<tll::const_memory> _bson_decode(const tll_msg_t *msg, tll_msg_t * out);
+	int _post_batch(const tll_msg_t *msg, int flags);
+	int _post_document(const tll::const_memory &data, int msgid, long long seq);
+	int _batch_append(const tll::const_memory &data, long long seq);
+	int _batch_flush();
+	int _on_reply(const tll_msg_t *msg);
+
+	int _post_columnar(const tll_msg_t *msg, int flags);
+	int _columnar_flush();
+	int _on_columnar(const tll_msg_t *msg);
 
-	const tll::scheme::Message * _bson_decode_meta(bson_iter_t *iter, tll_msg_t * out);
+	int _on_stream(const tll_msg_t *msg);
+
+	/// Encode only fields changed since previous message with the same key, full snapshot periodically
+	int _post_delta(const tll_msg_t *msg, int flags);
+	/// Decode full message or apply delta onto previous message with the same key
+	int _on_delta(const tll_msg_t *msg);
+
+	/// Encode into memory reserved in child, fall back to regular post if it does not fit
+	int _post_inplace(const tll_msg_t *msg, int flags);
+
+	/// Pass message to worker pool, collect finished jobs if all slots are busy
+	int _offload(const tll_msg_t *msg, bool encode);
+	/// Deliver finished jobs in submit order
+	int _offload_collect();
+	int _offload_deliver(Job * job);
+
+	/// Control message is SchemeReload of codec control scheme and is not known to the child
+	bool _reload_message(const tll_msg_t *msg)
+	{
+		auto message = _scheme_control ? _scheme_control->lookup(msg->msgid) : nullptr;
+		if (!message || std::string_view(message->name) != "SchemeReload")
+			return false;
+		auto child = _child->scheme(TLL_MESSAGE_CONTROL);
+		return !child || !child->lookup(msg->msgid);
+	}
+
+	/// Load scheme from SchemeReload control message and start binding it
+	int _reload(const tll_msg_t *msg);
+	/// Switch to reloaded scheme, called from channel thread when it is ready
+	int _reload_apply();
+
+	/// Publish identity of bound scheme, channels sharing it have the same value
+	void _info_report() { config_info().set("scheme.info", fmt::format("{}", fmt::ptr(_info.get()))); }
+
+	/// Log and publish encoder choice made by encoder=auto
+	void _auto_report()
+	{
+		auto stat = _doc.auto_pinned;
+		_doc.auto_pinned = nullptr;
+		_auto_report(*stat);
+	}
+
+	/// Report choice made inline or by offload worker, each worker measures and chooses on its own
+	void _auto_report(const Document::AutoStat &stat)
+	{
+		auto name = stat.choice == Encoder::Lib ? "libbson" : "cppbson";
+		_log.info("Message {}: selected {} encoder, {}ns libbson, {}ns cppbson per message", stat.message->name, name,
+			stat.ns[(size_t) Encoder::Lib] / _doc.auto_samples, stat.ns[(size_t) Encoder::CPP] / _doc.auto_samples);
+		config_info().set(fmt::format("encoder.{}", stat.message->name), name);
+	}
+
+	/// Count last decode error and report it according to error policy
+	int _decode_error(std::nullopt_t = std::nullopt) { return _decode_error(_doc.reason, *_doc.error_source); }
+	int _decode_error(Reason reason, const ErrorStack &error) { return _error_report(reason, error, "decode BSON"); }
+	/// Count error of offloaded encode and report it according to error policy
+	int _encode_error(Reason reason, const ErrorStack &error, int msgid)
+	{
+		return _error_report(reason, error, fmt::format("encode BSON message {}", msgid));
+	}
+	int _error_report(Reason reason, const ErrorStack &error, std::string_view action);
+
+	/// Enable process and pending dcaps while there are unflushed batches
+	void _pending_update()
+	{
+		bool pending = !_batch.empty() || !_columnar_rows.empty() || !_pool.empty() || _reload_thread.joinable();
+		if (pending == _pending)
+			return;
+		_pending = pending;
+		_update_dcaps(pending ? tll::dcaps::Process | tll::dcaps::Pending : 0, tll::dcaps::Process | tll::dcaps::Pending);
+	}
 };
 
 int BSON::_init(const tll::Channel::Url &url, tll::Channel *parent)
 {
 	using Mode = util::Settings::Mode;
+	using Fixed = util::Settings::Fixed;
 
 	auto reader = channel_props_reader(url);
 
-	_enc_type = reader.getT("encoder", Encoder::Lib, {{"libbson", Encoder::Lib}, {"cppbson", Encoder::CPP}});
+	_doc.encoder = reader.getT("encoder", Encoder::Lib, {{"libbson", Encoder::Lib}, {"cppbson", Encoder::CPP}, {"auto", Encoder::Auto}});
+	_doc.auto_samples = reader.getT("encoder.samples", 64u);
+	_doc.auto_period = reader.getT<unsigned>("encoder.period", 0);
 	_settings.type_key = reader.getT<std::string>("type-key", "_tll_name");
 	_settings.seq_key = reader.getT<std::string>("seq-key", "_tll_seq");
+	_settings.id_key = reader.getT<std::string>("id-key", "");
+	auto route = std::make_shared<Route>();
+	route->addr = Route::split(reader.getT<std::string>("addr-key", ""));
+	route->time = Route::split(reader.getT<std::string>("time-key", ""));
+	_route = route;
 	_settings.mode = reader.getT("compose", Mode::Flat, {{"flat", Mode::Flat}, {"nested", Mode::Nested}});
+	_settings.sparse = reader.getT("sparse", false);
+	_settings.enum_string = reader.getT("enum", false, {{"int", false}, {"string", true}});
+	_settings.bits_string = reader.getT("bits", false, {{"int", false}, {"string", true}});
+	_settings.time_datetime = reader.getT("time", false, {{"int", false}, {"datetime", true}});
+	_settings.time_remainder = reader.getT("time.remainder", false);
+	_settings.fixed = reader.getT("fixed", Fixed::Int, {{"int", Fixed::Int}, {"decimal128", Fixed::Decimal128}, {"double", Fixed::Double}});
+	_framing = reader.getT("framing", Framing::None, {{"none", Framing::None}, {"op-msg", Framing::OpMsg}});
+	if (_framing == Framing::OpMsg) {
+		auto collection = reader.getT<std::string>("op-msg.collection");
+		auto db = reader.getT<std::string>("op-msg.db", "test");
+		auto ordered = reader.getT("op-msg.ordered", true);
+		size_t max_size = reader.getT<tll::util::Size>("op-msg.max-message-size", opmsg::max_message_size);
+		_batch_count = reader.getT<unsigned>("op-msg.batch-count", 1000);
+		_batch_bytes = reader.getT<tll::util::Size>("op-msg.batch-bytes", 1024 * 1024);
+		_batch_linger = reader.getT<tll::duration>("op-msg.linger", std::chrono::milliseconds(1));
+		if (reader) {
+			_batch.init("insert", collection, db, ordered, max_size);
+			if (_batch.overhead() + 5 > max_size)
+				return _log.fail(EINVAL, "Max message size {} is too small, frame overhead is {}", max_size, _batch.overhead());
+		}
+	}
+	_columnar = reader.getT("columnar", false);
+	if (_columnar) {
+		_columnar_count = reader.getT<unsigned>("columnar.count", 1000);
+		_columnar_linger = reader.getT<tll::duration>("columnar.linger", std::chrono::milliseconds(1));
+		_settings.count_key = reader.getT<std::string>("columnar.count-key", "_tll_count");
+		if (_columnar_count == 0)
+			return _log.fail(EINVAL, "Zero columnar.count");
+	}
+	_stream = reader.getT("stream", false);
+	_settings.delta = reader.getT("delta", Delta::None, {{"no", Delta::None}, {"flat", Delta::Flat}, {"set", Delta::Set}});
+	if (_settings.delta != Delta::None) {
+		_settings.delta_key = _settings.delta == Delta::Set ? "$set" : "_tll_delta";
+		_delta_snapshot = reader.getT<unsigned>("delta.snapshot", 100);
+		auto keys = reader.getT<std::string>("delta.key", "");
+		for (size_t pos = 0; pos < keys.size();) {
+			auto end = std::min(keys.find(',', pos), keys.size());
+			if (end > pos)
+				_delta_enc.names.emplace_back(keys.substr(pos, end - pos));
+			pos = end + 1;
+		}
+		_delta_dec.names = _delta_enc.names;
+	}
+	auto filter = reader.getT<std::string>("filter", "");
+	_on_error = reader.getT("on-error", OnError::Fail, {{"fail", OnError::Fail}, {"drop", OnError::Drop}, {"log", OnError::Log}});
+	_error_interval = reader.getT<tll::duration>("on-error.interval", std::chrono::seconds(1));
+	util::Limits limits;
+	limits.depth = reader.getT<unsigned>("limit.depth", 0);
+	limits.array = reader.getT<unsigned>("limit.array", 0);
+	limits.bytes = reader.getT<tll::util::Size>("limit.bytes", 0);
+	limits.unknown = reader.getT<unsigned>("limit.unknown", 0);
+	_inplace_enable = reader.getT("inplace", true);
+	_inplace_size = reader.getT<tll::util::Size>("inplace.size", 4096);
+	_workers = reader.getT("workers", 0u);
+	_workers_depth = reader.getT<unsigned>("workers.depth", 1024);
 	if (!reader)
 		return _log.fail(EINVAL, "Invalid url: {}", reader.error());
 
-	if (_enc_type == Encoder::Lib)
-		_enc_lib.init();
-	else
-		_enc_cpp.init();
+	if (_columnar && _settings.mode != Mode::Flat)
+		return _log.fail(EINVAL, "Columnar batches are supported only in flat compose mode");
+	if (_stream && (_columnar || _framing != Framing::None))
+		return _log.fail(EINVAL, "Stream decoding can not be used with columnar batches or framing");
+	if (_workers && (_stream || _columnar || _framing != Framing::None))
+		return _log.fail(EINVAL, "Worker offload can not be used with stream decoding, columnar batches or framing");
+	if (_settings.delta != Delta::None && (_settings.mode != Mode::Flat || _stream || _columnar || _workers || _framing != Framing::None))
+		return _log.fail(EINVAL, "Delta encoding is supported only in flat compose mode without stream decoding, columnar batches, offload or framing");
+	if (filter.size() && (_stream || _columnar || _framing != Framing::None || _settings.delta != Delta::None))
+		return _log.fail(EINVAL, "Filter can not be used with stream decoding, columnar batches, framing or delta encoding");
+	if (filter.size() && !_filter.parse(filter))
+		return _log.fail(EINVAL, "Invalid filter '{}': {}", filter, _filter.error());
+	if (_workers && _workers_depth < _workers)
+		return _log.fail(EINVAL, "Offload depth {} is less then number of workers {}", _workers_depth, _workers);
+
+	_doc.settings = &_settings;
+	_doc.dec.limits = limits;
+	_stream_dec.limits(limits);
+
+	for (auto i = 0u; i < _error_count.size(); i++)
+		config_info().set_ptr(fmt::format("errors.{}", _reason_names[i]), &_error_count[i]);
+	config_info().set_ptr("inplace.fallback", &_inplace_fallback);
+	config_info().set_ptr("scheme.reloads", &_reload_count);
+	if (!_filter.empty())
+		config_info().set_ptr("filter.dropped", &_filter_dropped);
+	if (_settings.delta != Delta::None) {
+		config_info().set_ptr("delta.snapshots", &_delta_snapshots);
+		config_info().set_ptr("delta.updates", &_delta_updates);
+	}
+
+	if (_doc.encoder == Encoder::Auto && _doc.auto_samples == 0)
+		return _log.fail(EINVAL, "Zero encoder.samples");
+
+	_doc.init();
+	if (_doc.encoder == Encoder::Lib && (_columnar || _settings.delta != Delta::None))
+		_doc.enc_cpp.init();
 
 	return Base::_init(url, parent);
 }
@@ -102,117 +631,849 @@ int BSON::_init_scheme(const tll::scheme::Scheme *s)
 	if (!s)
 		return _log.fail(EINVAL, "BSON codec need scheme");
 	_scheme.reset(tll_scheme_ref(s));
+
+	ErrorStack error;
+	_info = SchemeInfo::shared(s, error);
+	if (!_info)
+		return _log.fail(EINVAL, "Failed to bind scheme at {}: {}", error.format_stack(), error.error());
+	if (_settings.time_datetime && _settings.time_remainder && !_info->check_time_remainder(_columnar, error))
+		return _log.fail(EINVAL, "Invalid scheme for time.remainder: {}", error.error());
+	_info_report();
+	_doc.info = _info.get();
+	auto route = std::make_shared<Route>(*_route);
+	if (!route->compile(*_info))
+		return _log.fail(EINVAL, "Failed to compile routing fields: {}", format_error(*route));
+	_route = route;
+	_doc.route = _route.get();
+	if (!_filter.empty() && !_filter.compile(*_info))
+		return _log.fail(EINVAL, "Failed to compile filter: {}", format_error(_filter));
 	return 0;
 }
 
-std::optional<tll::const_memory> BSON::_bson_encode(const tll_msg_t *msg, tll_msg_t * out)
+std::optional<tll::const_memory> Document::encode(const tll_msg_t *msg, tll_msg_t * out)
 {
-	auto message = _scheme->lookup(msg->msgid);
+	auto message = info->lookup(msg->msgid);
 	if (!message)
-		return _log.fail(std::nullopt, "Message {} not found", msg->msgid);
+		return fail(Reason::Unknown, "Message {} not found", msg->msgid);
+	if (out && route)
+		route->apply(message, tll::make_view(*msg), out);
+	if (encoder == Encoder::Auto)
+		return encode_auto(message, msg);
+	return encode(encoder, message, msg);
+}
 
-	if (_enc_type == Encoder::Lib) {
-		_enc_lib.error_clear();
-		if (auto r = _enc_lib.encode(_settings, message, msg); r)
+std::optional<tll::const_memory> Document::encode(Encoder e, const tll::scheme::Message * message, const tll_msg_t *msg)
+{
+	if (e == Encoder::Lib) {
+		enc_lib.error_clear();
+		if (auto r = enc_lib.encode(*settings, message, msg); r)
 			return r;
-		return _log.fail(std::nullopt, "Failed to encode message {} at {}: {}", message->name, _enc_lib.format_stack(), _enc_lib.error);
+		return fail_encoder(enc_lib);
 	} else {
-		_enc_cpp.error_clear();
-		if (auto r = _enc_cpp.encode(_settings, message, msg); r)
+		enc_cpp.error_clear();
+		if (auto r = enc_cpp.encode(*settings, message, msg); r)
 			return r;
-		return _log.fail(std::nullopt, "Failed to encode message {} at {}: {}", message->name, _enc_cpp.format_stack(), _enc_cpp.error);
+		return fail_encoder(enc_cpp);
 	}
 }
 
-std::optional<tll::const_memory> BSON::_bson_decode(const tll_msg_t *msg, tll_msg_t * out)
+std::optional<tll::const_memory> Document::encode_auto(const tll::scheme::Message * message, const tll_msg_t *msg)
 {
-	if (!bson_init_static(&_bson_dec, (const uint8_t *) msg->data, msg->size))
-		return _log.fail(std::nullopt, "Failed to bind BSON buffer");
-	if (!bson_iter_init(&_bson_iter, &_bson_dec))
-		return _log.fail(std::nullopt, "Failed to bind BSON iterator");
+	if (auto_stat.empty())
+		auto_stat.resize(info->messages_size());
+	auto & stat = auto_stat[tll::bson::info(message)->number];
+	if (stat.choice != Encoder::Auto) {
+		if (!auto_period || ++stat.pinned < auto_period)
+			return encode(stat.choice, message, msg);
+		stat = {};
+	}
+
+	// Alternate encoders so both see similar data and cache state
+	auto e = stat.count % 2 ? Encoder::CPP : Encoder::Lib;
+	auto start = std::chrono::steady_clock::now();
+	auto r = encode(e, message, msg);
+	if (!r)
+		return r;
+	stat.ns[(size_t) e] += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	if (++stat.count == 2 * auto_samples) {
+		stat.message = message;
+		stat.choice = stat.ns[(size_t) Encoder::Lib] <= stat.ns[(size_t) Encoder::CPP] ? Encoder::Lib : Encoder::CPP;
+		auto_pinned = &stat;
+	}
+	return r;
+}
+
+std::optional<tll::const_memory> Document::decode(const tll_msg_t *msg, tll_msg_t * out)
+{
+	auto message = dec.decode_document(*settings, *info, msg->data, msg->size, tll::make_view(buffer), out);
+	if (!message) {
+		reason = dec.reason;
+		error_source = &dec;
+		return std::nullopt;
+	}
+	if (route)
+		route->apply(message, tll::make_view(buffer), out);
+	return tll::const_memory { buffer.data(), buffer.size() };
+}
+
+int BSON::_post_batch(const tll_msg_t *msg, int flags)
+{
+	auto r = _doc.encode(msg);
+	if (_doc.auto_pinned)
+		_auto_report();
+	if (!r)
+		return _log.fail(EINVAL, "Failed to encode BSON message {}: {}", msg->msgid, format_error(*_doc.error_source));
+	return _batch_append(*r, msg->seq);
+}
+
+int BSON::_post_document(const tll::const_memory &data, int msgid, long long seq)
+{
+	if (_framing == Framing::OpMsg)
+		return _batch_append(data, seq);
+
+	tll_msg_t msg = {};
+	msg.type = TLL_MESSAGE_DATA;
+	msg.msgid = msgid;
+	msg.seq = seq;
+	msg.data = data.data;
+	msg.size = data.size;
+	return _child->post(&msg);
+}
+
+int BSON::_batch_append(const tll::const_memory &data, long long seq)
+{
+	if (data.size > opmsg::max_bson_size)
+		return _log.fail(EMSGSIZE, "Document size {} exceeds max BSON size {}", data.size, opmsg::max_bson_size);
+	if (_batch.overhead() + data.size > _batch.max_size)
+		return _log.fail(EMSGSIZE, "Document size {} does not fit into OP_MSG frame of max size {}", data.size, _batch.max_size);
+
+	if (!_batch.fits(data.size)) {
+		if (auto e = _batch_flush(); e)
+			return e;
+	}
+
+	if (_batch.empty())
+		_batch_start = tll::time::now();
+	_batch.append(data.data, data.size);
+	_batch_seq = seq;
+
+	if (_batch.count >= _batch_count || _batch.size() >= _batch_bytes)
+		return _batch_flush();
+	_pending_update();
+	return 0;
+}
+
+int BSON::_batch_flush()
+{
+	if (_batch.empty())
+		return 0;
+
+	auto data = _batch.finish();
+	_log.trace("Post OP_MSG request {}: {} documents, {} bytes", _batch.request_id, _batch.count, data.size);
+
+	tll_msg_t msg = {};
+	msg.type = TLL_MESSAGE_DATA;
+	msg.seq = _batch_seq;
+	msg.data = data.data;
+	msg.size = data.size;
+	auto r = _child->post(&msg);
+	_batch.reset();
+	_pending_update();
+	if (r)
+		return _log.fail(r, "Failed to post OP_MSG frame: {}", r);
+	return 0;
+}
+
+int BSON::_process(long timeout, int flags)
+{
+	if (_reload_ready.load(std::memory_order_acquire)) {
+		if (auto r = _reload_apply(); r)
+			return r;
+	}
+	if (!_pool.empty()) {
+		if (auto r = _offload_collect(); r)
+			return r;
+	}
+	auto now = tll::time::now();
+	if (!_columnar_rows.empty() && now - _columnar_start >= _columnar_linger) {
+		if (auto r = _columnar_flush(); r)
+			return r;
+	}
+	if (!_batch.empty() && now - _batch_start >= _batch_linger) {
+		if (auto r = _batch_flush(); r)
+			return r;
+	}
+	_pending_update();
+	return EAGAIN;
+}
+
+int BSON::_post_columnar(const tll_msg_t *msg, int flags)
+{
+	if (_columnar_rows.size() && _columnar_message->msgid != msg->msgid) {
+		if (auto r = _columnar_flush(); r)
+			return r;
+	}
+
+	if (_columnar_rows.empty()) {
+		_columnar_message = _info->lookup(msg->msgid);
+		if (!_columnar_message)
+			return _log.fail(EINVAL, "Message {} not found", msg->msgid);
+		_columnar_start = tll::time::now();
+		_columnar_data.clear();
+		_columnar_offsets.clear();
+	}
+
+	auto offset = _columnar_data.size();
+	_columnar_data.resize(offset + msg->size);
+	memcpy(_columnar_data.data() + offset, msg->data, msg->size);
+	_columnar_offsets.push_back(offset);
+	_columnar_rows.push_back(*msg);
+
+	if (_columnar_rows.size() >= _columnar_count)
+		return _columnar_flush();
+	_pending_update();
+	return 0;
+}
+
+int BSON::_columnar_flush()
+{
+	if (_columnar_rows.empty())
+		return 0;
+
+	for (auto i = 0u; i < _columnar_rows.size(); i++)
+		_columnar_rows[i].data = _columnar_data.data() + _columnar_offsets[i];
+
+	auto message = _columnar_message;
+	auto seq = _columnar_rows.back().seq;
+	_doc.enc_cpp.error_clear();
+	auto r = _doc.enc_cpp.encode_columnar(_settings, message, _columnar_rows);
+	_columnar_rows.clear();
+	_pending_update();
+	if (!r)
+		return _log.fail(EINVAL, "Failed to encode columnar batch of {} at {}: {}", message->name, _doc.enc_cpp.format_stack(), _doc.enc_cpp.error());
+	return _post_document(*r, message->msgid, seq);
+}
+
+int BSON::_on_columnar(const tll_msg_t *msg)
+{
+	if (!bson_init_static(&_doc.bson, (const uint8_t *) msg->data, msg->size))
+		return _decode_error(_doc.fail(Reason::Invalid, "Failed to bind BSON buffer"));
+	if (!bson_iter_init(&_doc.iter, &_doc.bson))
+		return _decode_error(_doc.fail(Reason::Invalid, "Failed to bind BSON iterator"));
+
 	const tll::scheme::Message * message = nullptr;
-	switch (_settings.mode) {
-	case util::Settings::Mode::Flat: {
-		bool reset = false, seq = _settings.seq_key.empty();
-		while (bson_iter_next(&_bson_iter)) {
-			std::string_view key = { bson_iter_key_unsafe(&_bson_iter), bson_iter_key_len(&_bson_iter) };
-			if (key == _settings.type_key) {
-				if (message)
-					return _log.fail(std::nullopt, "Duplicate key {}", key);
-				if (auto name = _dec.decode_string(&_bson_iter); name) {
-					message = _scheme->lookup(*name);
-					if (!message)
-						return _log.fail(std::nullopt, "Message '{}' not found", *name);
-				} else
-					return _log.fail(std::nullopt, "Non-string type key {}", key);
-				out->msgid = message->msgid;
-				if (seq)
-					break;
-			} else if (_settings.seq_key.size() && key == _settings.seq_key) {
-				if (auto r = _dec.decode_int(&_bson_iter); r)
-					out->seq = *r;
-				else
-					return _log.fail(std::nullopt, "Non-integer seq key {}: {}", key, bson_iter_type(&_bson_iter));
-				seq = true;
-				if (message)
-					break;
+	long long count = -1;
+	bson_iter_t seq = {};
+	bool seq_found = false;
+	bson_iter_t column = {};
+	bool column_found = false;
+	while (bson_iter_next(&_doc.iter)) {
+		std::string_view key = { bson_iter_key_unsafe(&_doc.iter), bson_iter_key_len(&_doc.iter) };
+		if (key == _settings.type_key) {
+			if (auto name = _doc.dec.decode_string(&_doc.iter); name) {
+				message = _info->lookup(*name);
+				if (!message)
+					return _decode_error(_doc.fail(Reason::Unknown, "Message '{}' not found", *name));
 			} else
-				reset = true;
+				return _decode_error(_doc.fail(Reason::Invalid, "Non-string type key {}", key));
+		} else if (key == _settings.count_key) {
+			if (auto r = _doc.dec.decode_int(&_doc.iter); r && *r >= 0)
+				count = *r;
+			else
+				return _decode_error(_doc.fail(Reason::Invalid, "Invalid count key {}", key));
+		} else if (_settings.seq_key.size() && key == _settings.seq_key) {
+			if (bson_iter_type(&_doc.iter) == BSON_TYPE_ARRAY) {
+				seq = _doc.iter;
+				seq_found = true;
+			}
+		} else if (!column_found && bson_iter_type(&_doc.iter) == BSON_TYPE_ARRAY) {
+			column = _doc.iter;
+			column_found = true;
+		}
+	}
+
+	if (count < 0)
+		return _on_document(msg);
+	if (!message)
+		return _decode_error(_doc.fail(Reason::Unknown, "No type key {} in columnar batch", _settings.type_key));
+
+	if (_doc.dec.limits.array && (size_t) count > _doc.dec.limits.array)
+		return _decode_error(_doc.fail(Reason::Limit, "Columnar batch size {} exceeds array limit {}", count, _doc.dec.limits.array));
+	if (_doc.dec.limits.bytes && message->size && (size_t) count > _doc.dec.limits.bytes / message->size)
+		return _decode_error(_doc.fail(Reason::Limit, "Columnar batch of {} messages exceeds size limit {}", count, _doc.dec.limits.bytes));
+
+	// Count is untrusted, check it against column length before allocating rows
+	_columnar_seq.clear();
+	if (seq_found) {
+		const uint8_t * array;
+		uint32_t len;
+		bson_iter_array(&seq, &len, &array);
+		bson_iter_t child;
+		if (!bson_iter_init_from_data(&child, array, len))
+			return _decode_error(_doc.fail(Reason::Invalid, "Failed to init BSON array iterator"));
+		while (bson_iter_next(&child)) {
+			if ((long long) _columnar_seq.size() == count)
+				return _decode_error(_doc.fail(Reason::Invalid, "Seq column is longer then count {}", count));
+			if (auto r = _doc.dec.decode_int(&child); r)
+				_columnar_seq.push_back(*r);
+			else
+				return _decode_error(_doc.fail(Reason::Invalid, "Non-integer seq in columnar batch: {}", bson_iter_type(&child)));
+		}
+		if (_columnar_seq.size() != (size_t) count)
+			return _decode_error(_doc.fail(Reason::Invalid, "Seq column size mismatch: {} != count {}", _columnar_seq.size(), count));
+	} else if (column_found) {
+		const uint8_t * array;
+		uint32_t len;
+		bson_iter_array(&column, &len, &array);
+		bson_iter_t child;
+		if (!bson_iter_init_from_data(&child, array, len))
+			return _decode_error(_doc.fail(Reason::Invalid, "Failed to init BSON array iterator"));
+		long long size = 0;
+		while (size <= count && bson_iter_next(&child))
+			size++;
+		if (size != count)
+			return _decode_error(_doc.fail(Reason::Invalid, "Column {} size mismatch: {} elements, count {}",
+				std::string_view(bson_iter_key_unsafe(&column), bson_iter_key_len(&column)), size, count));
+	} else if ((size_t) count > msg->size)
+		return _decode_error(_doc.fail(Reason::Invalid, "Columnar batch without columns has too large count {}", count));
+
+	if (_columnar_dec.size() < (size_t) count)
+		_columnar_dec.resize(count);
+	for (auto i = 0u; i < count; i++) {
+		_columnar_dec[i].resize(0);
+		_columnar_dec[i].resize(message->size);
+	}
+
+	if (!bson_iter_init(&_doc.iter, &_doc.bson))
+		return _decode_error(_doc.fail(Reason::Invalid, "Failed to bind BSON iterator"));
+	_doc.dec.error_clear();
+	_doc.dec.limits_reset(message->size * count);
+	if (!_doc.dec.decode_columns(&_doc.iter, message, _columnar_dec, count, 0, &_settings))
+		return _decode_error(_doc.fail_decoder());
+
+	tll_msg_t out = {};
+	tll_msg_copy_info(&out, msg);
+	out.msgid = message->msgid;
+	for (auto i = 0u; i < count; i++) {
+		if (seq_found)
+			out.seq = _columnar_seq[i];
+		_route->apply(message, tll::make_view(_columnar_dec[i]), &out);
+		out.data = _columnar_dec[i].data();
+		out.size = _columnar_dec[i].size();
+		_callback_data(&out);
+	}
+	return 0;
+}
+
+int BSON::_error_report(Reason r, const ErrorStack &error, std::string_view action)
+{
+	auto reason = _reason_names[(size_t) r];
+	_error_count[(size_t) r]++;
+	switch (_on_error) {
+	case OnError::Fail:
+		break;
+	case OnError::Drop:
+		return 0;
+	case OnError::Log: {
+		auto now = tll::time::now();
+		if (now - _error_last < _error_interval) {
+			_error_suppressed++;
+			return 0;
+		}
+		_error_last = now;
+		break;
+	}
+	}
+
+	std::string suppressed;
+	if (_error_suppressed)
+		suppressed = fmt::format(" ({} more errors suppressed)", _error_suppressed);
+	_error_suppressed = 0;
+	_log.error("Failed to {}, {}: {}{}", action, reason, format_error(error), suppressed);
+	return _on_error == OnError::Fail ? EINVAL : 0;
+}
+
+int BSON::_on_stream(const tll_msg_t *msg)
+{
+	auto data = static_cast<const char *>(msg->data);
+	size_t size = msg->size;
+	while (size) {
+		auto r = _stream_dec.feed(data, size);
+		if (!r) {
+			_stream_dec.reset();
+			state(tll::state::Error);
+			_decode_error(Reason::Invalid, _stream_dec);
+			return EINVAL;
+		}
+		data += *r;
+		size -= *r;
+		if (!_stream_dec.complete())
+			continue;
+
+		tll_msg_t out = {};
+		tll_msg_copy_info(&out, msg);
+		out.msgid = _stream_dec.message->msgid;
+		if (_stream_dec.seq)
+			out.seq = *_stream_dec.seq;
+		_route->apply(_stream_dec.message, tll::make_view(_stream_dec.buffer), &out);
+		out.data = _stream_dec.buffer.data();
+		out.size = _stream_dec.buffer.size();
+		_callback_data(&out);
+	}
+	return 0;
+}
+
+int BSON::_post_delta(const tll_msg_t *msg, int flags)
+{
+	auto message = _info->lookup(msg->msgid);
+	if (!message)
+		return _log.fail(EINVAL, "Message {} not found", msg->msgid);
+	if (msg->size < message->size)
+		return _log.fail(EMSGSIZE, "Message {} size {} is less then minimum {}", message->name, msg->size, message->size);
+	auto keys = _delta_enc.keys(message);
+	if (!keys)
+		return _log.fail(EINVAL, "Failed to resolve delta keys: {}", _delta_enc.error());
+
+	auto data = tll::make_view(*msg);
+	auto & entry = _delta_enc.lookup(message, *keys, data);
+	bool full = entry.data.empty() || (_delta_snapshot && entry.count >= _delta_snapshot);
+
+	std::optional<tll::const_memory> r;
+	if (full) {
+		r = _doc.encode(msg);
+		if (!r)
+			return _log.fail(EINVAL, "Failed to encode BSON message {}: {}", msg->msgid, format_error(*_doc.error_source));
+	} else {
+		auto mi = info(message);
+		auto prev = tll::make_view(entry.data);
+		Presence changed(mi->fields_size);
+		for (auto f = message->fields; f; f = f->next) {
+			auto idx = info(f)->index;
+			if (!keys->mask.contains(idx) && !delta::equal(f, data.view(f->offset), prev.view(f->offset)))
+				(void) changed.insert(idx);
+		}
+		_doc.enc_cpp.error_clear();
+		r = _doc.enc_cpp.encode_delta(_settings, message, msg, keys->mask, changed);
+		if (!r)
+			return _log.fail(EINVAL, "Failed to encode BSON delta of {}: {}", message->name, format_error(_doc.enc_cpp));
+	}
+
+	tll_msg_t out = {};
+	tll_msg_copy_info(&out, msg);
+	_route->apply(message, data, &out);
+	out.data = r->data;
+	out.size = r->size;
+	if (auto e = _child->post(&out, flags); e)
+		return e;
+
+	(full ? _delta_snapshots : _delta_updates)++;
+	entry.count = full ? 1 : entry.count + 1;
+	auto ptr = static_cast<const char *>(msg->data);
+	entry.data.assign(ptr, ptr + msg->size);
+	return 0;
+}
+
+int BSON::_on_delta(const tll_msg_t *msg)
+{
+	bson_t bson;
+	bson_iter_t iter, delta;
+	if (!bson_init_static(&bson, (const uint8_t *) msg->data, msg->size) || !bson_iter_init(&iter, &bson))
+		return _decode_error(_doc.fail(Reason::Invalid, "Failed to bind BSON buffer"));
+
+	// Read only metadata keys, other values are left for single decode pass below
+	tll_msg_t out = {};
+	tll_msg_copy_info(&out, msg);
+	const tll::scheme::Message * message = nullptr;
+	bool found = false;
+	while (bson_iter_next(&iter)) {
+		std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+		if (key == _settings.delta_key) {
+			delta = iter;
+			found = true;
+		} else if (key == _settings.type_key) {
+			auto name = _doc.dec.decode_string(&iter);
+			if (!name)
+				return _decode_error(_doc.fail(Reason::Invalid, "Non-string type key {}", key));
+			message = _info->lookup(*name);
+			if (!message)
+				return _decode_error(_doc.fail(Reason::Unknown, "Message '{}' not found", *name));
+		} else if (_settings.seq_key.size() && key == _settings.seq_key) {
+			auto seq = _doc.dec.decode_int(&iter);
+			if (!seq)
+				return _decode_error(_doc.fail(Reason::Invalid, "Non-integer seq key {}: {}", key, bson_iter_type(&iter)));
+			out.seq = *seq;
+		}
+	}
+
+	if (!found) {
+		auto m = _decode(msg);
+		if (!m)
+			return _decode_error();
+		auto message = _info->lookup(m->msgid);
+		auto keys = _delta_dec.keys(message);
+		if (!keys)
+			return _decode_error(Reason::Decode, _delta_dec);
+		auto & entry = _delta_dec.lookup(message, *keys, tll::make_view(*m));
+		auto ptr = static_cast<const char *>(m->data);
+		entry.data.assign(ptr, ptr + m->size);
+		entry.count = 1;
+		_delta_snapshots++;
+		_callback_data(m);
+		return 0;
+	}
+
+	if (!message)
+		return _decode_error(_doc.fail(Reason::Unknown, "No type key {} in BSON", _settings.type_key));
+	out.msgid = message->msgid;
+
+	// Decode key and changed fields once into zeroed scratch message, in set mode changed
+	// fields are in nested document and key fields are at top level
+	auto & dec = _doc.dec;
+	_delta_buf.resize(0);
+	_delta_buf.resize(message->size);
+	dec.error_clear();
+	dec.limits_reset(message->size);
+	dec.partial = true;
+	auto mi = tll::bson::info(message);
+	Presence seen(mi->fields_size), changed(mi->fields_size);
+	bool r = bson_iter_init(&iter, &bson) && bson_iter_next(&iter);
+	if (r) {
+		r = dec.decode(&iter, message, tll::make_view(_delta_buf), _settings);
+		seen = dec.partial_seen;
+	}
+	if (r && _settings.delta == Delta::Set) {
+		const uint8_t * data;
+		uint32_t len;
+		bson_iter_t fields;
+		if (bson_iter_type(&delta) != BSON_TYPE_DOCUMENT) {
+			dec.partial = false;
+			return _decode_error(_doc.fail(Reason::Invalid, "Non-document delta key {}: {}", _settings.delta_key, bson_iter_type(&delta)));
 		}
+		bson_iter_document(&delta, &len, &data);
+		if (!bson_iter_init_from_data(&fields, data, len)) {
+			dec.partial = false;
+			return _decode_error(_doc.fail(Reason::Invalid, "Failed to init BSON document iterator"));
+		}
+		if (bson_iter_next(&fields)) {
+			r = dec.decode(&fields, message, tll::make_view(_delta_buf), _settings);
+			changed = dec.partial_seen;
+		}
+	}
+	dec.partial = false;
+	if (!r)
+		return _decode_error(dec.limit_exceeded ? Reason::Limit : Reason::Decode, dec);
+
+	auto keys = _delta_dec.keys(message);
+	if (!keys)
+		return _decode_error(Reason::Decode, _delta_dec);
+	auto & entry = _delta_dec.lookup(message, *keys, tll::make_view(_delta_buf));
+	if (entry.data.empty())
+		return _decode_error(_doc.fail(Reason::Decode, "Delta of message '{}' without previous snapshot", message->name));
+
+	// Rebuild message from scratch so tail holds only data referenced by current pointers
+	_delta_msg.resize(0);
+	_delta_msg.resize(message->size);
+	auto dst = tll::make_view(_delta_msg);
+	for (auto f = message->fields; f; f = f->next) {
+		auto idx = tll::bson::info(f)->index;
+		auto & src = (seen.contains(idx) || changed.contains(idx)) ? _delta_buf : entry.data;
+		if (!delta::copy(f, tll::make_view(src).view(f->offset), dst.view(f->offset)))
+			return _decode_error(_doc.fail(Reason::Decode, "Failed to copy field '{}' of message '{}'", f->name, message->name));
+	}
+
+	entry.data.swap(_delta_msg);
+	entry.count++;
+	_delta_updates++;
+	_route->apply(message, tll::make_view(entry.data), &out);
+	out.data = entry.data.data();
+	out.size = entry.data.size();
+	_callback_data(&out);
+	return 0;
+}
+
+int BSON::_post_inplace(const tll_msg_t *msg, int flags)
+{
+	auto mem = _inplace->reserve(_inplace_size);
+	if (!mem.data)
+		return Base::_post(msg, flags);
+
+	util::SpanBuffer buf(mem.data, mem.size, mem.size, _inplace_spill);
+	tll_msg_t out = {};
+	tll_msg_copy_info(&out, msg);
+	auto r = _doc.encode_into(msg, tll::make_view(buf), &out);
+	if (!r)
+		return _log.fail(EINVAL, "Failed to encode BSON message {}: {}", msg->msgid, format_error(*_doc.error_source));
+
+	out.data = buf.data();
+	out.size = *r;
+	if (!buf.overflow())
+		return _inplace->commit(&out, flags);
+
+	// Reservation is dropped, document is already encoded into spill buffer
+	_inplace_fallback++;
+	return _child->post(&out, flags);
+}
+
+int BSON::_reload(const tll_msg_t *msg)
+{
+	if (_reload_thread.joinable())
+		return _log.fail(EAGAIN, "Scheme reload is already in progress");
+
+	auto message = _scheme_control ? _scheme_control->lookup(msg->msgid) : nullptr;
+	if (!message || !message->fields)
+		return _log.fail(EINVAL, "SchemeReload message not found in control scheme");
+	auto field = message->fields;
+	auto view = tll::make_view(*msg);
+	if (msg->size < message->size)
+		return _log.fail(EMSGSIZE, "SchemeReload message size {} is less then minimum {}", msg->size, message->size);
+	auto ptr = tll::scheme::read_pointer(field, view.view(field->offset));
+	if (!ptr || (ptr->size && field->offset + ptr->offset + ptr->size > msg->size))
+		return _log.fail(EMSGSIZE, "Invalid SchemeReload url pointer");
+	std::string url;
+	if (ptr->size)
+		url.assign(view.view(field->offset + ptr->offset).dataT<char>(), ptr->size - 1);
+	if (url.empty())
+		return _log.fail(EINVAL, "Empty scheme url in SchemeReload");
+
+	_log.info("Reload scheme from {:.64}", url);
+	// Context is not thread safe, scheme is loaded here and only binding is done in background
+	tll::scheme::ConstSchemePtr scheme(context().scheme_load(url));
+	if (!scheme)
+		return _log.fail(EINVAL, "Failed to load scheme from {:.64}", url);
+
+	_reload_ready = false;
+	_reload_info.reset();
+	_reload_scheme = std::move(scheme);
+	_reload_error.clear();
+	_reload_thread = std::thread([this] {
+		ErrorStack error;
+		_reload_info = SchemeInfo::shared(_reload_scheme.get(), error);
+		if (!_reload_info)
+			_reload_error = fmt::format("failed to bind scheme at {}: {}", error.format_stack(), error.error());
+		_reload_ready.store(true, std::memory_order_release);
+	});
+	_pending_update();
+	return 0;
+}
+
+int BSON::_reload_apply()
+{
+	// Partially decoded document is finished with old scheme, swap is retried on next process call
+	if (_stream && !_stream_dec.idle())
+		return 0;
+
+	_reload_thread.join();
+	_reload_ready = false;
+	auto info = std::move(_reload_info);
+	auto scheme = std::move(_reload_scheme);
+	_pending_update();
+	if (!info) {
+		_log.error("Scheme reload failed, keep old scheme: {}", _reload_error);
+		return 0;
+	}
+
+	if (ErrorStack error; _settings.time_datetime && _settings.time_remainder && !info->check_time_remainder(_columnar, error)) {
+		_log.error("Scheme reload failed, keep old scheme: {}", error.error());
+		return 0;
+	}
+
+	auto route = std::make_shared<Route>(*_route);
+	if (!route->compile(*info)) {
+		_log.error("Scheme reload failed, keep old scheme: routing fields do not match new scheme: {}", format_error(*route));
+		return 0;
+	}
+
+	filter::Filter filter;
+	if (!_filter.empty()) {
+		filter = _filter;
+		if (!filter.compile(*info)) {
+			_log.error("Scheme reload failed, keep old scheme: filter does not match new scheme: {}", format_error(filter));
+			return 0;
+		}
+	}
+
+	if (auto r = _columnar_flush(); r)
+		return r;
+	if (!_pool.empty())
+		_retired.push_back({ _pool.submitted(), std::move(_info), std::move(_route) });
+
+	_info = std::move(info);
+	_scheme = std::move(scheme);
+	_route = std::move(route);
+	_doc.rebind(_info.get());
+	_doc.route = _route.get();
+	_info_report();
+	if (!_filter.empty())
+		_filter = std::move(filter);
+	_delta_enc.clear();
+	_delta_dec.clear();
+	if (_stream)
+		_stream_dec.init(&_settings, _info.get());
+	_reload_count++;
+	_log.info("Scheme reloaded");
+
+	// Notify users that data scheme is changed and should be requested again
+	auto message = _scheme_control ? _scheme_control->lookup("SchemeChanged") : nullptr;
+	if (!message)
+		return _log.fail(EINVAL, "SchemeChanged message not found in control scheme");
+	tll_msg_t msg = {};
+	msg.type = TLL_MESSAGE_CONTROL;
+	msg.msgid = message->msgid;
+	_callback(&msg);
+	return 0;
+}
+
+void BSON::Worker::operator () (Job &job)
+{
+	if (doc.info != job.info)
+		doc.rebind(job.info);
+	doc.route = job.route;
+	job.pinned.reset();
+	job.msg.data = job.input.data();
+	job.msg.size = job.input.size();
+	tll_msg_t out = job.msg;
+	auto r = job.encode ? doc.encode(&job.msg, &out) : doc.decode(&job.msg, &out);
+	if (doc.auto_pinned) {
+		job.pinned = *doc.auto_pinned;
+		doc.auto_pinned = nullptr;
+	}
+	job.ok = (bool) r;
+	if (!r) {
+		job.reason = doc.reason;
+		job.error.error_copy(*doc.error_source);
+		return;
+	}
+	job.msg = out;
+	job.msg.size = r->size;
+	if (r->data == doc.buffer.data())
+		job.output.swap(doc.buffer);
+	else if (r->data == doc.enc_cpp.buffer.data())
+		job.output.swap(doc.enc_cpp.buffer);
+	else {
+		auto data = static_cast<const char *>(r->data);
+		job.output.assign(data, data + r->size);
+	}
+}
+
+int BSON::_offload(const tll_msg_t *msg, bool encode)
+{
+	if (encode) {
+		// Check what can be checked synchronously so post fails like without offload
+		auto message = _info->lookup(msg->msgid);
 		if (!message)
-			return _log.fail(std::nullopt, "No type key {} in BSON", _settings.type_key);
-		if (reset && bson_iter_init(&_bson_iter, &_bson_dec))
-			return _log.fail(std::nullopt, "Failed to bind BSON iterator");
-		_buffer_dec.resize(0);
-		_buffer_dec.resize(message->size);
-		_dec.error_clear();
-		if (!_dec.decode(&_bson_iter, message, tll::make_view(_buffer_dec), _settings))
-			return _log.fail(std::nullopt, "Failed to decode BSON message at {}: {}", _dec.format_stack(), _dec.error);
-	}
-	case util::Settings::Mode::Nested: {
-		while (bson_iter_next(&_bson_iter)) {
-			std::string_view key = { bson_iter_key_unsafe(&_bson_iter), bson_iter_key_len(&_bson_iter) };
-			if (_settings.seq_key.size() && key == _settings.seq_key) {
-				if (auto r = _dec.decode_int(&_bson_iter); r)
-					out->seq = *r;
-				else
-					return _log.fail(std::nullopt, "Non-integer seq key {}: {}", key, bson_iter_type(&_bson_iter));
-				if (message)
-					break;
-			} else if (message)
-				continue;
-			auto m = _scheme->lookup(key);
-			if (!m)
-				continue;
-			if (m->msgid == 0)
-				continue;
-			out->msgid = m->msgid;
-			message = m;
-
-			if (bson_iter_type(&_bson_iter) != BSON_TYPE_DOCUMENT)
-				return _log.fail(std::nullopt, "Non-document message '{}' key: {}", key, bson_iter_type(&_bson_iter));
-
-			_buffer_dec.resize(0);
-			_buffer_dec.resize(message->size);
-			_dec.error_clear();
+			return _log.fail(EINVAL, "Failed to encode BSON message {}: message not found", msg->msgid);
+		if (msg->size < message->size)
+			return _log.fail(EMSGSIZE, "Failed to encode BSON message {}: size {} is less then minimum {}", message->name, msg->size, message->size);
+	}
+
+	auto job = _pool.acquire();
+	while (!job) {
+		if (_collecting)
+			return _log.fail(EAGAIN, "Offload queue is full");
+		_pool.wait();
+		if (auto r = _offload_collect(); r)
+			return r;
+		job = _pool.acquire();
+	}
+
+	job->encode = encode;
+	job->info = _info.get();
+	job->route = _route.get();
+	tll_msg_copy_info(&job->msg, msg);
+	auto data = static_cast<const char *>(msg->data);
+	job->input.assign(data, data + msg->size);
+	_pool.submit();
+	_pending_update();
+	return 0;
+}
+
+int BSON::_offload_deliver(Job * job)
+{
+	tll_msg_t msg = job->msg;
+	msg.data = job->output.data();
+	if (job->pinned)
+		_auto_report(*job->pinned);
+	if (!job->ok) {
+		if (job->encode)
+			return _encode_error(job->reason, job->error, job->msg.msgid);
+		return _decode_error(job->reason, job->error);
+	} else if (job->encode) {
+		if (auto e = _child->post(&msg); e)
+			return _log.fail(e, "Failed to post encoded message {}: {}", msg.msgid, e);
+	} else
+		_callback_data(&msg);
+	return 0;
+}
+
+int BSON::_offload_collect()
+{
+	// Job is released after delivery, nested calls from callbacks only submit new jobs
+	if (_collecting)
+		return 0;
+	_collecting = true;
+	_collect_closed = false;
+	int r = 0;
+	while (auto job = _pool.front()) {
+		r = _offload_deliver(job);
+		if (_collect_closed) {
+			_collect_closed = false;
+			_collecting = false;
+			return r;
+		}
+		_pool.pop();
+		if (r)
+			break;
+	}
+	while (_retired.size() && _retired.front().submitted <= _pool.collected())
+		_retired.erase(_retired.begin());
+	_collecting = false;
+	_pending_update();
+	return r;
+}
 
+int BSON::_on_reply(const tll_msg_t *msg)
+{
+	opmsg::Frame frame;
+	if (auto err = opmsg::parse(msg->data, msg->size, frame); err.size())
+		return _log.fail(EINVAL, "Invalid OP_MSG reply: {}", err);
+
+	bson_t body;
+	bson_iter_t iter;
+	if (!bson_init_static(&body, (const uint8_t *) frame.body.data, frame.body.size) || !bson_iter_init(&iter, &body))
+		return _log.fail(EINVAL, "Failed to bind OP_MSG reply body");
+
+	double ok = 0;
+	long long n = 0;
+	std::string_view errmsg;
+	size_t errors = 0;
+	while (bson_iter_next(&iter)) {
+		std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+		if (key == "ok")
+			ok = bson_iter_as_double(&iter);
+		else if (key == "n")
+			n = bson_iter_as_int64(&iter);
+		else if (key == "errmsg") {
+			if (auto r = _doc.dec.decode_string(&iter); r)
+				errmsg = *r;
+		} else if (key == "writeErrors" && bson_iter_type(&iter) == BSON_TYPE_ARRAY) {
 			const uint8_t * array;
 			uint32_t len;
-			bson_iter_document(&_bson_iter, &len, &array);
+			bson_iter_array(&iter, &len, &array);
 			bson_iter_t child;
-			if (!bson_iter_init_from_data(&child, array, len))
-				return _log.fail(std::nullopt, "Failed to init BSON document iterator");
-			if (!bson_iter_next (&child))
-				continue;
-
-			if (!_dec.decode(&child, message, tll::make_view(_buffer_dec)))
-				return _log.fail(std::nullopt, "Failed to decode BSON message at {}: {}", _dec.format_stack(), _dec.error);
+			if (bson_iter_init_from_data(&child, array, len)) {
+				while (bson_iter_next(&child))
+					errors++;
+			}
 		}
-		if (!message)
-			return _log.fail(std::nullopt, "No known type in BSON");
 	}
-	}
-	return tll::const_memory { _buffer_dec.data(), _buffer_dec.size() };
+
+	if (ok != 1)
+		_log.error("OP_MSG request {} failed: {}", frame.header->response_to, errmsg);
+	else if (errors)
+		_log.error("OP_MSG request {}: {} documents inserted, {} write errors", frame.header->response_to, n, errors);
+	else
+		_log.trace("OP_MSG request {}: {} documents inserted", frame.header->response_to, n);
+	return 0;
 }
 
 TLL_DEFINE_IMPL(BSON);
@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_API_H
+#define _TLL_BSON_API_H
+
+#include <tll/scheme.h>
+
+#include "tll/bson/encoder.h"
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+#include "tll/bson/libbson.h"
+#include "tll/bson/util.h"
+
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace tll::bson {
+
+/**
+ * Standalone codec for use outside of bson+ channel
+ *
+ * Encodes messages into caller provided memory and decodes BSON documents into it, top level
+ * document layout (type and seq keys, flat or nested compose) is the same as in the channel.
+ * Encode and decode return size of the result. If it is larger than provided capacity then
+ * result did not fit, memory content is undefined and call should be repeated with buffer of at
+ * least returned size. Errors are reported with nullopt, message is available in error().
+ *
+ * Object is not thread safe, use one per thread. Bound scheme is shared between objects created
+ * for identical schemes.
+ */
+class Codec : public ErrorStack
+{
+	util::Settings _settings;
+	std::shared_ptr<const SchemeInfo> _info;
+	cppbson::Encoder _enc;
+	libbson::Decoder _dec;
+	/// Storage for results that do not fit into caller memory
+	std::vector<char> _spill;
+
+ public:
+	/// Metadata of decoded document
+	struct Meta
+	{
+		const tll::scheme::Message * message = nullptr;
+		int msgid = 0;
+		long long seq = 0;
+	};
+
+	bool init(const tll::Scheme * scheme, const util::Settings &settings = util::Settings::defaults())
+	{
+		_settings = settings;
+		_info = SchemeInfo::shared(scheme, *this);
+		if (_info && settings.time_datetime && settings.time_remainder && !_info->check_time_remainder(false, *this))
+			_info.reset();
+		return _info != nullptr;
+	}
+
+	const util::Settings & settings() const { return _settings; }
+	const SchemeInfo * info() const { return _info.get(); }
+	util::Limits & limits() { return _dec.limits; }
+
+	/// Encode message body ``data`` into ``out``, return document size. Body shorter than fixed part of the message is rejected
+	std::optional<size_t> encode(int msgid, long long seq, const void * data, size_t size, void * out, size_t capacity)
+	{
+		auto message = _info->lookup(msgid);
+		if (!message)
+			return fail(std::nullopt, "Message {} not found", msgid);
+		if (size < message->size)
+			return fail(std::nullopt, "Message '{}' size {} is less then minimum {}", message->name, size, message->size);
+		tll_msg_t msg = {};
+		msg.msgid = msgid;
+		msg.seq = seq;
+		msg.data = data;
+		msg.size = size;
+
+		util::SpanBuffer buf(out, capacity, capacity, _spill);
+		_enc.error_clear();
+		auto r = _enc.encode(_settings, message, &msg, tll::make_view(buf));
+		if (!r)
+			return encoder_fail();
+		return r;
+	}
+
+	/// Exact size of encoded document, costs one encode into internal buffer
+	std::optional<size_t> encoded_size(int msgid, long long seq, const void * data, size_t size)
+	{
+		return encode(msgid, seq, data, size, nullptr, 0);
+	}
+
+	/// Decode BSON document ``data`` into ``out``, return message size including pointer data
+	std::optional<size_t> decode(const void * data, size_t size, void * out, size_t capacity, Meta * meta = nullptr)
+	{
+		util::SpanBuffer buf(out, capacity, 0, _spill);
+		tll_msg_t msg = {};
+		auto message = _dec.decode_document(_settings, *_info, data, size, tll::make_view(buf), &msg);
+		if (!message) {
+			error_copy(_dec);
+			return std::nullopt;
+		}
+		if (meta)
+			*meta = { message, msg.msgid, msg.seq };
+		return buf.size();
+	}
+
+	/// Exact size of decoded message, costs one decode into internal buffer
+	std::optional<size_t> decoded_size(const void * data, size_t size)
+	{
+		return decode(data, size, nullptr, 0);
+	}
+
+	/// Data of last result that did not fit into caller memory, valid until next call
+	const std::vector<char> & spill() const { return _spill; }
+
+ private:
+	std::nullopt_t encoder_fail()
+	{
+		error_copy(_enc);
+		return std::nullopt;
+	}
+};
+
+} // namespace tll::bson
+
+#endif//_TLL_BSON_API_H
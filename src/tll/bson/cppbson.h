@@ -22,6 +22,9 @@ enum class Type : uint8_t
 	Document = 0x03,
 	Array = 0x04,
 	Binary = 0x05,
+	ObjectId = 0x07,
+	Bool = 0x08,
+	DateTime = 0x09,
 	Int32 = 0x10,
 	Int64 = 0x12,
 	Decimal128 = 0x13,
@@ -112,11 +115,33 @@ struct Document
 	void append_int64(std::string_view key, int64_t value) { append_scalar(key, value); }
 	void append_double(std::string_view key, double value) { append_scalar(key, value); }
 
+	void append_datetime(std::string_view key, int64_t value)
+	{
+		append(Type::DateTime, key, &value, sizeof(value));
+	}
+
+	void append_oid(std::string_view key, const std::array<uint8_t, 12> &value)
+	{
+		append(Type::ObjectId, key, value.data(), value.size());
+	}
+
+	void append_bool(std::string_view key, bool value)
+	{
+		uint8_t v = value;
+		append(Type::Bool, key, &v, sizeof(v));
+	}
+
 	void append_decimal128(std::string_view key, const Decimal128 * value)
 	{
 		append(Type::Decimal128, key, value, sizeof(*value));
 	}
 
+	void append_decimal128(std::string_view key, uint64_t low, uint64_t high)
+	{
+		uint64_t words[2] = { low, high };
+		append(Type::Decimal128, key, words, sizeof(words));
+	}
+
 	void append_utf8(std::string_view key, std::string_view value)
 	{
 		ensure_size(1 + key.size() + 1 + 4 + value.size() + 1);
@@ -168,6 +193,7 @@ struct Document
 
 	void finish_standalone()
 	{
+		ensure_size(1);
 		*view.view(offset).template dataT<int8_t>() = 0;
 		*view.template dataT<int32_t>() = ++offset;
 	}
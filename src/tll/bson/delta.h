@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_DELTA_H
+#define _TLL_BSON_DELTA_H
+
+#include <tll/scheme.h>
+#include <tll/scheme/util.h>
+
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::bson::delta {
+
+/**
+ * Compare two values of the field
+ *
+ * Plain values are compared with memcmp, pointers are compared by content so equal lists in
+ * different places of message tail are equal. Scheme must be bound.
+ */
+template <typename A, typename B>
+bool equal(const tll::scheme::Field * field, const A &a, const B &b)
+{
+	using Field = tll::scheme::Field;
+	if (info(field)->plain)
+		return !memcmp(a.data(), b.data(), field->size);
+	switch (field->type) {
+	case Field::Pointer: {
+		auto pa = tll::scheme::read_pointer(field, a);
+		auto pb = tll::scheme::read_pointer(field, b);
+		if (!pa || !pb || pa->size != pb->size || pa->entity != pb->entity)
+			return false;
+		auto af = field->type_ptr;
+		auto va = a.view(pa->offset);
+		auto vb = b.view(pb->offset);
+		if (info(af)->plain)
+			return !memcmp(va.data(), vb.data(), pa->size * pa->entity);
+		for (auto i = 0u; i < pa->size; i++) {
+			if (!equal(af, va.view(i * pa->entity), vb.view(i * pb->entity)))
+				return false;
+		}
+		return true;
+	}
+	case Field::Array: {
+		auto size = tll::scheme::read_size(field->count_ptr, a.view(field->count_ptr->offset));
+		if (size != tll::scheme::read_size(field->count_ptr, b.view(field->count_ptr->offset)))
+			return false;
+		auto af = field->type_array;
+		for (auto i = 0; i < size; i++) {
+			if (!equal(af, a.view(af->offset + i * af->size), b.view(af->offset + i * af->size)))
+				return false;
+		}
+		return true;
+	}
+	case Field::Message:
+		for (auto f = field->type_msg->fields; f; f = f->next) {
+			if (!equal(f, a.view(f->offset), b.view(f->offset)))
+				return false;
+		}
+		return true;
+	case Field::Union: {
+		auto tf = field->type_union->type_ptr;
+		auto type = tll::scheme::read_size(tf, a.view(tf->offset));
+		if (type != tll::scheme::read_size(tf, b.view(tf->offset)))
+			return false;
+		if (type < 0 || (size_t) type >= field->type_union->fields_size)
+			return false;
+		auto uf = field->type_union->fields + type;
+		return equal(uf, a.view(uf->offset), b.view(uf->offset));
+	}
+	default:
+		return !memcmp(a.data(), b.data(), field->size);
+	}
+}
+
+/**
+ * Copy value of the field into other message
+ *
+ * Fixed part is copied as is, pointer data is appended to the tail of ``dst`` buffer so copied
+ * message holds only data that is referenced from it. Scheme must be bound.
+ */
+template <typename Src, typename Dst>
+bool copy(const tll::scheme::Field * field, const Src &src, Dst dst)
+{
+	using Field = tll::scheme::Field;
+	memcpy(dst.data(), src.data(), field->size);
+	if (info(field)->plain)
+		return true;
+	switch (field->type) {
+	case Field::Pointer: {
+		auto ps = tll::scheme::read_pointer(field, src);
+		if (!ps)
+			return false;
+		tll::scheme::generic_offset_ptr_t ptr = {};
+		ptr.size = ps->size;
+		ptr.entity = ps->entity;
+		if (tll::scheme::alloc_pointer(field, dst, ptr))
+			return false;
+		auto af = field->type_ptr;
+		auto vs = src.view(ps->offset);
+		if (info(af)->plain) {
+			memcpy(dst.view(ptr.offset).data(), vs.data(), ps->size * ps->entity);
+			return true;
+		}
+		for (auto i = 0u; i < ps->size; i++) {
+			if (!copy(af, vs.view(i * ps->entity), dst.view(ptr.offset + i * ptr.entity)))
+				return false;
+		}
+		return true;
+	}
+	case Field::Array: {
+		auto size = tll::scheme::read_size(field->count_ptr, src.view(field->count_ptr->offset));
+		auto af = field->type_array;
+		for (auto i = 0; i < size; i++) {
+			if (!copy(af, src.view(af->offset + i * af->size), dst.view(af->offset + i * af->size)))
+				return false;
+		}
+		return true;
+	}
+	case Field::Message:
+		for (auto f = field->type_msg->fields; f; f = f->next) {
+			if (!copy(f, src.view(f->offset), dst.view(f->offset)))
+				return false;
+		}
+		return true;
+	case Field::Union: {
+		auto tf = field->type_union->type_ptr;
+		auto type = tll::scheme::read_size(tf, src.view(tf->offset));
+		if (type < 0 || (size_t) type >= field->type_union->fields_size)
+			return false;
+		auto uf = field->type_union->fields + type;
+		return copy(uf, src.view(uf->offset), dst.view(uf->offset));
+	}
+	default:
+		return true;
+	}
+}
+
+/**
+ * Last message for each (msgid, key fields) pair
+ *
+ * Key fields are top level plain fields listed by name, messages without any of them have one
+ * state per msgid.
+ */
+class State : public ErrorStack
+{
+ public:
+	/// Resolved key fields of the message
+	struct Keys
+	{
+		std::vector<const tll::scheme::Field *> fields;
+		/// Set of key field indexes
+		Presence mask;
+	};
+
+	struct Entry
+	{
+		/// Raw data of last message
+		std::vector<char> data;
+		/// Number of messages since last full snapshot
+		unsigned count = 0;
+	};
+
+	/// Names of key fields
+	std::vector<std::string> names;
+
+	/// Key fields of the message, nullptr on error
+	const Keys * keys(const tll::scheme::Message * message)
+	{
+		if (auto it = _keys.find(message); it != _keys.end())
+			return &it->second;
+		Keys keys;
+		keys.mask = Presence(info(message)->fields_size);
+		for (auto & name : names) {
+			for (auto f = message->fields; f; f = f->next) {
+				if (f->name != name)
+					continue;
+				if (!info(f)->plain)
+					return fail(nullptr, "Key field '{}' of message '{}' has pointers", name, message->name);
+				keys.fields.push_back(f);
+				keys.mask.insert(info(f)->index);
+			}
+		}
+		return &_keys.emplace(message, std::move(keys)).first->second;
+	}
+
+	/// State of the message with same key as ``data``, created empty if not found
+	template <typename Buf>
+	Entry & lookup(const tll::scheme::Message * message, const Keys &keys, const Buf &data)
+	{
+		_key.assign((const char *) &message->msgid, sizeof(message->msgid));
+		for (auto f : keys.fields)
+			_key.append(static_cast<const char *>(data.view(f->offset).data()), f->size);
+		return _entries[_key];
+	}
+
+	/// Drop all state, should be called when scheme is changed
+	void clear()
+	{
+		_keys.clear();
+		_entries.clear();
+	}
+
+ private:
+	std::unordered_map<const tll::scheme::Message *, Keys> _keys;
+	std::unordered_map<std::string, Entry> _entries;
+	std::string _key;
+};
+
+} // namespace tll::bson::delta
+
+#endif//_TLL_BSON_DELTA_H
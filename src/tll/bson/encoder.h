@@ -10,6 +10,7 @@
 
 #include "tll/bson/cppbson.h"
 #include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
 #include "tll/bson/util.h"
 
 namespace tll::bson::cppbson {
@@ -18,46 +19,296 @@ struct Encoder : public ErrorStack
 {
 	std::vector<char> buffer;
 
+	/// Generator of id_key values
+	util::ObjectId _oid;
+
+	/// Cache of array index keys "0", "1", ... used by columnar encoding
+	std::vector<char> _index_buf;
+	std::vector<std::string_view> _index;
+
 	void init()
 	{
 		buffer.resize(64 * 1024);
 	}
 
+	/// Settings of current encode call, used by nested encode functions
+	const util::Settings * _settings = &util::Settings::defaults();
+
 	std::optional<tll::const_memory> encode(const util::Settings &settings, const tll::scheme::Message * message, const tll_msg_t * msg)
 	{
-		Document bson(tll::make_view(buffer));
+		auto r = encode(settings, message, msg, tll::make_view(buffer));
+		if (!r)
+			return std::nullopt;
+		return tll::const_memory { buffer.data(), *r };
+	}
+
+	/// Encode message into view that is resized if needed, return document size
+	template <typename View>
+	std::optional<size_t> encode(const util::Settings &settings, const tll::scheme::Message * message, const tll_msg_t * msg, View view)
+	{
+		_settings = &settings;
+		Document<View> bson(view);
+		if (settings.id_key.size())
+			bson.append_oid(settings.id_key, _oid.next());
 		if (settings.seq_key.size())
 			bson.append_int64(settings.seq_key, (int64_t) msg->seq);
 		if (settings.mode == util::Settings::Mode::Flat) {
-			bson.append_utf8(settings.type_key, message->name);
+			bson.append_utf8(settings.type_key, key(message));
 			if (!encode(bson, message, tll::make_view(*msg)))
 				return std::nullopt;
 		} else {
-			auto child = bson.append_document(message->name);
+			auto child = bson.append_document(key(message));
 			if (!encode(child, message, tll::make_view(*msg)))
 				return std::nullopt;
 			bson.finish_document(child);
 		}
 		bson.finish_standalone();
+		return bson.offset;
+	}
+
+	/**
+	 * Encode delta document in flat mode: key fields and changed fields of the message, layout
+	 * is selected by settings.delta. Sets are indexed by FieldInfo::index of top level fields.
+	 */
+	std::optional<tll::const_memory> encode_delta(const util::Settings &settings, const tll::scheme::Message * message, const tll_msg_t * msg, const Presence &keys, const Presence &changed)
+	{
+		using Delta = util::Settings::Delta;
+		_settings = &settings;
+		Document bson(tll::make_view(buffer));
+		auto data = tll::make_view(*msg);
+		if (settings.id_key.size())
+			bson.append_oid(settings.id_key, _oid.next());
+		if (settings.seq_key.size())
+			bson.append_int64(settings.seq_key, (int64_t) msg->seq);
+		bson.append_utf8(settings.type_key, key(message));
+		if (settings.delta == Delta::Flat) {
+			bson.append_bool(settings.delta_key, true);
+			if (!encode_fields(bson, message, data, [&](unsigned idx) { return keys.contains(idx) || changed.contains(idx); }))
+				return std::nullopt;
+		} else {
+			if (!encode_fields(bson, message, data, [&](unsigned idx) { return keys.contains(idx); }))
+				return std::nullopt;
+			auto child = bson.append_document(settings.delta_key);
+			if (!encode_fields(child, message, data, [&](unsigned idx) { return changed.contains(idx); }))
+				return std::nullopt;
+			bson.finish_document(child);
+		}
+		bson.finish_standalone();
+		return tll::const_memory { bson.view.data(), bson.offset };
+	}
+
+	/**
+	 * Encode rows of the same message type as one document with array per field:
+	 *
+	 *   {seq: [seq0, seq1, ...], type: name, count: N, f0: [v0, v1, ...], sub: {f0: [...]}}
+	 *
+	 * Sub-messages are expanded into documents of columns, all other fields are encoded as arrays
+	 * of N elements.
+	 */
+	std::optional<tll::const_memory> encode_columnar(const util::Settings &settings, const tll::scheme::Message * message, const std::vector<tll_msg_t> &rows)
+	{
+		_settings = &settings;
+		index_prepare(rows.size());
+		Document bson(tll::make_view(buffer));
+		if (settings.seq_key.size()) {
+			auto child = bson.append_array(settings.seq_key);
+			for (auto i = 0u; i < rows.size(); i++)
+				child.append_int64(_index[i], rows[i].seq);
+			bson.finish_document(child);
+		}
+		bson.append_utf8(settings.type_key, key(message));
+		bson.append_int32(settings.count_key, rows.size());
+		if (!encode_columns(bson, message, rows, 0))
+			return std::nullopt;
+		bson.finish_standalone();
 		return tll::const_memory { bson.view.data(), bson.offset };
 	}
 
+	void index_prepare(size_t size)
+	{
+		if (_index.size() >= size)
+			return;
+		std::array<char, 10> idxbuf;
+		_index_buf.clear();
+		for (auto i = 0u; i < size; i++) {
+			auto s = util::uint_to_string(i, idxbuf);
+			_index_buf.insert(_index_buf.end(), s.begin(), s.end());
+			_index_buf.push_back('\0');
+		}
+		_index.clear();
+		for (auto ptr = _index_buf.data(); _index.size() < size; ptr += _index.back().size() + 1)
+			_index.emplace_back(ptr);
+	}
+
+	template <typename View>
+	bool encode_columns(Document<View> &bson, const tll::scheme::Message * message, const std::vector<tll_msg_t> &rows, size_t offset);
+
+	template <typename T, typename R, typename View>
+	void encode_column(Document<View> &bson, const std::vector<tll_msg_t> &rows, size_t offset)
+	{
+		bson.ensure_size(rows.size() * (1 + 1 + sizeof(R)) + _index[rows.size() - 1].size() * rows.size());
+		for (auto i = 0u; i < rows.size(); i++) {
+			auto key = _index[i];
+			bson.append_key_nocheck(data_type_v<R>, key);
+			*bson.view.view(bson.offset).template dataT<R>() = *(const T *) (((const char *) rows[i].data) + offset);
+			bson.offset += sizeof(R);
+		}
+	}
+
 	template <typename View, typename Buf>
 	bool encode(Document<View> &bson, const tll::scheme::Message * message, const Buf & buf);
 
+	/// Encode top level fields selected by ``filter(FieldInfo::index)``
+	template <typename View, typename Buf, typename Filter>
+	bool encode_fields(Document<View> &bson, const tll::scheme::Message * message, const Buf & buf, Filter filter);
+
 	template <typename View, typename Buf>
 	bool encode(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, const Buf & buf);
 
 	template <typename View, typename Buf>
 	bool encode_list(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, size_t size, size_t entity, const Buf & buf);
+
+	template <typename View, typename Buf>
+	bool encode_enum(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->type_enum)
+			return false;
+		auto name = fi->type_enum->name(util::read_int(field, data));
+		if (!name.size())
+			return false;
+		bson.append_utf8(key, name);
+		return true;
+	}
+
+	/// Encode bits as array of set bit names, bit fields wider then one bit as ``{name: value}`` documents
+	template <typename View, typename Buf>
+	bool encode_bits(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->type_bits)
+			return false;
+		unsigned long long v = util::read_int(field, data);
+		auto child = bson.append_array(key);
+		std::array<char, 10> idxbuf;
+		auto idx = 0u;
+		for (auto & b : fi->type_bits->bits) {
+			auto bv = (v >> b.offset) & b.mask;
+			if (!bv)
+				continue;
+			auto k = util::uint_to_string(idx++, idxbuf);
+			if (b.mask == 1) {
+				child.append_utf8(k, b.name);
+				continue;
+			}
+			auto value = child.append_document(k);
+			value.append_int64(b.name, bv);
+			child.finish_document(value);
+		}
+		bson.finish_document(child);
+		return true;
+	}
+
+	template <typename View, typename Buf>
+	bool encode_time(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi)
+			return false;
+		std::pair<long long, long long> v;
+		if (field->type == tll::scheme::Field::Double)
+			v = fi->time_split(*data.template dataT<double>());
+		else
+			v = fi->time_split(util::read_int(field, data));
+		bson.append_datetime(key, v.first);
+		return true;
+	}
+
+	/// Splice pre-encoded document after checking its length
+	template <typename View>
+	bool encode_raw(Document<View> &bson, std::string_view key, const void * data, size_t size)
+	{
+		auto doc = util::raw_document(data, size);
+		if (!doc)
+			return fail(false, "Invalid BSON document in field of size {}", size);
+		bson.append(Type::Document, key, doc->data(), doc->size());
+		return true;
+	}
+
+	/// Append sub-millisecond remainder of time point field of message or sub-message, skipped if zero
+	template <typename View, typename Buf>
+	void encode_time_remainder(Document<View> &bson, const tll::scheme::Field * field, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->time_rem_mul)
+			return;
+		std::pair<long long, long long> v;
+		if (field->type == tll::scheme::Field::Double)
+			v = fi->time_split(*data.template dataT<double>());
+		else
+			v = fi->time_split(util::read_int(field, data));
+		if (v.second)
+			bson.append_int32(fi->time_rem_key, v.second);
+	}
 };
 
 template <typename View, typename Buf>
 bool Encoder::encode(Document<View> &bson, const tll::scheme::Message * message, const Buf & buf)
 {
 	for (auto f = message->fields; f; f = f->next) {
-		if (!encode(bson, f, f->name, buf.view(f->offset)))
+		if (_settings->sparse && util::is_default(f, buf.view(f->offset)))
+			continue;
+		if (!encode(bson, f, key(f), buf.view(f->offset)))
 			return fail_field(false, f);
+		if (f->sub_type == tll::scheme::Field::TimePoint && _settings->time_datetime && _settings->time_remainder)
+			encode_time_remainder(bson, f, buf.view(f->offset));
+	}
+	return true;
+}
+
+template <typename View, typename Buf, typename Filter>
+bool Encoder::encode_fields(Document<View> &bson, const tll::scheme::Message * message, const Buf & buf, Filter filter)
+{
+	for (auto f = message->fields; f; f = f->next) {
+		if (!filter(info(f)->index))
+			continue;
+		if (!encode(bson, f, key(f), buf.view(f->offset)))
+			return fail_field(false, f);
+		if (f->sub_type == tll::scheme::Field::TimePoint && _settings->time_datetime && _settings->time_remainder)
+			encode_time_remainder(bson, f, buf.view(f->offset));
+	}
+	return true;
+}
+
+template <typename View>
+bool Encoder::encode_columns(Document<View> &bson, const tll::scheme::Message * message, const std::vector<tll_msg_t> &rows, size_t offset)
+{
+	using Field = tll::scheme::Field;
+	for (auto f = message->fields; f; f = f->next) {
+		if (f->type == Field::Message) {
+			auto child = bson.append_document(key(f));
+			if (!encode_columns(child, f->type_msg, rows, offset + f->offset))
+				return fail_field(false, f);
+			bson.finish_document(child);
+			continue;
+		}
+
+		auto child = bson.append_array(key(f));
+		auto plain = f->sub_type == Field::SubNone;
+		if (rows.empty()) {
+		} else if (plain && f->type == Field::Int32) {
+			encode_column<int32_t, int32_t>(child, rows, offset + f->offset);
+		} else if (plain && f->type == Field::Int64) {
+			encode_column<int64_t, int64_t>(child, rows, offset + f->offset);
+		} else if (plain && f->type == Field::Double) {
+			encode_column<double, double>(child, rows, offset + f->offset);
+		} else {
+			for (auto i = 0u; i < rows.size(); i++) {
+				if (!encode(child, f, _index[i], tll::make_view(rows[i]).view(offset + f->offset)))
+					return fail_index(fail_field(false, f), i);
+			}
+		}
+		bson.finish_document(child);
 	}
 	return true;
 }
@@ -66,6 +317,33 @@ template <typename View, typename Buf>
 bool Encoder::encode(Document<View> &bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
 {
 	using Field = tll::scheme::Field;
+	switch (field->sub_type) {
+	case Field::Enum:
+		if (_settings->enum_string && encode_enum(bson, field, key, data))
+			return true;
+		break;
+	case Field::Bits:
+		if (_settings->bits_string && encode_bits(bson, field, key, data))
+			return true;
+		break;
+	case Field::TimePoint:
+		if (_settings->time_datetime && encode_time(bson, field, key, data))
+			return true;
+		break;
+	case Field::Fixed:
+		if (_settings->fixed == util::Settings::Fixed::Decimal128) {
+			auto d = util::fixed_to_decimal128(util::read_int(field, data), field->fixed_precision);
+			bson.append_decimal128(key, d.low, d.high);
+			return true;
+		} else if (_settings->fixed == util::Settings::Fixed::Double) {
+			bson.append_double(key, (double) util::read_int(field, data) / util::pow10[field->fixed_precision]);
+			return true;
+		}
+		break;
+	default:
+		break;
+	}
+
 	switch (field->type) {
 	case Field::Int8:
 		bson.append_int32(key, *data.template dataT<int8_t>()); return true;
@@ -92,6 +370,8 @@ bool Encoder::encode(Document<View> &bson, const tll::scheme::Field * field, std
 		if (field->sub_type == Field::ByteString) {
 			auto ptr = data.template dataT<char>();
 			bson.append_utf8(key, std::string_view(ptr, strnlen(ptr, field->size)));
+		} else if (auto fi = info(field); fi && fi->raw_bson) {
+			return encode_raw(bson, key, data.data(), field->size);
 		} else
 			bson.append_binary(key, Memory { data.template dataT<uint8_t>(), field->size });
 		return true;
@@ -117,6 +397,8 @@ bool Encoder::encode(Document<View> &bson, const tll::scheme::Field * field, std
 				bson.append_utf8(key, std::string_view(data.view(ptr->offset).template dataT<const char>(), ptr->size - 1));
 			return true;
 		}
+		if (auto fi = info(field); fi && fi->raw_bson)
+			return encode_raw(bson, key, data.view(ptr->offset).data(), ptr->size * ptr->entity);
 		return encode_list(bson, field->type_ptr, key, ptr->size, ptr->entity, data.view(ptr->offset));
 	}
 	case Field::Message: {
@@ -133,7 +415,7 @@ bool Encoder::encode(Document<View> &bson, const tll::scheme::Field * field, std
 		auto uf = field->type_union->fields + type;
 
 		auto child = bson.append_document(key);
-		if (!encode(child, uf, uf->name, data.view(uf->offset)))
+		if (!encode(child, uf, tll::bson::key(uf), data.view(uf->offset)))
 			return fail_field(false, uf);
 		bson.finish_document(child);
 		return true;
@@ -3,8 +3,21 @@
 #ifndef _TLL_BSON_ERROR_STACK_H
 #define _TLL_BSON_ERROR_STACK_H
 
+#include <array>
+
+#if FMT_VERSION >= 80000
+#include <fmt/args.h>
+#endif
+
 namespace tll::bson {
 
+/**
+ * Error message and location of the failure
+ *
+ * Formatting is deferred: fail() only stores format string and arguments, message is formatted
+ * when error() is called. Rejecting bad input without logging it costs no formatting. String
+ * arguments are copied, so error remains valid after input data is released.
+ */
 struct ErrorStack
 {
 
@@ -15,22 +28,58 @@ struct ErrorStack
 	using format_string = fmt::format_string<Args...>;
 #endif
 
-	/// Error message
-	std::string error;
+	/// Stored error argument
+	using Arg = std::variant<long long, unsigned long long, double, std::string>;
+	/**
+	 * Arguments are stored inline so fail() does not allocate for numeric arguments. Four is the
+	 * largest number used by error messages, longer argument lists are rejected at compile time.
+	 */
+	static constexpr size_t args_max = 4;
+
 	/// Error stack, field pointer or array index
 	std::vector<std::variant<const tll::scheme::Field *, size_t>> error_stack;
 
 	void error_clear()
 	{
-		error.clear();
+		_format = {};
+		_args_size = 0;
+		_error.clear();
+		_formatted = true;
 		error_stack.clear();
 	}
 
+	/// Error message, formatted on first access
+	const std::string & error() const
+	{
+		if (!_formatted) {
+			_error = format_error();
+			_formatted = true;
+		}
+		return _error;
+	}
+
+	/// Copy error message and stack from other object
+	void error_copy(const ErrorStack &rhs)
+	{
+		_format = rhs._format;
+		_args_size = rhs._args_size;
+		for (auto i = 0u; i < _args_size; i++)
+			_args[i] = rhs._args[i];
+		_error = rhs._error;
+		_formatted = rhs._formatted;
+		error_stack = rhs.error_stack;
+	}
+
 	template <typename R, typename... Args>
 	[[nodiscard]]
 	R fail(R err, format_string<Args...> format, Args && ... args)
 	{
-		error = fmt::format(format, std::forward<Args>(args)...);
+		static_assert(sizeof...(Args) <= args_max, "Too many error arguments");
+		fmt::string_view f = format;
+		_format = { f.data(), f.size() };
+		_args_size = 0;
+		(push_arg(std::forward<Args>(args)), ...);
+		_formatted = false;
 		error_stack.clear();
 		return err;
 	}
@@ -66,6 +115,46 @@ struct ErrorStack
 		}
 		return r;
 	}
+
+ private:
+	std::string_view _format;
+	std::array<Arg, args_max> _args;
+	size_t _args_size = 0;
+	mutable std::string _error;
+	mutable bool _formatted = true;
+
+	template <typename T>
+	void push_arg(T && v)
+	{
+		using D = std::decay_t<T>;
+		auto & arg = _args[_args_size++];
+		if constexpr (std::is_enum_v<D> || std::is_same_v<D, bool>)
+			arg = static_cast<long long>(v);
+		else if constexpr (std::is_integral_v<D> && std::is_signed_v<D>)
+			arg = static_cast<long long>(v);
+		else if constexpr (std::is_integral_v<D>)
+			arg = static_cast<unsigned long long>(v);
+		else if constexpr (std::is_floating_point_v<D>)
+			arg = static_cast<double>(v);
+		else if (auto s = std::get_if<std::string>(&arg); s)
+			s->assign(std::string_view(v));
+		else
+			arg = std::string(std::string_view(v));
+	}
+
+	/// Format stored arguments, format specs are applied to stored value types
+	std::string format_error() const
+	{
+		fmt::dynamic_format_arg_store<fmt::format_context> store;
+		for (auto i = 0u; i < _args_size; i++)
+			std::visit([&store](auto & v) { store.push_back(v); }, _args[i]);
+		try {
+			return fmt::vformat(fmt::string_view(_format.data(), _format.size()), store);
+		} catch (fmt::format_error &) {
+			// Enums and bools are stored as integers, spec valid only for original type is not fatal
+			return std::string(_format);
+		}
+	}
 };
 
 } // namespace tll::bson
@@ -0,0 +1,605 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_FILTER_H
+#define _TLL_BSON_FILTER_H
+
+#include <bson/bson.h>
+
+#include <tll/scheme.h>
+#include <tll/util/memoryview.h>
+
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+#include "tll/bson/libbson.h"
+#include "tll/bson/util.h"
+
+#include <cctype>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::bson::filter {
+
+/**
+ * Predicate over fields of BSON document, checked before decode
+ *
+ * Expression is a boolean combination of comparisons of field paths with constants:
+ *
+ *   header.id0 == 100 && (string0 == 'AAA' || !(f0 < 1.5)) && e0 != B
+ *
+ * Operators are ``== != < <= > >=``, ``&& || !`` and parentheses. Constants are numbers, quoted
+ * strings and names of enum values. Expression is parsed once and compiled for each message of
+ * bound scheme: paths are resolved into fields, constants are converted into storage type of the
+ * field, so fixed point constants become mantissas and enum names become values.
+ *
+ * Document is matched with shallow scan of message level keys, sub-documents are entered only if
+ * some path goes through them. Values are converted with decoder rules and missing keys have
+ * default values, so result is the same as for decoded message.
+ *
+ * Comparison with path that does not exist in the message is unknown and expression is evaluated
+ * with three-valued logic: ``false && unknown`` is false, ``true || unknown`` is true and ``!unknown``
+ * is unknown. Document with unknown result is passed, so ``header.id0 == 100`` filters only
+ * messages that have ``header`` field and does not drop other ones. Value that can not be
+ * converted into field type (wrong BSON type, overflow) is unknown too.
+ */
+class Filter : public ErrorStack
+{
+	using Field = tll::scheme::Field;
+	using Message = tll::scheme::Message;
+
+ public:
+	enum class Op { EQ, NE, LT, LE, GT, GE };
+
+ private:
+	/// Node of parsed expression, children are indexes in node list
+	struct Node
+	{
+		enum class Type { And, Or, Not, Compare } type = Type::Compare;
+		int left = -1;
+		int right = -1;
+		Op op = Op::EQ;
+		/// Field path of comparison, split by dots
+		std::vector<std::string> path;
+		enum class Literal { Number, String, Name } literal = Literal::Number;
+		std::string value;
+	};
+
+	/// Comparison resolved for one message, constant is converted into storage type of the field
+	struct Leaf
+	{
+		/// Resolved field, nullptr if path does not exist in the message
+		const Field * field = nullptr;
+		enum class Kind { Int, Double, String } kind = Kind::Int;
+		long long i = 0;
+		double d = 0;
+		std::string s;
+	};
+
+	/// Fields of one document level used in comparisons, indexed by FieldInfo::index
+	struct Level
+	{
+		struct Slot
+		{
+			/// Comparisons of this field
+			std::vector<unsigned> leaves;
+			/// Level of sub-message, if paths go through it
+			int child = -1;
+		};
+
+		const Message * message = nullptr;
+		std::vector<Slot> slots;
+	};
+
+	struct Program
+	{
+		/// Leaves indexed by comparison node
+		std::vector<Leaf> leaves;
+		/// Document levels, first one is the message itself
+		std::vector<Level> levels;
+	};
+
+	std::vector<Node> _nodes;
+	int _root = -1;
+
+	const SchemeInfo * _info = nullptr;
+	std::unordered_map<const Message *, Program> _programs;
+
+	libbson::Decoder _dec;
+	/// Iterators of comparison values in current document, indexed by node
+	std::vector<bson_iter_t> _values;
+	std::vector<char> _scalar;
+
+	/// Parser state
+	std::string_view _text;
+	size_t _pos = 0;
+
+ public:
+	bool empty() const { return _root < 0; }
+
+	/// Parse expression, previous expression and compiled programs are dropped
+	bool parse(std::string_view text)
+	{
+		_nodes.clear();
+		_programs.clear();
+		_info = nullptr;
+		_root = -1;
+		_text = text;
+		_pos = 0;
+		auto root = parse_or();
+		skip();
+		if (root && _pos != _text.size())
+			root = fail(std::nullopt, "Unexpected '{}' at position {}", _text.substr(_pos), _pos);
+		_text = {};
+		if (!root)
+			return false;
+		_root = *root;
+		return true;
+	}
+
+	/// Resolve paths for each message of bound scheme, object keeps pointer to ``info``
+	bool compile(const SchemeInfo &info)
+	{
+		_programs.clear();
+		_info = &info;
+		std::vector<bool> found(_nodes.size());
+		for (auto m = info.scheme()->messages; m; m = m->next) {
+			if (!m->msgid)
+				continue;
+			auto & p = _programs[m];
+			p.leaves.resize(_nodes.size());
+			p.levels.push_back(level(m));
+			for (auto i = 0u; i < _nodes.size(); i++) {
+				if (_nodes[i].type != Node::Type::Compare)
+					continue;
+				auto r = resolve(p, i);
+				if (!r) {
+					auto text = error();
+					return fail(false, "Message '{}', path '{}': {}", m->name, join(_nodes[i].path), text);
+				}
+				if (*r)
+					found[i] = true;
+			}
+		}
+		for (auto i = 0u; i < _nodes.size(); i++) {
+			if (_nodes[i].type == Node::Type::Compare && !found[i])
+				return fail(false, "Field '{}' not found in any message", join(_nodes[i].path));
+		}
+		_values.resize(_nodes.size());
+		return true;
+	}
+
+	/**
+	 * Check top level document, message is found by type key or nested document key like in decode.
+	 *
+	 * Returns false only if document is rejected. Documents that can not be checked, like malformed
+	 * ones or documents of unknown messages, are passed so decoder reports the error. Documents
+	 * with unknown result of expression are passed too.
+	 */
+	bool match(const util::Settings &settings, const void * data, size_t size)
+	{
+		if (empty() || !_info)
+			return true;
+		bson_iter_t iter, body;
+		if (!bson_iter_init_from_data(&iter, (const uint8_t *) data, size))
+			return true;
+
+		const Message * message = nullptr;
+		if (settings.mode == util::Settings::Mode::Flat) {
+			for (auto it = iter; bson_iter_next(&it);) {
+				if (settings.type_key != std::string_view(bson_iter_key_unsafe(&it), bson_iter_key_len(&it)))
+					continue;
+				if (auto name = _dec.decode_string(&it); name)
+					message = _info->lookup(*name);
+				break;
+			}
+			body = iter;
+		} else {
+			while (bson_iter_next(&iter)) {
+				auto m = _info->lookup(std::string_view(bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter)));
+				if (!m || !m->msgid)
+					continue;
+				if (bson_iter_type(&iter) != BSON_TYPE_DOCUMENT || !recurse(&iter, &body))
+					return true;
+				message = m;
+				break;
+			}
+		}
+		if (!message)
+			return true;
+		auto it = _programs.find(message);
+		if (it == _programs.end())
+			return true;
+
+		std::fill(_values.begin(), _values.end(), bson_iter_t {});
+		if (!scan(it->second, 0, &body))
+			return true;
+		return eval(it->second, _root).value_or(true);
+	}
+
+ private:
+	static std::string join(const std::vector<std::string> &path)
+	{
+		std::string r;
+		for (auto & p : path) {
+			if (r.size())
+				r += ".";
+			r += p;
+		}
+		return r;
+	}
+
+	void skip()
+	{
+		while (_pos < _text.size() && isspace(_text[_pos]))
+			_pos++;
+	}
+
+	/// Consume token if it is next in the input
+	bool accept(std::string_view token)
+	{
+		skip();
+		if (_text.substr(_pos, token.size()) != token)
+			return false;
+		_pos += token.size();
+		return true;
+	}
+
+	std::optional<int> node(Node::Type type, int left, int right = -1)
+	{
+		auto & n = _nodes.emplace_back();
+		n.type = type;
+		n.left = left;
+		n.right = right;
+		return _nodes.size() - 1;
+	}
+
+	std::optional<int> parse_or()
+	{
+		auto left = parse_and();
+		while (left && accept("||")) {
+			auto right = parse_and();
+			if (!right)
+				return std::nullopt;
+			left = node(Node::Type::Or, *left, *right);
+		}
+		return left;
+	}
+
+	std::optional<int> parse_and()
+	{
+		auto left = parse_unary();
+		while (left && accept("&&")) {
+			auto right = parse_unary();
+			if (!right)
+				return std::nullopt;
+			left = node(Node::Type::And, *left, *right);
+		}
+		return left;
+	}
+
+	std::optional<int> parse_unary()
+	{
+		if (accept("!")) {
+			auto r = parse_unary();
+			if (!r)
+				return std::nullopt;
+			return node(Node::Type::Not, *r);
+		}
+		if (accept("(")) {
+			auto r = parse_or();
+			if (!r)
+				return std::nullopt;
+			if (!accept(")"))
+				return fail(std::nullopt, "Expected ')' at position {}", _pos);
+			return r;
+		}
+		return parse_compare();
+	}
+
+	static bool ident_start(char c) { return isalpha(c) || c == '_'; }
+	static bool ident(char c) { return isalnum(c) || c == '_'; }
+
+	std::optional<std::string_view> parse_ident()
+	{
+		skip();
+		auto start = _pos;
+		if (_pos >= _text.size() || !ident_start(_text[_pos]))
+			return std::nullopt;
+		while (_pos < _text.size() && ident(_text[_pos]))
+			_pos++;
+		return _text.substr(start, _pos - start);
+	}
+
+	std::optional<int> parse_compare()
+	{
+		Node n;
+		do {
+			auto name = parse_ident();
+			if (!name)
+				return fail(std::nullopt, "Expected field name at position {}", _pos);
+			n.path.emplace_back(*name);
+		} while (accept("."));
+
+		static constexpr std::pair<std::string_view, Op> ops[] = {
+			{"==", Op::EQ}, {"!=", Op::NE}, {"<=", Op::LE}, {">=", Op::GE}, {"<", Op::LT}, {">", Op::GT},
+		};
+		bool found = false;
+		for (auto & [token, op] : ops) {
+			if (accept(token)) {
+				n.op = op;
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			return fail(std::nullopt, "Expected comparison operator at position {}", _pos);
+
+		skip();
+		if (_pos >= _text.size())
+			return fail(std::nullopt, "Expected value at the end of expression");
+		auto c = _text[_pos];
+		if (c == '\'' || c == '"') {
+			n.literal = Node::Literal::String;
+			for (_pos++; _pos < _text.size() && _text[_pos] != c; _pos++) {
+				if (_text[_pos] == '\\' && _pos + 1 < _text.size())
+					_pos++;
+				n.value += _text[_pos];
+			}
+			if (_pos >= _text.size())
+				return fail(std::nullopt, "Unterminated string");
+			_pos++;
+		} else if (ident_start(c)) {
+			n.literal = Node::Literal::Name;
+			n.value = *parse_ident();
+		} else {
+			n.literal = Node::Literal::Number;
+			auto start = _pos;
+			while (_pos < _text.size() && (isalnum(_text[_pos]) || std::string_view("+-.").find(_text[_pos]) != std::string_view::npos))
+				_pos++;
+			n.value = _text.substr(start, _pos - start);
+			if (n.value.empty())
+				return fail(std::nullopt, "Expected value at position {}", _pos);
+		}
+		_nodes.push_back(std::move(n));
+		return _nodes.size() - 1;
+	}
+
+	static Level level(const Message * message)
+	{
+		Level l;
+		l.message = message;
+		l.slots.resize(info(message)->fields_size);
+		return l;
+	}
+
+	/// Resolve path of comparison node, returns false if path does not exist in the message
+	std::optional<bool> resolve(Program &p, unsigned idx)
+	{
+		auto & n = _nodes[idx];
+		unsigned level = 0;
+		for (auto i = 0u; i < n.path.size(); i++) {
+			auto mi = info(p.levels[level].message);
+			auto it = mi->index.find(n.path[i]);
+			if (it == mi->index.end())
+				return false;
+			auto field = it->second;
+			auto slot = info(field)->index;
+			if (i + 1 == n.path.size()) {
+				if (!constant(n, field, p.leaves[idx]))
+					return std::nullopt;
+				p.levels[level].slots[slot].leaves.push_back(idx);
+				return true;
+			}
+			if (field->type != Field::Message)
+				return fail(std::nullopt, "Field '{}' of path '{}' is not a message", field->name, join(n.path));
+			if (p.levels[level].slots[slot].child < 0) {
+				p.levels[level].slots[slot].child = p.levels.size();
+				p.levels.push_back(this->level(field->type_msg));
+			}
+			level = p.levels[level].slots[slot].child;
+		}
+		return false;
+	}
+
+	/// Exact mantissa of decimal number with given precision
+	static std::optional<long long> fixed(std::string_view s, unsigned precision)
+	{
+		bool neg = s.size() && s[0] == '-';
+		if (s.size() && (s[0] == '-' || s[0] == '+'))
+			s = s.substr(1);
+		auto dot = s.find('.');
+		auto ip = s.substr(0, dot);
+		auto fp = dot == s.npos ? std::string_view() : s.substr(dot + 1);
+		if (fp.size() > precision) {
+			if (fp.substr(precision).find_first_not_of('0') != fp.npos)
+				return std::nullopt;
+			fp = fp.substr(0, precision);
+		}
+		if ((ip.empty() && fp.empty()) || ip.size() + precision > 18)
+			return std::nullopt;
+		long long v = 0;
+		for (auto c : ip) {
+			if (!isdigit(c))
+				return std::nullopt;
+			v = v * 10 + (c - '0');
+		}
+		for (auto c : fp) {
+			if (!isdigit(c))
+				return std::nullopt;
+			v = v * 10 + (c - '0');
+		}
+		for (auto i = fp.size(); i < precision; i++)
+			v *= 10;
+		return neg ? -v : v;
+	}
+
+	static std::optional<long long> integer(std::string_view s)
+	{
+		long long v;
+		if (s.size() && s[0] == '+')
+			s = s.substr(1);
+		auto r = std::from_chars(s.data(), s.data() + s.size(), v);
+		if (r.ec != std::errc() || r.ptr != s.data() + s.size())
+			return std::nullopt;
+		return v;
+	}
+
+	/// Convert constant of comparison into storage type of the field
+	bool constant(const Node &n, const Field * field, Leaf &leaf)
+	{
+		using Literal = Node::Literal;
+		leaf.field = field;
+		switch (field->type) {
+		case Field::Int8: case Field::Int16: case Field::Int32: case Field::Int64:
+		case Field::UInt8: case Field::UInt16: case Field::UInt32: case Field::UInt64: {
+			leaf.kind = Leaf::Kind::Int;
+			std::optional<long long> v;
+			if (field->sub_type == Field::Fixed && n.literal == Literal::Number) {
+				v = fixed(n.value, field->fixed_precision);
+			} else if (n.literal == Literal::Number) {
+				v = integer(n.value);
+			} else if (field->sub_type == Field::Enum && info(field)->type_enum) {
+				v = info(field)->type_enum->value(n.value);
+				if (!v)
+					return fail(false, "Unknown enum value '{}'", n.value);
+			}
+			if (!v)
+				return fail(false, "Invalid integer value '{}'", n.value);
+			leaf.i = *v;
+			return true;
+		}
+		case Field::Double: {
+			leaf.kind = Leaf::Kind::Double;
+			char * end = nullptr;
+			leaf.d = strtod(n.value.c_str(), &end);
+			if (n.literal != Literal::Number || end != n.value.c_str() + n.value.size())
+				return fail(false, "Invalid floating point value '{}'", n.value);
+			return true;
+		}
+		case Field::Bytes:
+		case Field::Pointer:
+			if (field->sub_type != Field::ByteString)
+				break;
+			if (n.literal != Literal::String)
+				return fail(false, "String field can be compared only with quoted string, got '{}'", n.value);
+			leaf.kind = Leaf::Kind::String;
+			leaf.s = n.value;
+			return true;
+		default:
+			break;
+		}
+		return fail(false, "Field type is not supported in filter");
+	}
+
+	static bool recurse(const bson_iter_t * iter, bson_iter_t * child)
+	{
+		const uint8_t * data;
+		uint32_t len;
+		bson_iter_document(iter, &len, &data);
+		return bson_iter_init_from_data(child, data, len);
+	}
+
+	/// Collect iterators of compared fields, sub-documents are entered only if needed
+	bool scan(const Program &p, unsigned idx, bson_iter_t * iter)
+	{
+		auto & level = p.levels[idx];
+		auto mi = info(level.message);
+		while (bson_iter_next(iter)) {
+			auto it = mi->index.find(std::string_view(bson_iter_key_unsafe(iter), bson_iter_key_len(iter)));
+			if (it == mi->index.end())
+				continue;
+			auto & slot = level.slots[info(it->second)->index];
+			for (auto l : slot.leaves)
+				_values[l] = *iter;
+			if (slot.child < 0 || bson_iter_type(iter) != BSON_TYPE_DOCUMENT)
+				continue;
+			bson_iter_t child;
+			if (!recurse(iter, &child) || !scan(p, slot.child, &child))
+				return false;
+		}
+		return true;
+	}
+
+	template <typename T>
+	static bool compare(const T &a, const T &b, Op op)
+	{
+		switch (op) {
+		case Op::EQ: return a == b;
+		case Op::NE: return a != b;
+		case Op::LT: return a < b;
+		case Op::LE: return a <= b;
+		case Op::GT: return a > b;
+		case Op::GE: return a >= b;
+		}
+		return false;
+	}
+
+	/// Compare value with constant, nullopt if value can not be converted into field type
+	std::optional<bool> compare(const Leaf &leaf, const bson_iter_t &iter, Op op)
+	{
+		if (leaf.kind == Leaf::Kind::String) {
+			std::string_view v;
+			if (iter.raw) {
+				if (bson_iter_type(&iter) != BSON_TYPE_UTF8)
+					return std::nullopt;
+				uint32_t len;
+				auto ptr = bson_iter_utf8(&iter, &len);
+				v = { ptr, len };
+			}
+			return compare(v, std::string_view(leaf.s), op);
+		}
+
+		_scalar.resize(0);
+		_scalar.resize(std::max<size_t>(leaf.field->size, 16));
+		auto data = tll::make_view(_scalar);
+		if (iter.raw) {
+			auto it = iter;
+			_dec.error_clear();
+			if (!_dec.decode(&it, leaf.field, data))
+				return std::nullopt;
+		}
+		if (leaf.kind == Leaf::Kind::Double)
+			return compare(*data.template dataT<double>(), leaf.d, op);
+		return compare(util::read_int(leaf.field, data), leaf.i, op);
+	}
+
+	/// Evaluate node with three-valued logic, nullopt is unknown result of unresolved path or bad value
+	std::optional<bool> eval(const Program &p, int idx)
+	{
+		auto & n = _nodes[idx];
+		switch (n.type) {
+		case Node::Type::And:
+		case Node::Type::Or: {
+			// Value that decides result regardless of the other operand
+			const bool decisive = n.type == Node::Type::Or;
+			auto l = eval(p, n.left);
+			if (l == decisive)
+				return decisive;
+			auto r = eval(p, n.right);
+			if (r == decisive)
+				return decisive;
+			if (!l || !r)
+				return std::nullopt;
+			return !decisive;
+		}
+		case Node::Type::Not:
+			if (auto r = eval(p, n.left); r)
+				return !*r;
+			return std::nullopt;
+		case Node::Type::Compare:
+			if (!p.leaves[idx].field)
+				return std::nullopt;
+			return compare(p.leaves[idx], _values[idx], n.op);
+		}
+		return false;
+	}
+};
+
+} // namespace tll::bson::filter
+
+#endif//_TLL_BSON_FILTER_H
@@ -0,0 +1,566 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_INFO_H
+#define _TLL_BSON_INFO_H
+
+#include <tll/scheme.h>
+
+#include "tll/bson/error-stack.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::bson {
+
+/// Map from BSON key to scheme field, contains both field names and aliases
+using KeyIndex = std::unordered_map<std::string_view, const tll::scheme::Field *>;
+
+struct UnionInfo
+{
+	KeyIndex index;
+};
+
+/// Enum name tables, direct table for dense enums and hash for sparse ones
+struct EnumInfo
+{
+	/// Maximum span of dense table
+	static constexpr long long dense_limit = 256;
+
+	long long min = 0;
+	std::vector<std::string_view> dense;
+	std::unordered_map<long long, std::string_view> sparse;
+	std::unordered_map<std::string_view, long long> values;
+
+	/// Get name of the value, empty string if value is not in enum
+	std::string_view name(long long v) const
+	{
+		if (dense.size()) {
+			if (v < min || v - min >= (long long) dense.size())
+				return {};
+			return dense[v - min];
+		}
+		if (auto it = sparse.find(v); it != sparse.end())
+			return it->second;
+		return {};
+	}
+
+	std::optional<long long> value(std::string_view name) const
+	{
+		if (auto it = values.find(name); it != values.end())
+			return it->second;
+		return std::nullopt;
+	}
+};
+
+struct BitsInfo
+{
+	struct Bit
+	{
+		std::string_view name;
+		unsigned offset;
+		unsigned long long mask;
+	};
+
+	std::vector<Bit> bits;
+	std::unordered_map<std::string_view, const Bit *> index;
+};
+
+struct FieldInfo
+{
+	/// Key used in BSON document: field name or bson.key option
+	std::string key;
+	/// Position of the field in message or union
+	unsigned index = 0;
+	/// Key index of union type, for union fields
+	const UnionInfo * type_union = nullptr;
+	/// Name tables for enum fields
+	const EnumInfo * type_enum = nullptr;
+	/// Name tables for bits fields
+	const BitsInfo * type_bits = nullptr;
+	/// Bytes or pointer field holds pre-encoded BSON document, options.type: bson
+	bool raw_bson = false;
+	/// Value has no pointers inside and can be compared or copied as raw bytes
+	bool plain = true;
+
+	/// Resolution of time point field in nanoseconds
+	long long time_ns = 0;
+	/// Multiplier and divisor that convert time point value to milliseconds, one of them is 1
+	long long time_mul = 1;
+	long long time_div = 1;
+	/// Multiplier that converts sub-millisecond remainder to nanoseconds, 0 for coarse resolutions
+	long long time_rem_mul = 0;
+	/// Companion key for sub-millisecond remainder in nanoseconds, key + "_ns"
+	std::string time_rem_key;
+
+	/// Split time point value into milliseconds and sub-millisecond remainder in nanoseconds
+	std::pair<long long, long long> time_split(long long v) const
+	{
+		return { v * time_mul / time_div, v % time_div * time_rem_mul };
+	}
+
+	std::pair<long long, long long> time_split(double v) const
+	{
+		long long ms = v * time_mul / time_div;
+		if (!time_rem_mul)
+			return { ms, 0 };
+		return { ms, std::llround((v - ms * time_div) * time_rem_mul) };
+	}
+};
+
+/**
+ * Set of fields seen in one document level, indexed by FieldInfo::index
+ *
+ * Small messages use inline words, only messages with more than inline_bits fields allocate.
+ */
+class Presence
+{
+	static constexpr unsigned inline_bits = 256;
+	std::array<uint64_t, inline_bits / 64> _inline = {};
+	std::vector<uint64_t> _spill;
+
+	const uint64_t * words() const { return _spill.size() ? _spill.data() : _inline.data(); }
+	uint64_t * words() { return _spill.size() ? _spill.data() : _inline.data(); }
+
+ public:
+	Presence() = default;
+	explicit Presence(unsigned size)
+	{
+		if (size > inline_bits)
+			_spill.resize((size + 63) / 64);
+	}
+
+	/// Mark field as seen, return false if it was seen before
+	bool insert(unsigned idx)
+	{
+		auto & w = words()[idx / 64];
+		auto bit = 1ull << (idx % 64);
+		if (w & bit)
+			return false;
+		w |= bit;
+		return true;
+	}
+
+	bool contains(unsigned idx) const { return words()[idx / 64] & (1ull << (idx % 64)); }
+
+	/// Find first index that is set in mask but not seen
+	std::optional<unsigned> missing(const std::vector<uint64_t> &mask) const
+	{
+		auto w = words();
+		for (auto i = 0u; i < mask.size(); i++) {
+			if (auto m = mask[i] & ~w[i]; m)
+				return i * 64 + __builtin_ctzll(m);
+		}
+		return std::nullopt;
+	}
+};
+
+struct MessageInfo
+{
+	/// Value of type key in flat mode or nested document key: message name or bson.key option
+	std::string key;
+	/// Position of the message in bound scheme, index for per-message state of encoders
+	unsigned number = 0;
+	/// Key index of message fields
+	KeyIndex index;
+	/// Number of fields in the message
+	unsigned fields_size = 0;
+	/// Index of time point remainder companion keys
+	KeyIndex time_rem_index;
+	/// Bitmap of required fields, options.bson.required, empty if there are none
+	std::vector<uint64_t> required;
+};
+
+/// Get binding info of the field, nullptr if scheme is not bound
+inline const FieldInfo * info(const tll::scheme::Field * field) { return static_cast<const FieldInfo *>(field->user); }
+inline const MessageInfo * info(const tll::scheme::Message * message) { return static_cast<const MessageInfo *>(message->user); }
+
+/// Get BSON key of the field
+inline std::string_view key(const tll::scheme::Field * field)
+{
+	if (auto i = info(field); i)
+		return i->key;
+	return field->name;
+}
+
+/// Get BSON key of the message
+inline std::string_view key(const tll::scheme::Message * message)
+{
+	if (auto i = info(message); i)
+		return i->key;
+	return message->name;
+}
+
+template <typename T>
+std::string_view option(const T * options, std::string_view name)
+{
+	for (auto o = options; o; o = o->next) {
+		if (o->name == name)
+			return o->value;
+	}
+	return {};
+}
+
+/**
+ * Scheme bound for BSON encoding and decoding
+ *
+ * Binding creates private copy of the scheme and attaches FieldInfo and MessageInfo objects to
+ * user pointers of its fields and messages. All lookup tables and pre-encoded keys are built
+ * once here so encoders and decoders don't do any per-message work for them.
+ *
+ * Encoders and decoders accept both plain and bound schemes, plain ones use field and message
+ * names as keys.
+ */
+class SchemeInfo : public ErrorStack
+{
+	tll::scheme::SchemePtr _scheme;
+
+	std::deque<FieldInfo> _fields;
+	std::deque<MessageInfo> _messages;
+	std::unordered_map<const tll::scheme::Union *, UnionInfo> _unions;
+	std::unordered_map<const void *, EnumInfo> _enums;
+	std::unordered_map<const void *, BitsInfo> _bits;
+
+	std::unordered_map<std::string_view, const tll::scheme::Message *> _by_name;
+	std::unordered_map<int, const tll::scheme::Message *> _by_msgid;
+
+ public:
+	/// Largest supported fixed point precision, scale of mantissa must fit into uint64_t util::pow10 table
+	static constexpr unsigned fixed_precision_max = 19;
+
+	SchemeInfo() = default;
+	SchemeInfo(const SchemeInfo &) = delete;
+	SchemeInfo & operator = (const SchemeInfo &) = delete;
+
+	/// Bound copy of the scheme
+	const tll::Scheme * scheme() const { return _scheme.get(); }
+
+	/// Number of messages, upper bound of MessageInfo::number
+	size_t messages_size() const { return _messages.size(); }
+
+	const tll::scheme::Message * lookup(int msgid) const
+	{
+		if (auto it = _by_msgid.find(msgid); it != _by_msgid.end())
+			return it->second;
+		return nullptr;
+	}
+
+	/// Lookup message by name or bson.key alias
+	const tll::scheme::Message * lookup(std::string_view name) const
+	{
+		if (auto it = _by_name.find(name); it != _by_name.end())
+			return it->second;
+		return nullptr;
+	}
+
+	/**
+	 * Check that sub-millisecond remainder of time points can be stored
+	 *
+	 * Remainder companion key exists only for fields of messages and sub-messages, list elements
+	 * and union variants have no place for it. Columnar batches have no companion columns at all,
+	 * so any time point with remainder is rejected there. On failure error is set in ``error``.
+	 */
+	bool check_time_remainder(bool columnar, ErrorStack &error) const
+	{
+		for (auto m = _scheme->messages; m; m = m->next) {
+			if (!m->msgid)
+				continue;
+			for (auto f = m->fields; f; f = f->next) {
+				if (auto lost = time_remainder_lost(f, !columnar, columnar); lost)
+					return error.fail(false, "Sub-millisecond remainder of time point field '{}' in message '{}' can not be stored {}",
+						lost->name, m->name, columnar ? "in columnar batch" : "in list element or union");
+			}
+		}
+		return true;
+	}
+
+	/**
+	 * Get bound scheme shared by all users of identical scheme
+	 *
+	 * Bound schemes are cached by scheme text and kept alive while any user holds the pointer, so
+	 * channels opened on the same scheme share one immutable set of lookup tables. On failure
+	 * nullptr is returned and error is copied into ``error``.
+	 */
+	static std::shared_ptr<const SchemeInfo> shared(const tll::Scheme * scheme, ErrorStack &error)
+	{
+		auto text = scheme->dump("yamls");
+		if (!text)
+			return error.fail(nullptr, "Failed to dump scheme");
+
+		static std::mutex lock;
+		static std::map<std::string, std::weak_ptr<const SchemeInfo>, std::less<>> cache;
+
+		std::unique_lock<std::mutex> guard(lock);
+		if (auto it = cache.find(*text); it != cache.end()) {
+			if (auto ptr = it->second.lock(); ptr)
+				return ptr;
+		}
+
+		for (auto it = cache.begin(); it != cache.end();) {
+			if (it->second.expired())
+				it = cache.erase(it);
+			else
+				it++;
+		}
+
+		auto info = std::make_shared<SchemeInfo>();
+		if (!info->bind(scheme)) {
+			error.error_copy(*info);
+			return nullptr;
+		}
+		cache[*text] = info;
+		return info;
+	}
+
+	bool bind(const tll::Scheme * scheme)
+	{
+		_scheme.reset(scheme->copy());
+		if (!_scheme)
+			return fail(false, "Failed to copy scheme");
+
+		for (auto m = _scheme->messages; m; m = m->next) {
+			if (!bind(m))
+				return false;
+		}
+		return true;
+	}
+
+ private:
+	/// Time point with remainder that has no companion key, ``keyed`` is set for message fields
+	static const tll::scheme::Field * time_remainder_lost(const tll::scheme::Field * field, bool keyed, bool columnar)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Array:
+			return time_remainder_lost(field->type_array, false, columnar);
+		case Field::Pointer:
+			return time_remainder_lost(field->type_ptr, false, columnar);
+		case Field::Message:
+			for (auto f = field->type_msg->fields; f; f = f->next) {
+				if (auto r = time_remainder_lost(f, !columnar, columnar); r)
+					return r;
+			}
+			return nullptr;
+		case Field::Union:
+			for (auto i = 0u; i < field->type_union->fields_size; i++) {
+				if (auto r = time_remainder_lost(field->type_union->fields + i, false, columnar); r)
+					return r;
+			}
+			return nullptr;
+		default:
+			if (!keyed && field->sub_type == Field::TimePoint && info(field) && info(field)->time_rem_mul)
+				return field;
+			return nullptr;
+		}
+	}
+
+	bool bind(tll::scheme::Message * message)
+	{
+		auto & mi = _messages.emplace_back();
+		mi.number = _messages.size() - 1;
+		message->user = &mi;
+		message->user_free = nullptr;
+
+		mi.key = message->name;
+		if (auto k = option(message->options, "bson.key"); k.size())
+			mi.key = k;
+
+		if (!_by_name.emplace(message->name, message).second)
+			return fail(false, "Duplicate message name '{}'", message->name);
+		if (mi.key != message->name && !_by_name.emplace(mi.key, message).second)
+			return fail(false, "Duplicate key '{}' of message '{}'", mi.key, message->name);
+		if (message->msgid)
+			_by_msgid.emplace(message->msgid, message);
+
+		for (auto f = message->fields; f; f = f->next) {
+			if (!bind(f, mi.fields_size++))
+				return fail_field(fail(false, "Failed to bind field of message '{}'", message->name), f);
+			if (!index(mi.index, f))
+				return false;
+			if (auto fi = info(f); fi->time_rem_key.size())
+				mi.time_rem_index.emplace(fi->time_rem_key, f);
+
+			auto required = option(f->options, "bson.required");
+			if (required == "yes" || required == "true") {
+				auto idx = info(f)->index;
+				mi.required.resize(std::max<size_t>(mi.required.size(), (mi.fields_size + 63) / 64));
+				mi.required[idx / 64] |= 1ull << (idx % 64);
+			} else if (required.size() && required != "no" && required != "false")
+				return fail_field(fail(false, "Invalid bson.required value '{}' in message '{}'", required, message->name), f);
+		}
+		return true;
+	}
+
+	bool bind(tll::scheme::Field * field, unsigned idx)
+	{
+		using Field = tll::scheme::Field;
+		auto & fi = _fields.emplace_back();
+		field->user = &fi;
+		field->user_free = nullptr;
+
+		fi.index = idx;
+		fi.key = field->name ? field->name : "";
+		if (auto k = option(field->options, "bson.key"); k.size())
+			fi.key = k;
+
+		if (field->sub_type == Field::Enum)
+			fi.type_enum = bind_enum(field);
+		else if (field->sub_type == Field::Bits)
+			fi.type_bits = bind_bits(field);
+		else if (field->sub_type == Field::TimePoint)
+			bind_time(field, fi);
+		else if (field->sub_type == Field::Fixed && field->fixed_precision > fixed_precision_max)
+			return fail(false, "Fixed point precision {} is not supported, max {}", field->fixed_precision, fixed_precision_max);
+
+		fi.plain = plain(field);
+
+		if (option(field->options, "type") == "bson") {
+			if (field->type != Field::Bytes && field->type != Field::Pointer)
+				return fail(false, "BSON document can be stored only in bytes or pointer field");
+			fi.raw_bson = true;
+		}
+
+		switch (field->type) {
+		case Field::Array:
+			return bind(field->type_array, 0);
+		case Field::Pointer:
+			return bind(field->type_ptr, 0);
+		case Field::Union: {
+			auto u = field->type_union;
+			auto [it, inserted] = _unions.emplace(u, UnionInfo {});
+			fi.type_union = &it->second;
+			if (!inserted)
+				return true;
+			for (auto i = 0u; i < u->fields_size; i++) {
+				auto uf = u->fields + i;
+				if (!bind(uf, i))
+					return fail_field(false, uf);
+				if (!index(it->second.index, uf))
+					return false;
+			}
+			return true;
+		}
+		default:
+			return true;
+		}
+	}
+
+	static bool plain(const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Pointer:
+			return false;
+		case Field::Array:
+			return plain(field->type_array);
+		case Field::Message:
+			for (auto f = field->type_msg->fields; f; f = f->next) {
+				if (!plain(f))
+					return false;
+			}
+			return true;
+		case Field::Union:
+			for (auto i = 0u; i < field->type_union->fields_size; i++) {
+				if (!plain(field->type_union->fields + i))
+					return false;
+			}
+			return true;
+		default:
+			return true;
+		}
+	}
+
+	void bind_time(const tll::scheme::Field * field, FieldInfo & fi)
+	{
+		// Resolution in nanoseconds
+		long long ns = 1;
+		switch (field->time_resolution) {
+		case TLL_SCHEME_TIME_NS: ns = 1; break;
+		case TLL_SCHEME_TIME_US: ns = 1000; break;
+		case TLL_SCHEME_TIME_MS: ns = 1000000; break;
+		case TLL_SCHEME_TIME_SECOND: ns = 1000000000ll; break;
+		case TLL_SCHEME_TIME_MINUTE: ns = 60 * 1000000000ll; break;
+		case TLL_SCHEME_TIME_HOUR: ns = 3600 * 1000000000ll; break;
+		case TLL_SCHEME_TIME_DAY: ns = 86400 * 1000000000ll; break;
+		}
+		fi.time_ns = ns;
+		constexpr long long ms = 1000000;
+		if (ns < ms) {
+			fi.time_div = ms / ns;
+			fi.time_rem_mul = ns;
+			fi.time_rem_key = fi.key + "_ns";
+		} else
+			fi.time_mul = ns / ms;
+	}
+
+	const EnumInfo * bind_enum(const tll::scheme::Field * field)
+	{
+		auto [it, inserted] = _enums.emplace(field->type_enum, EnumInfo {});
+		auto & ei = it->second;
+		if (!inserted)
+			return &ei;
+
+		long long min = 0, max = 0;
+		size_t count = 0;
+		for (auto v = field->type_enum->values; v; v = v->next) {
+			long long value = v->value;
+			if (count++ == 0)
+				min = max = value;
+			min = std::min(min, value);
+			max = std::max(max, value);
+			ei.values.emplace(v->name, value);
+		}
+
+		// Range of int64 enum may not fit into signed difference
+		if (count && (unsigned long long) max - (unsigned long long) min < (unsigned long long) EnumInfo::dense_limit) {
+			ei.min = min;
+			ei.dense.resize(max - min + 1);
+			for (auto v = field->type_enum->values; v; v = v->next)
+				ei.dense[v->value - min] = v->name;
+		} else {
+			for (auto v = field->type_enum->values; v; v = v->next)
+				ei.sparse.emplace(v->value, v->name);
+		}
+		return &ei;
+	}
+
+	const BitsInfo * bind_bits(const tll::scheme::Field * field)
+	{
+		auto [it, inserted] = _bits.emplace(field->bitfields, BitsInfo {});
+		auto & bi = it->second;
+		if (!inserted)
+			return &bi;
+
+		for (auto b = field->bitfields; b; b = b->next) {
+			auto mask = b->size >= 64 ? ~0ull : ((1ull << b->size) - 1);
+			bi.bits.push_back({ b->name, b->offset, mask });
+		}
+		for (auto & b : bi.bits)
+			bi.index.emplace(b.name, &b);
+		return &bi;
+	}
+
+	bool index(KeyIndex &index, const tll::scheme::Field * field)
+	{
+		auto k = key(field);
+		if (!index.emplace(k, field).second)
+			return fail(false, "Duplicate key '{}' for field '{}'", k, field->name);
+		if (k != field->name && !index.emplace(field->name, field).second)
+			return fail(false, "Field name '{}' clashes with other field key", field->name);
+		return true;
+	}
+};
+
+} // namespace tll::bson
+
+#endif//_TLL_BSON_INFO_H
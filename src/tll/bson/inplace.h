@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_INPLACE_H
+#define _TLL_BSON_INPLACE_H
+
+#include <tll/channel.h>
+#include <tll/util/memoryview.h>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace tll::bson::inplace {
+
+/**
+ * In-place write extension of child channel
+ *
+ * Channel that owns its output memory (shared memory or ring buffer) can implement this interface
+ * so codec encodes directly into it instead of posting a message that is copied once more.
+ * Reserved memory is valid until next reserve or commit call, reservation that is not committed
+ * is dropped.
+ */
+struct Writer
+{
+	virtual ~Writer() = default;
+
+	/// Reserve at least ``size`` bytes, return empty memory if it is not possible now
+	virtual tll::memory reserve(size_t size) = 0;
+	/// Commit message with data located at the start of reserved memory, flags are the same as in post
+	virtual int commit(const tll_msg_t * msg, int flags) = 0;
+};
+
+/// Get writer of the channel object
+using Getter = Writer * (*)(tll_channel_t *);
+
+inline std::mutex & registry_lock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+inline std::unordered_map<const tll_channel_impl_t *, Getter> & registry()
+{
+	static std::unordered_map<const tll_channel_impl_t *, Getter> map;
+	return map;
+}
+
+/// Register channel implementation that supports in-place writes
+inline void reg(const tll_channel_impl_t * impl, Getter getter)
+{
+	std::unique_lock<std::mutex> lock(registry_lock());
+	registry()[impl] = getter;
+}
+
+inline void unreg(const tll_channel_impl_t * impl)
+{
+	std::unique_lock<std::mutex> lock(registry_lock());
+	registry().erase(impl);
+}
+
+/// Writer of the channel, nullptr if its implementation is not registered
+inline Writer * lookup(tll_channel_t * c)
+{
+	std::unique_lock<std::mutex> lock(registry_lock());
+	if (auto it = registry().find(c->impl); it != registry().end())
+		return it->second(c);
+	return nullptr;
+}
+
+} // namespace tll::bson::inplace
+
+#endif//_TLL_BSON_INPLACE_H
@@ -0,0 +1,576 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_JSON_H
+#define _TLL_BSON_JSON_H
+
+#include <bson/bson.h>
+
+#include <tll/scheme.h>
+
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+#include "tll/bson/util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace tll::bson::json {
+
+/**
+ * Transcoder of BSON documents into MongoDB Extended JSON v2
+ *
+ * Document is walked once and JSON text is written into internal buffer that is reused between
+ * calls, no intermediate tll message is created. Relaxed mode gives plain JSON numbers and ISO-8601
+ * dates, canonical mode wraps each typed value so it can be converted back without loss.
+ *
+ * In relaxed mode bound scheme is used as a hint for known keys: integer enums are written as
+ * names, fixed point mantissas and fixed point Decimal128 values as decimal numbers and integer
+ * time points as dates. Canonical mode ignores the scheme, its output depends only on BSON types.
+ */
+class Transcoder : public ErrorStack
+{
+	using Field = tll::scheme::Field;
+
+	std::vector<char> _buf;
+	bool _hints = false;
+
+ public:
+	enum class Mode { Relaxed, Canonical };
+
+	/// Default nesting depth limit, same as in libbson JSON writer
+	static constexpr unsigned default_depth = 100;
+
+	Mode mode = Mode::Relaxed;
+	/**
+	 * Only depth limit is used, other limits are not relevant for transcoding. Depth is limited to
+	 * default_depth so hostile documents can not exhaust stack with recursion, zero disables the
+	 * limit.
+	 */
+	util::Limits limits;
+
+	Transcoder() { limits.depth = default_depth; }
+
+	/**
+	 * Transcode top level document, message is found by type key or nested document key as in
+	 * decode. Scheme ``info`` can be nullptr, then no hints are used. Result is valid until next call.
+	 */
+	std::optional<std::string_view> transcode(const util::Settings &settings, const SchemeInfo * info, const void * data, size_t size)
+	{
+		error_clear();
+		_buf.resize(0);
+		_hints = info && mode == Mode::Relaxed;
+
+		bson_iter_t iter;
+		if (!bson_iter_init_from_data(&iter, (const uint8_t *) data, size))
+			return fail(std::nullopt, "Failed to bind BSON buffer");
+
+		if (!_hints) {
+			if (!document(&iter, nullptr, 0))
+				return std::nullopt;
+			return std::string_view(_buf.data(), _buf.size());
+		}
+
+		if (settings.mode == util::Settings::Mode::Flat) {
+			const KeyIndex * index = nullptr;
+			auto scan = iter;
+			while (bson_iter_next(&scan)) {
+				if (settings.type_key != std::string_view(bson_iter_key_unsafe(&scan), bson_iter_key_len(&scan)))
+					continue;
+				if (bson_iter_type(&scan) == BSON_TYPE_UTF8) {
+					uint32_t len;
+					auto name = bson_iter_utf8(&scan, &len);
+					if (auto m = info->lookup(std::string_view(name, len)); m)
+						index = &bson::info(m)->index;
+				}
+				break;
+			}
+			if (!document(&iter, index, 0))
+				return std::nullopt;
+			return std::string_view(_buf.data(), _buf.size());
+		}
+
+		// Nested mode, each known top level key is a message document
+		_buf.push_back('{');
+		bool first = true;
+		while (bson_iter_next(&iter)) {
+			if (!first)
+				_buf.push_back(',');
+			first = false;
+			std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+			string(key.data(), key.size());
+			_buf.push_back(':');
+			auto m = info->lookup(key);
+			bool r;
+			if (m && m->msgid && bson_iter_type(&iter) == BSON_TYPE_DOCUMENT)
+				r = child(&iter, &bson::info(m)->index, nullptr, 1);
+			else
+				r = value(&iter, nullptr, 1);
+			if (!r)
+				return std::nullopt;
+		}
+		_buf.push_back('}');
+		return std::string_view(_buf.data(), _buf.size());
+	}
+
+	/// Transcode document without scheme
+	std::optional<std::string_view> transcode(const void * data, size_t size)
+	{
+		return transcode(util::Settings::defaults(), nullptr, data, size);
+	}
+
+ private:
+	void append(const char * data, size_t size) { _buf.insert(_buf.end(), data, data + size); }
+	void append(std::string_view s) { append(s.data(), s.size()); }
+
+	template <typename T>
+	void integer(T v)
+	{
+		fmt::format_int f(v);
+		append(f.data(), f.size());
+	}
+
+	/// Integer wrapped into quotes, used for canonical $numberInt and $numberLong values
+	template <typename T>
+	void wrapped(std::string_view key, T v)
+	{
+		_buf.push_back('{');
+		append(key);
+		_buf.push_back('"');
+		integer(v);
+		append("\"}");
+	}
+
+	static bool escaped(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+
+	/// Length of prefix that does not need escaping, checked 8 bytes at a time
+	static size_t plain_prefix(const char * data, size_t size)
+	{
+		constexpr uint64_t ones = 0x0101010101010101ull;
+		constexpr uint64_t high = 0x8080808080808080ull;
+		size_t i = 0;
+		for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+			uint64_t v;
+			memcpy(&v, data + i, sizeof(v));
+			auto quote = v ^ (ones * '"');
+			auto slash = v ^ (ones * '\\');
+			// High bit is set for bytes below 0x20 and for zero bytes of quote and slash words
+			auto m = ((v - ones * 0x20) & ~v) | ((quote - ones) & ~quote) | ((slash - ones) & ~slash);
+			if (m & high)
+				break;
+		}
+		for (; i < size; i++) {
+			if (escaped(data[i]))
+				break;
+		}
+		return i;
+	}
+
+	/// Quoted JSON string, non-ASCII bytes are copied as is
+	void string(const char * data, size_t size)
+	{
+		static constexpr char hex[] = "0123456789abcdef";
+		_buf.push_back('"');
+		auto end = data + size;
+		while (data < end) {
+			auto len = plain_prefix(data, end - data);
+			append(data, len);
+			data += len;
+			if (data == end)
+				break;
+			unsigned char c = *data++;
+			switch (c) {
+			case '"': append("\\\""); break;
+			case '\\': append("\\\\"); break;
+			case '\b': append("\\b"); break;
+			case '\f': append("\\f"); break;
+			case '\n': append("\\n"); break;
+			case '\r': append("\\r"); break;
+			case '\t': append("\\t"); break;
+			default: {
+				char u[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+				append(u, sizeof(u));
+			}
+			}
+		}
+		_buf.push_back('"');
+	}
+
+	void string(std::string_view s) { string(s.data(), s.size()); }
+
+	void base64(const uint8_t * data, size_t size)
+	{
+		static constexpr char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+		_buf.push_back('"');
+		for (; size >= 3; size -= 3, data += 3) {
+			uint32_t v = (data[0] << 16) | (data[1] << 8) | data[2];
+			char out[] = { table[v >> 18], table[(v >> 12) & 63], table[(v >> 6) & 63], table[v & 63] };
+			append(out, sizeof(out));
+		}
+		if (size) {
+			uint32_t v = (data[0] << 16) | (size > 1 ? data[1] << 8 : 0);
+			char out[] = { table[v >> 18], table[(v >> 12) & 63], size > 1 ? table[(v >> 6) & 63] : '=', '=' };
+			append(out, sizeof(out));
+		}
+		_buf.push_back('"');
+	}
+
+	void oid(const bson_oid_t * oid)
+	{
+		char str[25];
+		bson_oid_to_string(oid, str);
+		append("{\"$oid\":\"");
+		append(str, 24);
+		append("\"}");
+	}
+
+	/// Shortest representation that is parsed back into same double, integral values get .0 suffix
+	void number(double v)
+	{
+		auto size = _buf.size();
+		fmt::format_to(std::back_inserter(_buf), "{}", v);
+		if (std::find_if(_buf.begin() + size, _buf.end(), [](char c) { return c == '.' || c == 'e'; }) == _buf.end())
+			append(".0");
+	}
+
+	void number_double(double v)
+	{
+		if (mode == Mode::Relaxed && std::isfinite(v) && !(v == 0 && std::signbit(v)))
+			return number(v);
+		append("{\"$numberDouble\":\"");
+		if (std::isnan(v))
+			append("NaN");
+		else if (std::isinf(v))
+			append(v > 0 ? "Infinity" : "-Infinity");
+		else
+			number(v);
+		append("\"}");
+	}
+
+	/// Fixed point value mantissa * 10^-precision as JSON number, precision is limited by 64 bit mantissa
+	bool fixed(long long mantissa, unsigned precision)
+	{
+		if (precision >= std::size(util::pow10))
+			return fail(false, "Fixed point precision {} is too large", precision);
+		if (!precision) {
+			integer(mantissa);
+			return true;
+		}
+		uint64_t v = mantissa < 0 ? -(uint64_t) mantissa : mantissa;
+		if (mantissa < 0)
+			_buf.push_back('-');
+		integer(v / util::pow10[precision]);
+		_buf.push_back('.');
+		fmt::format_int frac(v % util::pow10[precision]);
+		_buf.insert(_buf.end(), precision - frac.size(), '0');
+		append(frac.data(), frac.size());
+		return true;
+	}
+
+	/// Relaxed dates between 1970 and 9999 years are written in ISO-8601 format
+	void date(long long ms)
+	{
+		constexpr long long max = 253402300800000ll; // 10000-01-01
+		if (mode == Mode::Canonical || ms < 0 || ms >= max) {
+			append("{\"$date\":");
+			wrapped("\"$numberLong\":", ms);
+			_buf.push_back('}');
+			return;
+		}
+		time_t sec = ms / 1000;
+		tm t;
+		gmtime_r(&sec, &t);
+		fmt::format_to(std::back_inserter(_buf), "{{\"$date\":\"{:04d}-{:02d}-{:02d}T{:02d}:{:02d}:{:02d}.{:03d}Z\"}}",
+			t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, (int) (ms % 1000));
+	}
+
+	/// Integer value with scheme hints, returns false if hint is not applicable and nullopt on error
+	std::optional<bool> hinted(const Field * field, long long v)
+	{
+		switch (field->sub_type) {
+		case Field::Enum:
+			if (auto fi = info(field); fi && fi->type_enum) {
+				if (auto name = fi->type_enum->name(v); name.size()) {
+					string(name);
+					return true;
+				}
+			}
+			return false;
+		case Field::Fixed:
+			if (!fixed(v, field->fixed_precision))
+				return std::nullopt;
+			return true;
+		case Field::TimePoint:
+			if (auto fi = info(field); fi) {
+				date(fi->time_split(v).first);
+				return true;
+			}
+			return false;
+		default:
+			return false;
+		}
+	}
+
+	/// Key index of sub-document for field hint: message fields or union variants
+	static const KeyIndex * index(const Field * field)
+	{
+		if (!field)
+			return nullptr;
+		auto fi = info(field);
+		if (!fi || fi->raw_bson)
+			return nullptr;
+		if (field->type == Field::Message)
+			return &info(field->type_msg)->index;
+		if (field->type == Field::Union)
+			return &fi->type_union->index;
+		return nullptr;
+	}
+
+	/// Element hint of array field
+	static const Field * element(const Field * field)
+	{
+		if (!field || (info(field) && info(field)->raw_bson))
+			return nullptr;
+		if (field->type == Field::Array)
+			return field->type_array;
+		if (field->type == Field::Pointer && field->sub_type != Field::ByteString)
+			return field->type_ptr;
+		return nullptr;
+	}
+
+	bool document(bson_iter_t * iter, const KeyIndex * index, unsigned depth)
+	{
+		if (limits.depth && depth > limits.depth)
+			return fail(false, "Nesting depth limit {} exceeded", limits.depth);
+		_buf.push_back('{');
+		bool first = true;
+		while (bson_iter_next(iter)) {
+			if (!first)
+				_buf.push_back(',');
+			first = false;
+			std::string_view key = { bson_iter_key_unsafe(iter), bson_iter_key_len(iter) };
+			string(key.data(), key.size());
+			_buf.push_back(':');
+			const Field * field = nullptr;
+			if (index) {
+				if (auto it = index->find(key); it != index->end())
+					field = it->second;
+			}
+			if (!value(iter, field, depth + 1))
+				return field ? fail_field(false, field) : false;
+		}
+		_buf.push_back('}');
+		return true;
+	}
+
+	bool array(bson_iter_t * iter, const Field * field, unsigned depth)
+	{
+		if (limits.depth && depth > limits.depth)
+			return fail(false, "Nesting depth limit {} exceeded", limits.depth);
+		_buf.push_back('[');
+		size_t idx = 0;
+		while (bson_iter_next(iter)) {
+			if (idx)
+				_buf.push_back(',');
+			if (!value(iter, field, depth + 1))
+				return fail_index(false, idx);
+			idx++;
+		}
+		_buf.push_back(']');
+		return true;
+	}
+
+	/// Sub-document or array value, with key index for documents or element hint for arrays
+	bool child(const bson_iter_t * iter, const KeyIndex * index, const Field * field, unsigned depth)
+	{
+		const uint8_t * data;
+		uint32_t len;
+		bson_iter_t it;
+		if (bson_iter_type(iter) == BSON_TYPE_ARRAY) {
+			bson_iter_array(iter, &len, &data);
+			if (!bson_iter_init_from_data(&it, data, len))
+				return fail(false, "Failed to init BSON array iterator");
+			return array(&it, field, depth);
+		}
+		bson_iter_document(iter, &len, &data);
+		if (!bson_iter_init_from_data(&it, data, len))
+			return fail(false, "Failed to init BSON document iterator");
+		return document(&it, index, depth);
+	}
+
+	bool value(const bson_iter_t * iter, const Field * field, unsigned depth)
+	{
+		if (!_hints)
+			field = nullptr;
+		switch (bson_iter_type(iter)) {
+		case BSON_TYPE_DOCUMENT:
+			return child(iter, index(field), nullptr, depth);
+		case BSON_TYPE_ARRAY:
+			return child(iter, nullptr, element(field), depth);
+		case BSON_TYPE_UTF8: {
+			uint32_t len;
+			auto ptr = bson_iter_utf8(iter, &len);
+			string(ptr, len);
+			return true;
+		}
+		case BSON_TYPE_INT32: {
+			auto v = bson_iter_int32_unsafe(iter);
+			if (field) {
+				auto r = hinted(field, v);
+				if (!r)
+					return false;
+				if (*r)
+					return true;
+			}
+			if (mode == Mode::Canonical)
+				wrapped("\"$numberInt\":", v);
+			else
+				integer(v);
+			return true;
+		}
+		case BSON_TYPE_INT64: {
+			auto v = bson_iter_int64_unsafe(iter);
+			if (field) {
+				auto r = hinted(field, v);
+				if (!r)
+					return false;
+				if (*r)
+					return true;
+			}
+			if (mode == Mode::Canonical)
+				wrapped("\"$numberLong\":", v);
+			else
+				integer(v);
+			return true;
+		}
+		case BSON_TYPE_DOUBLE: {
+			auto v = bson_iter_double_unsafe(iter);
+			if (field && field->sub_type == Field::TimePoint && info(field) && std::isfinite(v)) {
+				date(info(field)->time_split(v).first);
+				return true;
+			}
+			number_double(v);
+			return true;
+		}
+		case BSON_TYPE_DECIMAL128: {
+			bson_decimal128_t d;
+			bson_iter_decimal128_unsafe(iter, &d);
+			if (field && field->sub_type == Field::Fixed) {
+				if (auto v = util::decimal128_to_fixed({ d.low, d.high }, field->fixed_precision); v)
+					return fixed(*v, field->fixed_precision);
+			}
+			char str[BSON_DECIMAL128_STRING];
+			bson_decimal128_to_string(&d, str);
+			append("{\"$numberDecimal\":");
+			string(str, strlen(str));
+			_buf.push_back('}');
+			return true;
+		}
+		case BSON_TYPE_BOOL:
+			append(bson_iter_bool_unsafe(iter) ? "true" : "false");
+			return true;
+		case BSON_TYPE_NULL:
+			append("null");
+			return true;
+		case BSON_TYPE_UNDEFINED:
+			append("{\"$undefined\":true}");
+			return true;
+		case BSON_TYPE_DATE_TIME:
+			date(bson_iter_date_time(iter));
+			return true;
+		case BSON_TYPE_OID:
+			oid(bson_iter_oid(iter));
+			return true;
+		case BSON_TYPE_BINARY: {
+			bson_subtype_t sub;
+			uint32_t len;
+			const uint8_t * ptr;
+			bson_iter_binary(iter, &sub, &len, &ptr);
+			append("{\"$binary\":{\"base64\":");
+			base64(ptr, len);
+			fmt::format_to(std::back_inserter(_buf), ",\"subType\":\"{:02x}\"}}}}", (unsigned) sub);
+			return true;
+		}
+		case BSON_TYPE_REGEX: {
+			const char * options;
+			auto regex = bson_iter_regex(iter, &options);
+			append("{\"$regularExpression\":{\"pattern\":");
+			string(regex, strlen(regex));
+			append(",\"options\":");
+			string(options, strlen(options));
+			append("}}");
+			return true;
+		}
+		case BSON_TYPE_TIMESTAMP: {
+			uint32_t t, i;
+			bson_iter_timestamp(iter, &t, &i);
+			append("{\"$timestamp\":{\"t\":");
+			integer(t);
+			append(",\"i\":");
+			integer(i);
+			append("}}");
+			return true;
+		}
+		case BSON_TYPE_CODE: {
+			uint32_t len;
+			auto code = bson_iter_code(iter, &len);
+			append("{\"$code\":");
+			string(code, len);
+			_buf.push_back('}');
+			return true;
+		}
+		case BSON_TYPE_CODEWSCOPE: {
+			uint32_t len, slen;
+			const uint8_t * scope;
+			auto code = bson_iter_codewscope(iter, &len, &slen, &scope);
+			append("{\"$code\":");
+			string(code, len);
+			append(",\"$scope\":");
+			bson_iter_t it;
+			if (!bson_iter_init_from_data(&it, scope, slen))
+				return fail(false, "Failed to init BSON scope iterator");
+			if (!document(&it, nullptr, depth))
+				return false;
+			_buf.push_back('}');
+			return true;
+		}
+		case BSON_TYPE_SYMBOL: {
+			uint32_t len;
+			auto sym = bson_iter_symbol(iter, &len);
+			append("{\"$symbol\":");
+			string(sym, len);
+			_buf.push_back('}');
+			return true;
+		}
+		case BSON_TYPE_DBPOINTER: {
+			uint32_t len;
+			const char * coll;
+			const bson_oid_t * id;
+			bson_iter_dbpointer(iter, &len, &coll, &id);
+			append("{\"$dbPointer\":{\"$ref\":");
+			string(coll, len);
+			append(",\"$id\":");
+			oid(id);
+			append("}}");
+			return true;
+		}
+		case BSON_TYPE_MINKEY:
+			append("{\"$minKey\":1}");
+			return true;
+		case BSON_TYPE_MAXKEY:
+			append("{\"$maxKey\":1}");
+			return true;
+		default:
+			return fail(false, "Unsupported BSON type: {}", (int) bson_iter_type(iter));
+		}
+	}
+};
+
+} // namespace tll::bson::json
+
+#endif//_TLL_BSON_JSON_H
@@ -11,8 +11,12 @@
 #include <tll/util/memoryview.h>
 
 #include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
 #include "tll/bson/util.h"
 
+#include <algorithm>
+#include <cmath>
+
 namespace tll::bson::libbson {
 
 using Settings = util::Settings;
@@ -21,22 +25,33 @@ struct Encoder : public ErrorStack
 {
 	bson_t _bson = BSON_INITIALIZER;
 
+	/// Generator of id_key values
+	util::ObjectId _oid;
+
+	/// Settings of current encode call, used by nested encode functions
+	const Settings * _settings = &Settings::defaults();
+
 	~Encoder() { bson_destroy(&_bson); }
 
 	void init() {}
 
 	std::optional<tll::const_memory> encode(const Settings &settings, const tll::scheme::Message * message, const tll_msg_t * msg)
 	{
+		_settings = &settings;
 		bson_reinit(&_bson);
+		if (settings.id_key.size())
+			bson_append_oid(&_bson, settings.id_key.data(), settings.id_key.size(), (const bson_oid_t *) _oid.next().data());
 		if (settings.seq_key.size())
 			bson_append_int64(&_bson, settings.seq_key.data(), settings.seq_key.size(), msg->seq);
 		if (settings.mode == Settings::Mode::Flat) {
-			bson_append_utf8(&_bson, settings.type_key.data(), settings.type_key.size(), message->name, strlen(message->name));
+			auto name = key(message);
+			bson_append_utf8(&_bson, settings.type_key.data(), settings.type_key.size(), name.data(), name.size());
 			if (!encode(&_bson, message, tll::make_view(*msg)))
 				return std::nullopt;
 		} else {
 			bson_t child;
-			if (!bson_append_document_begin(&_bson, message->name, strlen(message->name), &child))
+			auto name = key(message);
+			if (!bson_append_document_begin(&_bson, name.data(), name.size(), &child))
 				return fail(std::nullopt, "Failed to init nested document");
 			if (!encode(&child, message, tll::make_view(*msg)))
 				return std::nullopt;
@@ -54,14 +69,111 @@ struct Encoder : public ErrorStack
 
 	template <typename Buf>
 	bool encode_list(bson_t * bson, const tll::scheme::Field * field, std::string_view key, size_t size, size_t entity, const Buf & buf);
+
+	template <typename Buf>
+	std::string_view enum_name(const tll::scheme::Field * field, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->type_enum)
+			return {};
+		return fi->type_enum->name(util::read_int(field, data));
+	}
+
+	/// Encode bits as array of set bit names, bit fields wider then one bit as ``{name: value}`` documents
+	template <typename Buf>
+	bool encode_bits(bson_t * bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
+	{
+		auto bits = info(field)->type_bits;
+		unsigned long long v = util::read_int(field, data);
+		bson_t child;
+		if (!bson_append_array_begin(bson, key.data(), key.size(), &child))
+			return fail(false, "Failed to init array");
+		std::array<char, 10> idxbuf;
+		auto idx = 0u;
+		for (auto & b : bits->bits) {
+			auto bv = (v >> b.offset) & b.mask;
+			if (!bv)
+				continue;
+			auto k = util::uint_to_string(idx++, idxbuf);
+			if (b.mask == 1) {
+				if (!bson_append_utf8(&child, k.data(), k.size(), b.name.data(), b.name.size()))
+					return fail(false, "Failed to append bit name");
+				continue;
+			}
+			bson_t value;
+			if (!bson_append_document_begin(&child, k.data(), k.size(), &value))
+				return fail(false, "Failed to init bit value document");
+			if (!bson_append_int64(&value, b.name.data(), b.name.size(), bv))
+				return fail(false, "Failed to append bit value");
+			if (!bson_append_document_end(&child, &value))
+				return fail(false, "Failed to finalize bit value document");
+		}
+		if (!bson_append_array_end(bson, &child))
+			return fail(false, "Failed to finalize array");
+		return true;
+	}
+
+	template <typename Buf>
+	bool encode_time(bson_t * bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
+	{
+		auto fi = info(field);
+		std::pair<long long, long long> v;
+		if (field->type == tll::scheme::Field::Double)
+			v = fi->time_split(*data.template dataT<double>());
+		else
+			v = fi->time_split(util::read_int(field, data));
+		if (!bson_append_date_time(bson, key.data(), key.size(), v.first))
+			return fail(false, "Failed to append datetime");
+		return true;
+	}
+
+	/// Splice pre-encoded document after checking its length
+	bool encode_raw(bson_t * bson, std::string_view key, const void * data, size_t size)
+	{
+		auto doc = util::raw_document(data, size);
+		if (!doc)
+			return fail(false, "Invalid BSON document in field of size {}", size);
+		bson_t child;
+		if (!bson_init_static(&child, (const uint8_t *) doc->data(), doc->size()))
+			return fail(false, "Failed to init BSON document");
+		if (!bson_append_document(bson, key.data(), key.size(), &child))
+			return fail(false, "Failed to append BSON document");
+		return true;
+	}
+
+	/// Append sub-millisecond remainder of time point field of message or sub-message, skipped if zero
+	template <typename Buf>
+	bool encode_time_remainder(bson_t * bson, const tll::scheme::Field * field, const Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->time_rem_mul)
+			return true;
+		std::pair<long long, long long> v;
+		if (field->type == tll::scheme::Field::Double)
+			v = fi->time_split(*data.template dataT<double>());
+		else
+			v = fi->time_split(util::read_int(field, data));
+		if (!v.second)
+			return true;
+		auto & rk = fi->time_rem_key;
+		if (!bson_append_int32(bson, rk.data(), rk.size(), v.second))
+			return fail(false, "Failed to append datetime remainder");
+		return true;
+	}
 };
 
 template <typename Buf>
 bool Encoder::encode(bson_t * bson, const tll::scheme::Message * message, const Buf & buf)
 {
 	for (auto f = message->fields; f; f = f->next) {
-		if (!encode(bson, f, f->name, buf.view(f->offset)))
+		if (_settings->sparse && util::is_default(f, buf.view(f->offset)))
+			continue;
+		if (!encode(bson, f, key(f), buf.view(f->offset)))
 			return fail_field(false, f);
+		if (f->sub_type == tll::scheme::Field::TimePoint && _settings->time_datetime && _settings->time_remainder) {
+			if (!encode_time_remainder(bson, f, buf.view(f->offset)))
+				return fail_field(false, f);
+		}
 	}
 	return true;
 }
@@ -70,6 +182,33 @@ template <typename Buf>
 bool Encoder::encode(bson_t * bson, const tll::scheme::Field * field, std::string_view key, const Buf & data)
 {
 	using Field = tll::scheme::Field;
+	switch (field->sub_type) {
+	case Field::Enum:
+		if (_settings->enum_string) {
+			if (auto name = enum_name(field, data); name.size())
+				return bson_append_utf8(bson, key.data(), key.size(), name.data(), name.size());
+		}
+		break;
+	case Field::Bits:
+		if (_settings->bits_string && info(field) && info(field)->type_bits)
+			return encode_bits(bson, field, key, data);
+		break;
+	case Field::TimePoint:
+		if (_settings->time_datetime && info(field))
+			return encode_time(bson, field, key, data);
+		break;
+	case Field::Fixed:
+		if (_settings->fixed == Settings::Fixed::Decimal128) {
+			auto d = util::fixed_to_decimal128(util::read_int(field, data), field->fixed_precision);
+			bson_decimal128_t v = { d.low, d.high };
+			return bson_append_decimal128(bson, key.data(), key.size(), &v);
+		} else if (_settings->fixed == Settings::Fixed::Double)
+			return bson_append_double(bson, key.data(), key.size(), (double) util::read_int(field, data) / util::pow10[field->fixed_precision]);
+		break;
+	default:
+		break;
+	}
+
 	switch (field->type) {
 	case Field::Int8:
 		return bson_append_int32(bson, key.data(), key.size(), *data.template dataT<int8_t>());
@@ -97,6 +236,8 @@ bool Encoder::encode(bson_t * bson, const tll::scheme::Field * field, std::strin
 			auto ptr = data.template dataT<char>();
 			return bson_append_utf8(bson, key.data(), key.size(), ptr, strnlen(ptr, field->size));
 		}
+		if (auto fi = info(field); fi && fi->raw_bson)
+			return encode_raw(bson, key, data.data(), field->size);
 		return bson_append_binary(bson, key.data(), key.size(), BSON_SUBTYPE_BINARY, data.template dataT<uint8_t>(), field->size);
 
 	case Field::Array: {
@@ -118,6 +259,8 @@ bool Encoder::encode(bson_t * bson, const tll::scheme::Field * field, std::strin
 				return bson_append_utf8(bson, key.data(), key.size(), "", 0);
 			return bson_append_utf8(bson, key.data(), key.size(), data.view(ptr->offset).template dataT<const char>(), ptr->size - 1);
 		}
+		if (auto fi = info(field); fi && fi->raw_bson)
+			return encode_raw(bson, key, data.view(ptr->offset).data(), ptr->size * ptr->entity);
 		return encode_list(bson, field->type_ptr, key, ptr->size, ptr->entity, data.view(ptr->offset));
 	}
 	case Field::Message: {
@@ -140,7 +283,7 @@ bool Encoder::encode(bson_t * bson, const tll::scheme::Field * field, std::strin
 		if (!bson_append_document_begin(bson, key.data(), key.size(), &child))
 			return fail(false, "Failed to init document");
 
-		if (!encode(&child, uf, uf->name, data.view(uf->offset)))
+		if (!encode(&child, uf, tll::bson::key(uf), data.view(uf->offset)))
 			return fail_field(false, uf);
 		if (!bson_append_document_end(bson, &child))
 			return fail(false, "Failed to finish document");
@@ -170,6 +313,89 @@ bool Encoder::encode_list(bson_t * bson, const tll::scheme::Field * field, std::
 
 struct Decoder : public ErrorStack
 {
+	/// Decode limits, checked during the walk
+	util::Limits limits;
+	/// Last error was caused by exceeded limit
+	bool limit_exceeded = false;
+	/// Top level document is partial update of existing message, required fields are not checked
+	bool partial = false;
+	/// Fields present in last partial top level document
+	Presence partial_seen;
+
+	/// Class of decode_document error
+	enum class Reason {
+		Invalid, // Malformed document or metadata
+		Unknown, // Unknown message
+		Decode, // Invalid message body
+		Limit, // Decode limit exceeded
+	} reason = Reason::Decode;
+
+	/**
+	 * Decode top level document: find message by type key or by nested document key, fill msgid
+	 * and seq of ``meta`` and decode message into ``buf`` that is resized to message size.
+	 *
+	 * Returns decoded message or nullptr on error, class of the error is stored in ``reason``.
+	 */
+	template <typename Buf>
+	const tll::scheme::Message * decode_document(const Settings &settings, const SchemeInfo &info, const void * data, size_t size, Buf buf, tll_msg_t * meta);
+
+	/// Reset limit counters before decoding new document of given fixed size
+	void limits_reset(size_t bytes = 0)
+	{
+		_depth = 0;
+		_unknown = 0;
+		_bytes = bytes;
+		limit_exceeded = false;
+	}
+
+	/// Enter nested document or array, leave with DepthGuard
+	bool limit_enter()
+	{
+		if (++_depth > limits.depth && limits.depth)
+			return fail_limit(false, "Nesting depth limit {} exceeded", limits.depth);
+		return true;
+	}
+
+	struct DepthGuard
+	{
+		unsigned &depth;
+		~DepthGuard() { depth--; }
+	};
+
+	bool limit_unknown(std::string_view key)
+	{
+		if (++_unknown > limits.unknown && limits.unknown)
+			return fail_limit(false, "Unknown keys limit {} exceeded at key '{}'", limits.unknown, key);
+		return true;
+	}
+
+	bool limit_bytes(size_t size)
+	{
+		_bytes += size;
+		if (_bytes > limits.bytes && limits.bytes)
+			return fail_limit(false, "Decoded size limit {} exceeded: {}", limits.bytes, _bytes);
+		return true;
+	}
+
+	template <typename R, typename... Args>
+	[[nodiscard]]
+	R fail_limit(R err, format_string<Args...> format, Args && ... args)
+	{
+		limit_exceeded = true;
+		return fail(err, format, std::forward<Args>(args)...);
+	}
+
+	template <typename R, typename... Args>
+	[[nodiscard]]
+	R fail_reason(R err, Reason r, format_string<Args...> format, Args && ... args)
+	{
+		reason = r;
+		return fail(err, format, std::forward<Args>(args)...);
+	}
+
+	/// Maximum allowed pointer list size
+	size_t limit_array() const { return limits.array ? limits.array : std::numeric_limits<size_t>::max(); }
+
 	template <typename Buf>
 	bool decode(bson_iter_t * iter, const tll::scheme::Message * message, Buf buf, const Settings &settings);
 
@@ -179,12 +405,177 @@ struct Decoder : public ErrorStack
 	template <typename Buf>
 	bool decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf buf);
 
+	/// Decode scalar field: integer with enum, bits, time point or fixed subtype, double or decimal128
+	template <typename Buf>
+	bool decode_plain(bson_iter_t * iter, const tll::scheme::Field * field, Buf buf);
+
 	template <typename Buf>
 	bool decode_list(bson_iter_t * iter, const tll::scheme::Field * field, size_t entity, Buf buf);
 
+	/**
+	 * Decode columnar batch document produced by cppbson::Encoder::encode_columnar
+	 *
+	 * Rows must be preallocated with at least count elements, each initialized with message size
+	 * zeroed buffer. Every column must have exactly count elements. Top level type, seq and count
+	 * keys are skipped if settings are passed.
+	 */
+	template <typename Rows>
+	bool decode_columns(bson_iter_t * iter, const tll::scheme::Message * message, Rows &rows, size_t count, size_t offset, const Settings * settings = nullptr);
+
 	template <typename T, typename Buf>
 	bool decode_scalar(bson_iter_t * iter, const tll::scheme::Field * field, Buf & buf);
 
+	template <typename Buf>
+	bool decode_enum(bson_iter_t * iter, const tll::scheme::Field * field, Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->type_enum)
+			return fail(false, "Enum names are not available, scheme is not bound");
+		size_t len;
+		auto str = bson_iter_utf8_unsafe(iter, &len);
+		auto v = fi->type_enum->value({str, len});
+		if (!v)
+			return fail(false, "Unknown enum value '{}'", std::string_view(str, len));
+		util::write_int(field, data, *v);
+		return true;
+	}
+
+	template <typename Buf>
+	bool decode_bits(bson_iter_t * iter, const tll::scheme::Field * field, Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi || !fi->type_bits)
+			return fail(false, "Bit names are not available, scheme is not bound");
+
+		const uint8_t * array;
+		uint32_t len;
+		bson_iter_array(iter, &len, &array);
+		bson_iter_t child;
+		if (!bson_iter_init_from_data(&child, array, len))
+			return fail(false, "Failed to init BSON array iterator");
+		unsigned long long v = 0;
+		while (bson_iter_next(&child)) {
+			if (bson_iter_type(&child) == BSON_TYPE_DOCUMENT) {
+				if (!decode_bits_values(&child, fi->type_bits, v))
+					return false;
+				continue;
+			}
+			auto name = decode_string(&child);
+			if (!name)
+				return fail(false, "Invalid BSON type for bit name: {}", bson_iter_type(&child));
+			auto it = fi->type_bits->index.find(*name);
+			if (it == fi->type_bits->index.end())
+				return fail(false, "Unknown bit '{}'", *name);
+			if (it->second->mask != 1)
+				return fail(false, "Bit field '{}' is wider then one bit, value is required", *name);
+			v |= 1ull << it->second->offset;
+		}
+		util::write_int(field, data, v);
+		return true;
+	}
+
+	/// Decode ``{name: value}`` document of wide bit fields
+	bool decode_bits_values(bson_iter_t * iter, const BitsInfo * bits, unsigned long long &v)
+	{
+		const uint8_t * doc;
+		uint32_t len;
+		bson_iter_document(iter, &len, &doc);
+		bson_iter_t child;
+		if (!bson_iter_init_from_data(&child, doc, len))
+			return fail(false, "Failed to init BSON document iterator");
+		while (bson_iter_next(&child)) {
+			std::string_view name = { bson_iter_key_unsafe(&child), bson_iter_key_len(&child) };
+			auto it = bits->index.find(name);
+			if (it == bits->index.end())
+				return fail(false, "Unknown bit '{}'", name);
+			auto value = decode_int(&child);
+			if (!value)
+				return fail(false, "Invalid BSON type for value of bit '{}': {}", name, bson_iter_type(&child));
+			if ((unsigned long long) *value > it->second->mask)
+				return fail(false, "Value {} does not fit into bit field '{}'", *value, name);
+			v |= (unsigned long long) *value << it->second->offset;
+		}
+		return true;
+	}
+
+	/**
+	 * Decode datetime into time point field
+	 *
+	 * Value is added to the field so sub-millisecond remainder from companion key can be
+	 * merged regardless of key order.
+	 */
+	template <typename Buf>
+	bool decode_time(bson_iter_t * iter, const tll::scheme::Field * field, Buf & data)
+	{
+		auto fi = info(field);
+		if (!fi)
+			return fail(false, "Time resolution is not available, scheme is not bound");
+		long long ms = bson_iter_date_time(iter);
+		if (field->type == tll::scheme::Field::Double)
+			*data.template dataT<double>() += (double) ms * fi->time_div / fi->time_mul;
+		else
+			util::write_int(field, data, util::read_int(field, data) + ms * fi->time_div / fi->time_mul);
+		return true;
+	}
+
+	/**
+	 * Decode Decimal128 or double into fixed point mantissa, value must be exactly representable.
+	 *
+	 * Scaled double is allowed to differ from integer only by rounding error of scaling, relative
+	 * 1e-12 but not less then 1e-6, so 1.15 is accepted for fixed2 and 1.2345 is rejected.
+	 */
+	template <typename Buf>
+	bool decode_fixed(bson_iter_t * iter, const tll::scheme::Field * field, Buf & data)
+	{
+		auto prec = field->fixed_precision;
+		if (bson_iter_type(iter) == BSON_TYPE_DOUBLE) {
+			auto v = bson_iter_double_unsafe(iter) * util::pow10[prec];
+			if (!(std::fabs(v) < 9.2e18))
+				return fail(false, "Double value {} out of range for fixed{}", bson_iter_double_unsafe(iter), prec);
+			auto r = std::llround(v);
+			if (std::fabs(v - r) > std::max(1e-6, std::fabs(v) * 1e-12))
+				return fail(false, "Double value {} can not be represented as fixed{}", bson_iter_double_unsafe(iter), prec);
+			util::write_int(field, data, r);
+			return true;
+		}
+		bson_decimal128_t d;
+		bson_iter_decimal128_unsafe(iter, &d);
+		auto v = util::decimal128_to_fixed({ d.low, d.high }, prec);
+		if (!v) {
+			char buf[BSON_DECIMAL128_STRING];
+			bson_decimal128_to_string(&d, buf);
+			return fail(false, "Decimal128 value {} can not be represented as fixed{}", buf, prec);
+		}
+		util::write_int(field, data, *v);
+		return true;
+	}
+
+	/// Decode sub-millisecond remainder of time point field from companion key
+	template <typename Buf>
+	bool decode_time_remainder(bson_iter_t * iter, const tll::scheme::Field * field, Buf data)
+	{
+		auto fi = info(field);
+		auto ns = decode_int(iter);
+		if (!ns)
+			return fail(false, "Invalid BSON type for datetime remainder: {}", bson_iter_type(iter));
+		if (field->type == tll::scheme::Field::Double)
+			*data.template dataT<double>() += (double) *ns / fi->time_rem_mul;
+		else
+			util::write_int(field, data, util::read_int(field, data) + *ns / fi->time_rem_mul);
+		return true;
+	}
+
+	/// Lookup time point field by remainder companion key
+	const tll::scheme::Field * lookup_remainder(const tll::scheme::Message * message, std::string_view name)
+	{
+		auto mi = info(message);
+		if (!mi || mi->time_rem_index.empty())
+			return nullptr;
+		if (auto it = mi->time_rem_index.find(name); it != mi->time_rem_index.end())
+			return it->second;
+		return nullptr;
+	}
+
 	std::optional<long long> decode_int(bson_iter_t * iter)
 	{
 			switch (bson_iter_type(iter)) {
@@ -206,54 +597,301 @@ struct Decoder : public ErrorStack
 			return std::string_view(ptr, len);
 	}
 
+	/// Mark field as seen in bound message, reject duplicate keys
+	bool presence_insert(Presence &seen, const tll::scheme::Field * field, std::string_view key)
+	{
+		if (auto fi = info(field); fi && !seen.insert(fi->index))
+			return fail(false, "Duplicate key '{}'", key);
+		return true;
+	}
+
+	/// Check that all required fields of the message were seen
+	bool check_required(const tll::scheme::Message * message, const Presence &seen)
+	{
+		auto mi = info(message);
+		if (!mi || mi->required.empty())
+			return true;
+		auto idx = seen.missing(mi->required);
+		if (!idx)
+			return true;
+		for (auto f = message->fields; f; f = f->next) {
+			if (info(f)->index == *idx)
+				return fail(false, "Missing required field '{}' of message '{}'", tll::bson::key(f), message->name);
+		}
+		return fail(false, "Missing required field {} of message '{}'", *idx, message->name);
+	}
+
+	/// Check required fields of empty document
+	bool check_required(const tll::scheme::Message * message)
+	{
+		auto mi = info(message);
+		if (!mi || mi->required.empty())
+			return true;
+		return check_required(message, Presence(mi->fields_size));
+	}
+
+	/// Lookup field by key, check expected field first and then key index
 	const tll::scheme::Field * lookup(const tll::scheme::Message * message, const tll::scheme::Field * field, std::string_view name)
 	{
-		if (field && field->name == name)
+		if (field && key(field) == name)
 			return field;
+		if (auto mi = info(message); mi) {
+			if (auto it = mi->index.find(name); it != mi->index.end())
+				return it->second;
+			return nullptr;
+		}
 		for (auto f = message->fields; f; f = f->next) {
 			if (f->name == name)
 				return f;
 		}
 		return nullptr;
 	}
+
+	/// Lookup union field by key
+	const tll::scheme::Field * lookup(const tll::scheme::Field * field, std::string_view name)
+	{
+		auto ud = field->type_union;
+		if (auto fi = info(field); fi && fi->type_union) {
+			if (auto it = fi->type_union->index.find(name); it != fi->type_union->index.end())
+				return it->second;
+			return nullptr;
+		}
+		for (auto i = 0u; i < ud->fields_size; i++) {
+			if (ud->fields[i].name == name)
+				return ud->fields + i;
+		}
+		return nullptr;
+	}
+
+ private:
+	unsigned _depth = 0;
+	size_t _unknown = 0;
+	size_t _bytes = 0;
 };
 
+template <typename Buf>
+const tll::scheme::Message * Decoder::decode_document(const Settings &settings, const SchemeInfo &info, const void * data, size_t size, Buf buf, tll_msg_t * meta)
+{
+	bson_t bson;
+	bson_iter_t iter;
+	reason = Reason::Invalid;
+	error_clear();
+	if (!bson_init_static(&bson, (const uint8_t *) data, size))
+		return fail(nullptr, "Failed to bind BSON buffer");
+	if (!bson_iter_init(&iter, &bson))
+		return fail(nullptr, "Failed to bind BSON iterator");
+
+	auto body = [&](bson_iter_t * it, const tll::scheme::Message * message) {
+		buf.resize(0);
+		buf.resize(message->size);
+		limits_reset(message->size);
+		reason = Reason::Decode;
+		auto r = settings.mode == Settings::Mode::Flat ? decode(it, message, buf, settings) : decode(it, message, buf);
+		if (!r && limit_exceeded)
+			reason = Reason::Limit;
+		return r;
+	};
+
+	const tll::scheme::Message * message = nullptr;
+	switch (settings.mode) {
+	case Settings::Mode::Flat: {
+		bool reset = false, seq = settings.seq_key.empty();
+		while (bson_iter_next(&iter)) {
+			std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+			if (key == settings.type_key) {
+				if (message)
+					return fail(nullptr, "Duplicate key {}", key);
+				if (auto name = decode_string(&iter); name) {
+					message = info.lookup(*name);
+					if (!message)
+						return fail_reason(nullptr, Reason::Unknown, "Message '{}' not found", *name);
+				} else
+					return fail(nullptr, "Non-string type key {}", key);
+				meta->msgid = message->msgid;
+				if (seq)
+					break;
+			} else if (settings.seq_key.size() && key == settings.seq_key) {
+				if (auto r = decode_int(&iter); r)
+					meta->seq = *r;
+				else
+					return fail(nullptr, "Non-integer seq key {}: {}", key, (int) bson_iter_type(&iter));
+				seq = true;
+				if (message)
+					break;
+			} else
+				reset = true;
+		}
+		if (!message)
+			return fail_reason(nullptr, Reason::Unknown, "No type key {} in BSON", settings.type_key);
+		// Fields before type or seq key were skipped, restart from the first element
+		if (reset && (!bson_iter_init(&iter, &bson) || !bson_iter_next(&iter)))
+			return fail(nullptr, "Failed to bind BSON iterator");
+		if (!body(&iter, message))
+			return nullptr;
+		return message;
+	}
+	case Settings::Mode::Nested: {
+		while (bson_iter_next(&iter)) {
+			std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+			if (settings.seq_key.size() && key == settings.seq_key) {
+				if (auto r = decode_int(&iter); r)
+					meta->seq = *r;
+				else
+					return fail(nullptr, "Non-integer seq key {}: {}", key, (int) bson_iter_type(&iter));
+				if (message)
+					break;
+			} else if (message)
+				continue;
+			auto m = info.lookup(key);
+			if (!m)
+				continue;
+			if (m->msgid == 0)
+				continue;
+			meta->msgid = m->msgid;
+			message = m;
+
+			if (bson_iter_type(&iter) != BSON_TYPE_DOCUMENT)
+				return fail(nullptr, "Non-document message '{}' key: {}", key, (int) bson_iter_type(&iter));
+
+			const uint8_t * array;
+			uint32_t len;
+			bson_iter_document(&iter, &len, &array);
+			bson_iter_t child;
+			if (!bson_iter_init_from_data(&child, array, len))
+				return fail(nullptr, "Failed to init BSON document iterator");
+			if (!bson_iter_next (&child)) {
+				buf.resize(0);
+				buf.resize(message->size);
+				reason = Reason::Decode;
+				if (!check_required(message))
+					return nullptr;
+				continue;
+			}
+			if (!body(&child, message))
+				return nullptr;
+		}
+		if (!message)
+			return fail_reason(nullptr, Reason::Unknown, "No known type in BSON");
+		return message;
+	}
+	}
+	return fail(nullptr, "Unknown compose mode");
+}
+
 template <typename Buf>
 bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Message * message, Buf buf)
 {
 	const tll::scheme::Field * field = message->fields;
+	auto mi = info(message);
+	Presence seen(mi ? mi->fields_size : 0);
 	do {
 		std::string_view key = { bson_iter_key_unsafe(iter), bson_iter_key_len(iter) };
 		auto f = lookup(message, field, key);
-		if (!f)
+		if (!f) {
+			if (auto tf = lookup_remainder(message, key); tf) {
+				if (!decode_time_remainder(iter, tf, buf.view(tf->offset)))
+					return fail_field(false, tf);
+			} else if (!limit_unknown(key))
+				return false;
 			continue;
+		}
 		field = f;
+		if (!presence_insert(seen, field, key))
+			return false;
 		if (!decode(iter, field, buf.view(field->offset)))
 			return fail_field(false, field);
 		field = field->next;
 	} while (bson_iter_next(iter));
-	return true;
+	return check_required(message, seen);
 }
 
 template <typename Buf>
 bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Message * message, Buf buf, const Settings &settings)
 {
 	const tll::scheme::Field * field = message->fields;
+	auto mi = info(message);
+	Presence seen(mi ? mi->fields_size : 0);
 	do {
 		std::string_view key = { bson_iter_key_unsafe(iter), bson_iter_key_len(iter) };
 		if (key == settings.type_key)
 			continue;
 		else if (settings.seq_key.size() && key == settings.seq_key)
 			continue;
+		else if (settings.id_key.size() && key == settings.id_key)
+			continue;
+		else if (settings.delta_key.size() && key == settings.delta_key)
+			continue;
 		auto f = lookup(message, field, key);
-		if (!f)
+		if (!f) {
+			if (auto tf = lookup_remainder(message, key); tf) {
+				if (!decode_time_remainder(iter, tf, buf.view(tf->offset)))
+					return fail_field(false, tf);
+			} else if (!limit_unknown(key))
+				return false;
 			continue;
+		}
 		field = f;
+		if (!presence_insert(seen, field, key))
+			return false;
 		if (!decode(iter, field, buf.view(field->offset)))
 			return fail_field(false, field);
 		field = field->next;
 	} while (bson_iter_next(iter));
-	return true;
+	if (partial) {
+		partial_seen = seen;
+		return true;
+	}
+	return check_required(message, seen);
+}
+
+template <typename Rows>
+bool Decoder::decode_columns(bson_iter_t * iter, const tll::scheme::Message * message, Rows &rows, size_t count, size_t offset, const Settings * settings)
+{
+	using Field = tll::scheme::Field;
+	auto mi = info(message);
+	Presence seen(mi ? mi->fields_size : 0);
+	while (bson_iter_next(iter)) {
+		std::string_view key = { bson_iter_key_unsafe(iter), bson_iter_key_len(iter) };
+		if (settings && (key == settings->type_key || key == settings->seq_key || key == settings->count_key))
+			continue;
+		auto f = lookup(message, nullptr, key);
+		if (!f)
+			continue;
+		if (!presence_insert(seen, f, key))
+			return false;
+		auto t = bson_iter_type(iter);
+
+		const uint8_t * array;
+		uint32_t len;
+		bson_iter_t child;
+		if (f->type == Field::Message) {
+			if (t != BSON_TYPE_DOCUMENT)
+				return fail_field(fail(false, "Invalid BSON type for message columns: {}", t), f);
+			bson_iter_document(iter, &len, &array);
+			if (!bson_iter_init_from_data(&child, array, len))
+				return fail_field(fail(false, "Failed to init BSON document iterator"), f);
+			if (!decode_columns(&child, f->type_msg, rows, count, offset + f->offset))
+				return fail_field(false, f);
+			continue;
+		}
+
+		if (t != BSON_TYPE_ARRAY)
+			return fail_field(fail(false, "Invalid BSON type for column: {}", t), f);
+		bson_iter_array(iter, &len, &array);
+		if (!bson_iter_init_from_data(&child, array, len))
+			return fail_field(fail(false, "Failed to init BSON array iterator"), f);
+		auto i = 0u;
+		while (bson_iter_next(&child)) {
+			if (i >= count)
+				return fail_field(fail(false, "Column too long: more than {} elements", count), f);
+			if (!decode(&child, f, tll::make_view(rows[i]).view(offset + f->offset)))
+				return fail_index(fail_field(false, f), i);
+			i++;
+		}
+		if (i != count)
+			return fail_field(fail(false, "Column too short: {} elements, count {}", i, count), f);
+	}
+	return check_required(message, seen);
 }
 
 template <typename T, typename Buf>
@@ -282,10 +920,31 @@ bool Decoder::decode_scalar(bson_iter_t * iter, const tll::scheme::Field * field
 }
 
 template <typename Buf>
-bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf data)
+bool Decoder::decode_plain(bson_iter_t * iter, const tll::scheme::Field * field, Buf data)
 {
 	auto t = bson_iter_type(iter);
 	using Field = tll::scheme::Field;
+	switch (field->sub_type) {
+	case Field::Enum:
+		if (t == BSON_TYPE_UTF8)
+			return decode_enum(iter, field, data);
+		break;
+	case Field::Bits:
+		if (t == BSON_TYPE_ARRAY)
+			return decode_bits(iter, field, data);
+		break;
+	case Field::TimePoint:
+		if (t == BSON_TYPE_DATE_TIME)
+			return decode_time(iter, field, data);
+		break;
+	case Field::Fixed:
+		if (t == BSON_TYPE_DECIMAL128 || t == BSON_TYPE_DOUBLE)
+			return decode_fixed(iter, field, data);
+		break;
+	default:
+		break;
+	}
+
 	switch (field->type) {
 	case Field::Int8:
 		return decode_scalar<int8_t>(iter, field, data);
@@ -319,9 +978,31 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 			return fail(false, "Invalid BSON type for decimal128: {}", t);
 		bson_iter_decimal128_unsafe(iter, data.template dataT<bson_decimal128_t>());
 		return true;
+	default:
+		return fail(false, "Field is not a scalar");
+	}
+}
+
+template <typename Buf>
+bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf data)
+{
+	auto t = bson_iter_type(iter);
+	using Field = tll::scheme::Field;
+	switch (field->type) {
+	case Field::Int8: case Field::Int16: case Field::Int32: case Field::Int64:
+	case Field::UInt8: case Field::UInt16: case Field::UInt32: case Field::UInt64:
+	case Field::Double: case Field::Decimal128:
+		return decode_plain(iter, field, data);
 
 	case Field::Bytes:
-		if (t == BSON_TYPE_UTF8) {
+		if (t == BSON_TYPE_DOCUMENT && info(field) && info(field)->raw_bson) {
+			uint32_t len;
+			const uint8_t * ptr;
+			bson_iter_document(iter, &len, &ptr);
+			if (len > field->size)
+				return fail(false, "BSON document too long: {} > max {}", len, field->size);
+			memcpy(data.data(), ptr, len);
+		} else if (t == BSON_TYPE_UTF8) {
 			size_t len;
 			auto str = bson_iter_utf8_unsafe(iter, &len);
 			if (len > field->size)
@@ -353,13 +1034,15 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 			return fail(false, "Failed to init BSON array iterator");
 		unsigned count = 0;
 		while (bson_iter_next (&child)) {
-			count++;
+			if (++count > field->count)
+				return fail(false, "Array size too large: more than max {}", field->count);
 		}
-		if (count > field->count)
-			return fail(false, "Array size too large: {} > max {}", count, field->count);
 
 		tll::scheme::write_size(field->count_ptr, data, count);
 
+		if (!limit_enter())
+			return false;
+		DepthGuard guard = { _depth };
 		auto af = field->type_array;
 		bson_iter_init_from_data(&child, array, len);
 		return decode_list(&child, af, af->size, data.view(af->offset));
@@ -373,6 +1056,8 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 			auto str = bson_iter_utf8_unsafe(iter, &len);
 			ptr.size = len + 1;
 			ptr.entity = 1;
+			if (!limit_bytes(ptr.size))
+				return false;
 			if (tll::scheme::alloc_pointer(field, data, ptr))
 				return fail(false, "Failed to allocate pointer of size {}", ptr.size);
 			auto view = data.view(ptr.offset);
@@ -380,6 +1065,19 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 			*view.view(len).template dataT<char>() = '\0';
 			return true;
 		}
+		if (t == BSON_TYPE_DOCUMENT && info(field) && info(field)->raw_bson) {
+			uint32_t len;
+			const uint8_t * doc;
+			bson_iter_document(iter, &len, &doc);
+			ptr.entity = field->type_ptr->size;
+			ptr.size = (len + ptr.entity - 1) / ptr.entity;
+			if (!limit_bytes(ptr.size * ptr.entity))
+				return false;
+			if (tll::scheme::alloc_pointer(field, data, ptr))
+				return fail(false, "Failed to allocate pointer of size {}", ptr.size);
+			memcpy(data.view(ptr.offset).data(), doc, len);
+			return true;
+		}
 		if (t != BSON_TYPE_ARRAY)
 			return fail(false, "Invalid BSON type for array: {}", t);
 		const uint8_t * array;
@@ -388,16 +1086,24 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 		bson_iter_t child;
 		if (!bson_iter_init_from_data(&child, array, len))
 			return fail(false, "Failed to init BSON array iterator");
-		while (bson_iter_next (&child))
-			ptr.size++;
+		const auto max = limit_array();
+		while (bson_iter_next (&child)) {
+			if (ptr.size++ == max)
+				return fail_limit(false, "Array size limit {} exceeded", max);
+		}
 
 		auto af = field->type_ptr;
 		ptr.entity = af->size;
 
+		if (!limit_bytes(ptr.size * ptr.entity))
+			return false;
 		if (tll::scheme::alloc_pointer(field, data, ptr))
 			return fail(false, "Failed to allocate pointer of size {}", ptr.size);
 		auto view = data.view(ptr.offset);
 
+		if (!limit_enter())
+			return false;
+		DepthGuard guard = { _depth };
 		bson_iter_init_from_data(&child, array, len);
 		return decode_list(&child, af, ptr.entity, view);
 	}
@@ -412,8 +1118,11 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 		if (!bson_iter_init_from_data(&child, array, len))
 			return fail(false, "Failed to init BSON document iterator");
 		if (!bson_iter_next (&child))
-			return true;
+			return check_required(field->type_msg);
 
+		if (!limit_enter())
+			return false;
+		DepthGuard guard = { _depth };
 		return decode(&child, field->type_msg, data);
 	}
 	case Field::Union: {
@@ -426,18 +1135,22 @@ bool Decoder::decode(bson_iter_t * iter, const tll::scheme::Field * field, Buf d
 		bson_iter_t child;
 		if (!bson_iter_init_from_data(&child, array, len))
 			return fail(false, "Failed to init BSON document iterator");
+		if (!limit_enter())
+			return false;
+		DepthGuard guard = { _depth };
 		while (bson_iter_next (&child)) {
 			std::string_view key = { bson_iter_key_unsafe(&child), bson_iter_key_len(&child) };
-			auto ud = field->type_union;
-			for (auto i = 0u; i < ud->fields_size; i++) {
-				auto uf = ud->fields + i;
-				if (uf->name == key) {
-					tll::scheme::write_size(ud->type_ptr, data.view(ud->type_ptr->offset), i);
-					if (!decode(&child, uf, data.view(uf->offset)))
-						return fail_field(false, uf);
-					return true;
-				}
+			auto uf = lookup(field, key);
+			if (!uf) {
+				if (!limit_unknown(key))
+					return false;
+				continue;
 			}
+			auto ud = field->type_union;
+			tll::scheme::write_size(ud->type_ptr, data.view(ud->type_ptr->offset), uf - ud->fields);
+			if (!decode(&child, uf, data.view(uf->offset)))
+				return fail_field(false, uf);
+			return true;
 		}
 		return fail(false, "No known fields in union");
 	}
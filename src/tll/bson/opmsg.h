@@ -0,0 +1,176 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_OPMSG_H
+#define _TLL_BSON_OPMSG_H
+
+#include <tll/util/memoryview.h>
+
+#include "tll/bson/cppbson.h"
+
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace tll::bson::opmsg {
+
+/// MongoDB wire protocol opcode for OP_MSG
+static constexpr int32_t op_msg = 2013;
+
+/// Flag bit indicating that frame is followed by CRC-32C checksum
+static constexpr uint32_t checksum_present = 1;
+
+/// Maximum size of single BSON document accepted by the server
+static constexpr size_t max_bson_size = 16 * 1024 * 1024;
+
+/// Default value of server maxMessageSizeBytes
+static constexpr size_t max_message_size = 48000000;
+
+struct Header
+{
+	int32_t size;
+	int32_t request_id;
+	int32_t response_to;
+	int32_t opcode;
+};
+
+/**
+ * OP_MSG frame builder for bulk commands
+ *
+ * Frame is composed from standard message header, flag bits, kind 0 section with command body and
+ * kind 1 document sequence section that holds all appended documents:
+ *
+ *   header | flags | 0 {insert: coll, $db: db, ordered: bool} | 1 size "documents" doc0 doc1 ...
+ *
+ * Command body is constant and is encoded once in @ref init, so appending document is one memcpy.
+ */
+struct Batch
+{
+	/// Frame buffer
+	std::vector<char> buffer;
+	/// Number of documents in current frame
+	size_t count = 0;
+	/// Frame size limit, maxMessageSizeBytes
+	size_t max_size = max_message_size;
+	/// Request id of last finished frame
+	int32_t request_id = 0;
+
+	/// Encoded prefix of the frame: flags, kind 0 section and kind 1 section header
+	std::vector<char> _prefix;
+
+	void init(std::string_view command, std::string_view collection, std::string_view db, bool ordered, size_t max = max_message_size)
+	{
+		max_size = max;
+
+		std::vector<char> body;
+		cppbson::Document doc(tll::make_view(body));
+		doc.append_utf8(command, collection);
+		doc.append_utf8("$db", db);
+		doc.append_bool("ordered", ordered);
+		doc.finish_standalone();
+
+		constexpr std::string_view ident = "documents";
+		_prefix.resize(sizeof(uint32_t) + 1 + doc.offset + 1 + sizeof(int32_t) + ident.size() + 1);
+		auto ptr = _prefix.data();
+		memset(ptr, 0, sizeof(uint32_t)); // Flag bits
+		ptr += sizeof(uint32_t);
+		*ptr++ = 0; // Kind 0, body
+		memcpy(ptr, body.data(), doc.offset);
+		ptr += doc.offset;
+		*ptr++ = 1; // Kind 1, document sequence, size is filled in finish
+		ptr += sizeof(int32_t);
+		memcpy(ptr, ident.data(), ident.size() + 1);
+		reset();
+	}
+
+	void reset()
+	{
+		count = 0;
+		buffer.resize(sizeof(Header));
+		buffer.insert(buffer.end(), _prefix.begin(), _prefix.end());
+	}
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return buffer.size(); }
+
+	/// Frame size without any documents
+	size_t overhead() const { return sizeof(Header) + _prefix.size(); }
+
+	/// Check if document fits into current frame without exceeding max_size
+	bool fits(size_t size) const { return buffer.size() + size <= max_size; }
+
+	void append(const void * data, size_t size)
+	{
+		auto off = buffer.size();
+		buffer.resize(off + size);
+		memcpy(buffer.data() + off, data, size);
+		count++;
+	}
+
+	/// Fill header and section sizes, frame is valid until next @ref reset
+	tll::const_memory finish()
+	{
+		auto header = (Header *) buffer.data();
+		header->size = buffer.size();
+		header->request_id = ++request_id;
+		header->response_to = 0;
+		header->opcode = op_msg;
+
+		// Kind 1 section size includes size field itself but not kind byte
+		auto section = sizeof(Header) + _prefix.size() - (sizeof(int32_t) + strlen("documents") + 1);
+		int32_t ssize = buffer.size() - section;
+		memcpy(buffer.data() + section, &ssize, sizeof(ssize));
+		return { buffer.data(), buffer.size() };
+	}
+};
+
+/**
+ * Parsed OP_MSG frame, only kind 0 body section is extracted
+ */
+struct Frame
+{
+	const Header * header = nullptr;
+	uint32_t flags = 0;
+	tll::const_memory body;
+};
+
+/// Parse OP_MSG frame, return error string on failure
+inline std::string_view parse(const void * data, size_t size, Frame &frame)
+{
+	if (size < sizeof(Header) + sizeof(uint32_t))
+		return "Frame too short";
+	auto ptr = (const uint8_t *) data;
+	frame.header = (const Header *) ptr;
+	if (frame.header->opcode != op_msg)
+		return "Invalid opcode, not OP_MSG";
+	if (frame.header->size < 0 || (size_t) frame.header->size != size)
+		return "Frame size mismatch";
+	memcpy(&frame.flags, ptr + sizeof(Header), sizeof(frame.flags));
+	auto end = ptr + size;
+	if (frame.flags & checksum_present) {
+		if (size < sizeof(Header) + sizeof(uint32_t) * 2)
+			return "Frame too short for checksum";
+		end -= sizeof(uint32_t);
+	}
+	ptr += sizeof(Header) + sizeof(uint32_t);
+	while (ptr < end) {
+		auto kind = *ptr++;
+		int32_t len;
+		if (end - ptr < (ptrdiff_t) sizeof(len))
+			return "Truncated section";
+		memcpy(&len, ptr, sizeof(len));
+		if (len < 5 || end - ptr < len)
+			return "Section size out of bounds";
+		if (kind == 0)
+			frame.body = { ptr, (size_t) len };
+		else if (kind != 1)
+			return "Unknown section kind";
+		ptr += len;
+	}
+	if (!frame.body.data)
+		return "No body section";
+	return {};
+}
+
+} // namespace tll::bson::opmsg
+
+#endif//_TLL_BSON_OPMSG_H
@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_POOL_H
+#define _TLL_BSON_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace tll::bson {
+
+/// Bounded lock-free ring with one producer and one consumer thread, size is rounded to power of 2
+template <typename T>
+class SpscRing
+{
+	std::vector<T> _data;
+	size_t _mask = 0;
+	/// Position of next element to pop, written only by consumer
+	alignas(64) std::atomic<size_t> _head = 0;
+	/// Position of next element to push, written only by producer
+	alignas(64) std::atomic<size_t> _tail = 0;
+
+ public:
+	explicit SpscRing(size_t size)
+	{
+		size_t s = 1;
+		while (s < size)
+			s <<= 1;
+		_data.resize(s);
+		_mask = s - 1;
+	}
+
+	bool push(const T &v)
+	{
+		auto tail = _tail.load(std::memory_order_relaxed);
+		if (tail - _head.load(std::memory_order_acquire) == _data.size())
+			return false;
+		_data[tail & _mask] = v;
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::optional<T> pop()
+	{
+		auto head = _head.load(std::memory_order_relaxed);
+		if (head == _tail.load(std::memory_order_acquire))
+			return std::nullopt;
+		auto v = _data[head & _mask];
+		_head.store(head + 1, std::memory_order_release);
+		return v;
+	}
+};
+
+/**
+ * Pool of worker threads that process jobs and return them in submit order
+ *
+ * Jobs live in ring of slots owned by the pool. Owner thread fills next free slot and submits it,
+ * slot is passed to worker ``slot % workers`` through its own SPSC ring. Worker calls its
+ * ``Worker`` object on the job and marks slot as done. Owner collects slots strictly in submit
+ * order, so later jobs finished by faster workers wait for earlier ones and output order is
+ * preserved without any sorting.
+ *
+ * All methods except worker callbacks are called from owner thread only.
+ */
+template <typename Job, typename Worker>
+class WorkerPool
+{
+	struct Slot
+	{
+		Job job;
+		std::atomic<bool> done = false;
+	};
+
+	struct Thread
+	{
+		Worker worker;
+		SpscRing<size_t> ring;
+		std::thread thread;
+
+		explicit Thread(size_t depth) : ring(depth) {}
+	};
+
+	std::unique_ptr<Slot[]> _slots;
+	size_t _depth = 0;
+	/// Next slot to collect
+	size_t _head = 0;
+	/// Next slot to submit
+	size_t _tail = 0;
+	std::vector<std::unique_ptr<Thread>> _threads;
+	std::atomic<bool> _stop = false;
+
+	/// Owner is blocked in wait(), workers notify it when job is done
+	std::atomic<bool> _waiting = false;
+	std::mutex _wait_lock;
+	std::condition_variable _wait_cv;
+
+ public:
+	~WorkerPool() { stop(); }
+
+	size_t size() const { return _threads.size(); }
+	bool empty() const { return _head == _tail; }
+	bool full() const { return _tail - _head == _depth; }
+
+	/// Number of jobs submitted since start, can be used as epoch of job published later
+	size_t submitted() const { return _tail; }
+	/// Number of jobs collected since start, all jobs of epoch less or equal to it are released
+	size_t collected() const { return _head; }
+
+	/// Start ``count`` threads with ``depth`` slots in flight, ``init(worker, idx)`` prepares worker objects
+	template <typename F>
+	void start(unsigned count, size_t depth, F init)
+	{
+		stop();
+		_depth = depth;
+		_slots.reset(new Slot[depth]);
+		_head = _tail = 0;
+		_stop = false;
+		for (auto i = 0u; i < count; i++) {
+			_threads.emplace_back(new Thread(depth / count + 1));
+			init(_threads.back()->worker, i);
+		}
+		for (auto & t : _threads)
+			t->thread = std::thread([this, ptr = t.get()] { run(*ptr); });
+	}
+
+	/// Stop threads, jobs in flight are discarded
+	void stop()
+	{
+		_stop = true;
+		for (auto & t : _threads) {
+			if (t->thread.joinable())
+				t->thread.join();
+		}
+		_threads.clear();
+		_head = _tail = 0;
+	}
+
+	/// Slot for the next job, nullptr if all slots are in flight
+	Job * acquire()
+	{
+		if (full())
+			return nullptr;
+		auto & slot = _slots[_tail % _depth];
+		slot.done.store(false, std::memory_order_relaxed);
+		return &slot.job;
+	}
+
+	/// Pass job from last acquire() to its worker
+	void submit()
+	{
+		auto idx = _tail++ % _depth;
+		auto & ring = _threads[idx % _threads.size()]->ring;
+		while (!ring.push(idx))
+			std::this_thread::yield();
+	}
+
+	/// Oldest job if it is finished, nullptr otherwise
+	Job * front()
+	{
+		if (empty())
+			return nullptr;
+		auto & slot = _slots[_head % _depth];
+		if (!slot.done.load(std::memory_order_acquire))
+			return nullptr;
+		return &slot.job;
+	}
+
+	/// Release oldest job returned by front()
+	void pop() { _head++; }
+
+	/// Block until job ``idx`` positions after the oldest one is finished and return it, nullptr if there is no such job
+	Job * wait(size_t idx = 0)
+	{
+		if (_tail - _head <= idx)
+			return nullptr;
+		auto & slot = _slots[(_head + idx) % _depth];
+		_waiting.store(true);
+		// Pairs with fence in run(): either owner sees done flag or worker sees waiting flag
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		{
+			std::unique_lock<std::mutex> lock(_wait_lock);
+			_wait_cv.wait(lock, [&slot] { return slot.done.load(std::memory_order_acquire); });
+		}
+		_waiting.store(false, std::memory_order_relaxed);
+		return &slot.job;
+	}
+
+ private:
+	void run(Thread &t)
+	{
+		unsigned idle = 0;
+		while (!_stop.load(std::memory_order_relaxed)) {
+			auto idx = t.ring.pop();
+			if (!idx) {
+				if (++idle < 1000)
+					std::this_thread::yield();
+				else
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				continue;
+			}
+			idle = 0;
+			auto & slot = _slots[*idx];
+			t.worker(slot.job);
+			slot.done.store(true, std::memory_order_release);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (_waiting.load(std::memory_order_relaxed)) {
+				std::lock_guard<std::mutex> lock(_wait_lock);
+				_wait_cv.notify_one();
+			}
+		}
+	}
+};
+
+} // namespace tll::bson
+
+#endif//_TLL_BSON_POOL_H
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_ROUTE_H
+#define _TLL_BSON_ROUTE_H
+
+#include <tll/channel.h>
+#include <tll/scheme.h>
+
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+#include "tll/bson/util.h"
+
+#include <cmath>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace tll::bson {
+
+/**
+ * Routing metadata taken from message fields: msg->addr and msg->time
+ *
+ * Fields are given by paths of field names separated with dots, intermediate fields must be
+ * sub-messages. Paths are resolved once for each message of bound scheme into field and offset
+ * from the message start, so value is read from message body without any walk: from posted data
+ * on encode and from decoded buffer on decode. Address field is integer, time field is integer
+ * or double, time points are converted into nanoseconds, other integers are used as is.
+ *
+ * Messages without these fields keep metadata of the input message. Compiled object is not
+ * changed after compile and can be used from several threads.
+ */
+class Route : public ErrorStack
+{
+	using Field = tll::scheme::Field;
+	using Message = tll::scheme::Message;
+
+	struct Entry
+	{
+		const Field * field = nullptr;
+		size_t offset = 0;
+	};
+
+	struct Fields
+	{
+		Entry addr;
+		Entry time;
+	};
+
+	std::unordered_map<const Message *, Fields> _messages;
+
+ public:
+	/// Split path of addr field, empty if not used
+	std::vector<std::string> addr;
+	/// Split path of time field, empty if not used
+	std::vector<std::string> time;
+
+	bool empty() const { return addr.empty() && time.empty(); }
+
+	/// Split dotted path into field names
+	static std::vector<std::string> split(std::string_view path)
+	{
+		std::vector<std::string> r;
+		for (size_t pos = 0; pos < path.size();) {
+			auto end = std::min(path.find('.', pos), path.size());
+			r.emplace_back(path.substr(pos, end - pos));
+			pos = end + 1;
+		}
+		return r;
+	}
+
+	/// Resolve paths for all messages of bound scheme, object keeps pointers into ``info``
+	bool compile(const SchemeInfo &info)
+	{
+		_messages.clear();
+		if (empty())
+			return true;
+		bool found_addr = addr.empty(), found_time = time.empty();
+		for (auto m = info.scheme()->messages; m; m = m->next) {
+			if (!m->msgid)
+				continue;
+			Fields fields;
+			if (!resolve(m, addr, fields.addr, false) || !resolve(m, time, fields.time, true)) {
+				auto text = error();
+				return fail(false, "Message '{}': {}", m->name, text);
+			}
+			if (!fields.addr.field && !fields.time.field)
+				continue;
+			found_addr |= fields.addr.field != nullptr;
+			found_time |= fields.time.field != nullptr;
+			_messages.emplace(m, fields);
+		}
+		if (!found_addr)
+			return fail(false, "Address field '{}' not found in any message", join(addr));
+		if (!found_time)
+			return fail(false, "Time field '{}' not found in any message", join(time));
+		return true;
+	}
+
+	/// Fill addr and time of ``msg`` from message body ``data``
+	template <typename Buf>
+	void apply(const Message * message, const Buf &data, tll_msg_t * msg) const
+	{
+		if (_messages.empty())
+			return;
+		auto it = _messages.find(message);
+		if (it == _messages.end())
+			return;
+		auto & f = it->second;
+		if (f.addr.field && f.addr.offset + f.addr.field->size <= data.size())
+			msg->addr.i64 = util::read_int(f.addr.field, data.view(f.addr.offset));
+		if (f.time.field && f.time.offset + f.time.field->size <= data.size())
+			msg->time = time_value(f.time.field, data.view(f.time.offset));
+	}
+
+ private:
+	static std::string join(const std::vector<std::string> &path)
+	{
+		std::string r;
+		for (auto & p : path)
+			r += (r.size() ? "." : "") + p;
+		return r;
+	}
+
+	template <typename Buf>
+	static long long time_value(const Field * field, const Buf &data)
+	{
+		long long mul = field->sub_type == Field::TimePoint ? info(field)->time_ns : 1;
+		if (field->type == Field::Double)
+			return std::llround(*data.template dataT<double>() * mul);
+		return util::read_int(field, data) * mul;
+	}
+
+	/// Resolve path in the message, missing path leaves entry empty
+	bool resolve(const Message * message, const std::vector<std::string> &path, Entry &entry, bool real)
+	{
+		size_t offset = 0;
+		for (auto i = 0u; i < path.size(); i++) {
+			const Field * field = nullptr;
+			for (auto f = message->fields; f; f = f->next) {
+				if (f->name == path[i]) {
+					field = f;
+					break;
+				}
+			}
+			if (!field)
+				return true;
+			offset += field->offset;
+			if (i + 1 < path.size()) {
+				if (field->type != Field::Message)
+					return fail_field(fail(false, "Field '{}' of path '{}' is not a message", field->name, join(path)), field);
+				message = field->type_msg;
+				continue;
+			}
+			switch (field->type) {
+			case Field::Int8: case Field::Int16: case Field::Int32: case Field::Int64:
+			case Field::UInt8: case Field::UInt16: case Field::UInt32: case Field::UInt64:
+				break;
+			case Field::Double:
+				if (real)
+					break;
+				[[fallthrough]];
+			default:
+				return fail_field(fail(false, "Field of path '{}' is not a number", join(path)), field);
+			}
+			entry = { field, offset };
+		}
+		return true;
+	}
+};
+
+} // namespace tll::bson
+
+#endif//_TLL_BSON_ROUTE_H
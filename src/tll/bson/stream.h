@@ -0,0 +1,636 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_STREAM_H
+#define _TLL_BSON_STREAM_H
+
+#include "tll/bson/libbson.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace tll::bson::libbson {
+
+/**
+ * Resumable decoder for stream of BSON documents split into arbitrary chunks
+ *
+ * Parser keeps explicit stack of open documents instead of recursion and fills output message as
+ * elements arrive, so large document needs neither staging copy nor one long blocking decode
+ * call. Messages, unions and lists are walked in place, only leaf elements (scalars, strings,
+ * bit arrays, raw documents) are staged and decoded with regular Decoder.
+ *
+ * Element count of pointer list is not known when it is opened: space for the upper bound
+ * estimated from array size is allocated and then shrinked to actual count if nothing was
+ * allocated after the list.
+ *
+ * In flat mode type key must precede message fields, both encoders put it first.
+ */
+class StreamDecoder : public ErrorStack
+{
+	using Field = tll::scheme::Field;
+	using Message = tll::scheme::Message;
+
+	enum class Phase { Length, Type, Key, Prefix, Value, Skip };
+	enum class Kind { Flat, Nested, Message, Union, List };
+	enum class Action { Skip, Descend, Leaf, TypeKey, SeqKey, Remainder };
+
+	struct Frame
+	{
+		Kind kind;
+		/// Position after terminating zero
+		size_t end = 0;
+		/// Offset of message data, first element for lists
+		size_t offset = 0;
+		const Message * message = nullptr;
+		/// Union field or list element field
+		const Field * field = nullptr;
+		/// Next expected field of message
+		const Field * hint = nullptr;
+		/// Field that owns this document, for error reporting
+		const Field * owner = nullptr;
+		/// Offset of array or pointer field that owns the list
+		size_t owner_offset = 0;
+		size_t count = 0;
+		size_t capacity = 0;
+		/// Fields seen in message document
+		Presence seen;
+	};
+
+	const Settings * _settings = &Settings::defaults();
+	const SchemeInfo * _info = nullptr;
+	Decoder _dec;
+
+	std::vector<Frame> _stack;
+	Phase _phase = Phase::Length;
+	/// Position in current document
+	size_t _pos = 0;
+	bool _complete = false;
+
+	unsigned char _prefix[4];
+	size_t _prefix_size = 0;
+
+	bson_type_t _type = BSON_TYPE_EOD;
+	std::string _key;
+	Action _action = Action::Skip;
+	const Field * _field = nullptr;
+	size_t _offset = 0;
+	size_t _start = 0;
+	size_t _remaining = 0;
+	std::vector<uint8_t> _stage;
+
+ public:
+	/// Decoded message, valid when complete() is true
+	const Message * message = nullptr;
+	std::optional<long long> seq;
+	std::vector<char> buffer;
+
+	void init(const Settings * settings, const SchemeInfo * info)
+	{
+		_settings = settings;
+		_info = info;
+		reset();
+	}
+
+	/// Decode limits, depth is counted below the message like in Decoder
+	void limits(const util::Limits &limits) { _dec.limits = limits; }
+
+	/// Drop partially decoded document
+	void reset()
+	{
+		_stack.clear();
+		_phase = Phase::Length;
+		_pos = 0;
+		_prefix_size = 0;
+		_complete = false;
+		message = nullptr;
+	}
+
+	/// Document is decoded, it is valid until next feed call
+	bool complete() const { return _complete; }
+
+	/// No document is partially decoded, scheme can be replaced with init()
+	bool idle() const { return _stack.empty() && _phase == Phase::Length && _prefix_size == 0; }
+
+	/**
+	 * Feed chunk of the stream
+	 *
+	 * Parsing stops at the end of the document, so if complete() is set after the call the rest
+	 * of the chunk should be fed again.
+	 *
+	 * @return number of consumed bytes or nullopt on error
+	 */
+	std::optional<size_t> feed(const void * data, size_t size);
+
+ private:
+	bool read_prefix(const unsigned char * &ptr, const unsigned char * end)
+	{
+		auto n = std::min<size_t>(sizeof(_prefix) - _prefix_size, end - ptr);
+		memcpy(_prefix + _prefix_size, ptr, n);
+		ptr += n;
+		_pos += n;
+		_prefix_size += n;
+		return _prefix_size == sizeof(_prefix);
+	}
+
+	int32_t prefix()
+	{
+		int32_t v;
+		memcpy(&v, _prefix, sizeof(v));
+		_prefix_size = 0;
+		return v;
+	}
+
+	/// Check that n more bytes fit into current document before its terminating zero
+	bool fits(size_t n) const { return _pos + n < _stack.back().end; }
+
+	/// Fixed value size, -1 for length prefixed types and -2 for unsupported ones
+	static long fixed_size(bson_type_t type)
+	{
+		switch (type) {
+		case BSON_TYPE_UNDEFINED:
+		case BSON_TYPE_NULL:
+		case BSON_TYPE_MAXKEY:
+		case BSON_TYPE_MINKEY:
+			return 0;
+		case BSON_TYPE_BOOL: return 1;
+		case BSON_TYPE_INT32: return 4;
+		case BSON_TYPE_DOUBLE:
+		case BSON_TYPE_DATE_TIME:
+		case BSON_TYPE_TIMESTAMP:
+		case BSON_TYPE_INT64:
+			return 8;
+		case BSON_TYPE_OID: return 12;
+		case BSON_TYPE_DECIMAL128: return 16;
+		case BSON_TYPE_UTF8:
+		case BSON_TYPE_CODE:
+		case BSON_TYPE_SYMBOL:
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY:
+		case BSON_TYPE_BINARY:
+		case BSON_TYPE_CODEWSCOPE:
+		case BSON_TYPE_DBPOINTER:
+			return -1;
+		default:
+			return -2;
+		}
+	}
+
+	/// Full size of length prefixed value including prefix
+	static long long variable_size(bson_type_t type, int32_t len)
+	{
+		switch (type) {
+		case BSON_TYPE_DOCUMENT:
+		case BSON_TYPE_ARRAY:
+		case BSON_TYPE_CODEWSCOPE:
+			return len;
+		case BSON_TYPE_BINARY: return 4ll + 1 + len;
+		case BSON_TYPE_DBPOINTER: return 4ll + len + 12;
+		default: return 4ll + len;
+		}
+	}
+
+	/// Empty presence set sized for the message, unbound messages are not tracked
+	static Presence presence(const Message * message)
+	{
+		auto mi = info(message);
+		return Presence(mi ? mi->fields_size : 0);
+	}
+
+	/// Minimal size of list element: type, key and smallest value that is accepted for the field
+	static size_t min_element_size(const Field * field)
+	{
+		switch (field->type) {
+		case Field::Bytes:
+		case Field::Message:
+		case Field::Union:
+		case Field::Array:
+		case Field::Pointer:
+			return 1 + 2 + 5;
+		case Field::Decimal128:
+			return 1 + 2 + 16;
+		default:
+			return 1 + 2 + 4;
+		}
+	}
+
+	template <typename R>
+	R fail_frames(R err)
+	{
+		for (auto f = _stack.rbegin(); f != _stack.rend(); f++) {
+			if (f->kind == Kind::List)
+				error_stack.push_back(f->count ? f->count - 1 : 0);
+			if (f->owner)
+				error_stack.push_back(f->owner);
+		}
+		return err;
+	}
+
+	bool resolve();
+	bool resolve_field(Frame &frame);
+	void target(const Field * field, size_t offset);
+	bool begin_value();
+	bool begin_sized();
+	bool begin_body(size_t size, size_t consumed);
+	bool descend(size_t size);
+	bool finish_leaf();
+	bool end_frame();
+};
+
+inline std::optional<size_t> StreamDecoder::feed(const void * data, size_t size)
+{
+	auto begin = static_cast<const unsigned char *>(data);
+	auto ptr = begin, end = begin + size;
+	_complete = false;
+	while (ptr < end) {
+		switch (_phase) {
+		case Phase::Length: {
+			if (!read_prefix(ptr, end))
+				break;
+			auto len = prefix();
+			if (len < 5)
+				return fail(std::nullopt, "Invalid document size: {}", len);
+			message = nullptr;
+			seq.reset();
+			buffer.clear();
+			_stack.clear();
+			_dec.limits_reset();
+			auto & frame = _stack.emplace_back();
+			frame.kind = _settings->mode == Settings::Mode::Flat ? Kind::Flat : Kind::Nested;
+			frame.end = len;
+			_phase = Phase::Type;
+			break;
+		}
+		case Phase::Type:
+			_type = (bson_type_t) *ptr++;
+			_pos++;
+			if (_type == BSON_TYPE_EOD) {
+				if (!end_frame())
+					return std::nullopt;
+				if (_stack.empty()) {
+					_complete = true;
+					_phase = Phase::Length;
+					_pos = 0;
+					return ptr - begin;
+				}
+			} else {
+				_key.clear();
+				_phase = Phase::Key;
+			}
+			break;
+		case Phase::Key: {
+			auto z = static_cast<const unsigned char *>(memchr(ptr, 0, end - ptr));
+			auto last = z ? z : end;
+			_key.append((const char *) ptr, last - ptr);
+			_pos += last - ptr;
+			ptr = last;
+			if (!fits(0))
+				return fail_frames(fail(std::nullopt, "Key out of document bounds"));
+			if (z) {
+				ptr++;
+				_pos++;
+				if (!begin_value())
+					return std::nullopt;
+			}
+			break;
+		}
+		case Phase::Prefix:
+			if (!read_prefix(ptr, end))
+				break;
+			if (!begin_sized())
+				return std::nullopt;
+			break;
+		case Phase::Value: {
+			auto n = std::min<size_t>(_remaining, end - ptr);
+			_stage.insert(_stage.end(), ptr, ptr + n);
+			ptr += n;
+			_pos += n;
+			_remaining -= n;
+			if (!_remaining && !finish_leaf())
+				return std::nullopt;
+			break;
+		}
+		case Phase::Skip: {
+			auto n = std::min<size_t>(_remaining, end - ptr);
+			ptr += n;
+			_pos += n;
+			_remaining -= n;
+			if (!_remaining)
+				_phase = Phase::Type;
+			break;
+		}
+		}
+	}
+	return size;
+}
+
+inline bool StreamDecoder::resolve()
+{
+	auto & frame = _stack.back();
+	_action = Action::Skip;
+	switch (frame.kind) {
+	case Kind::Flat:
+		if (_key == _settings->type_key) {
+			if (message)
+				return fail(false, "Duplicate key {}", _key);
+			_action = Action::TypeKey;
+			return true;
+		} else if (_settings->seq_key.size() && _key == _settings->seq_key) {
+			_action = Action::SeqKey;
+			return true;
+		} else if (_settings->id_key.size() && _key == _settings->id_key)
+			return true;
+		if (!message)
+			return fail(false, "Type key {} must precede message fields", _settings->type_key);
+		return resolve_field(frame);
+
+	case Kind::Nested: {
+		if (_settings->seq_key.size() && _key == _settings->seq_key) {
+			_action = Action::SeqKey;
+			return true;
+		} else if (message)
+			return true;
+		auto m = _info->lookup(_key);
+		if (!m || m->msgid == 0)
+			return true;
+		if (_type != BSON_TYPE_DOCUMENT)
+			return fail(false, "Non-document message '{}' key: {}", _key, (int) _type);
+		message = m;
+		buffer.resize(m->size);
+		_dec.limits_reset(m->size);
+		_action = Action::Descend;
+		_field = nullptr;
+		_offset = 0;
+		return true;
+	}
+
+	case Kind::Message:
+		return resolve_field(frame);
+
+	case Kind::Union: {
+		auto uf = _dec.lookup(frame.field, _key);
+		if (!uf) {
+			if (_dec.limit_unknown(_key))
+				return true;
+			error_copy(_dec);
+			return fail_frames(false);
+		}
+		auto ud = frame.field->type_union;
+		tll::scheme::write_size(ud->type_ptr, tll::make_view(buffer).view(frame.offset + ud->type_ptr->offset), uf - ud->fields);
+		target(uf, frame.offset + uf->offset);
+		return true;
+	}
+
+	case Kind::List:
+		if (frame.count >= frame.capacity)
+			return fail_frames(fail(false, "Array size too large: more than {} elements", frame.capacity));
+		target(frame.field, frame.offset + frame.field->size * frame.count++);
+		return true;
+	}
+	return true;
+}
+
+inline bool StreamDecoder::resolve_field(Frame &frame)
+{
+	auto f = _dec.lookup(frame.message, frame.hint, _key);
+	if (!f) {
+		if (auto tf = _dec.lookup_remainder(frame.message, _key); tf) {
+			_action = Action::Remainder;
+			_field = tf;
+			_offset = frame.offset + tf->offset;
+		} else if (!_dec.limit_unknown(_key)) {
+			error_copy(_dec);
+			return fail_frames(false);
+		}
+		return true;
+	}
+	if (!_dec.presence_insert(frame.seen, f, _key)) {
+		error_copy(_dec);
+		return fail_frames(false);
+	}
+	frame.hint = f->next;
+	target(f, frame.offset + f->offset);
+	return true;
+}
+
+inline void StreamDecoder::target(const Field * field, size_t offset)
+{
+	_field = field;
+	_offset = offset;
+	_action = Action::Leaf;
+	if (field->sub_type == Field::ByteString)
+		return;
+	if (auto fi = info(field); fi && fi->raw_bson)
+		return;
+	switch (field->type) {
+	case Field::Message:
+	case Field::Union:
+		if (_type == BSON_TYPE_DOCUMENT)
+			_action = Action::Descend;
+		break;
+	case Field::Array:
+	case Field::Pointer:
+		if (_type == BSON_TYPE_ARRAY)
+			_action = Action::Descend;
+		break;
+	default:
+		break;
+	}
+}
+
+inline bool StreamDecoder::begin_value()
+{
+	if (!resolve())
+		return false;
+	_start = _pos;
+	auto size = fixed_size(_type);
+	if (size == -2)
+		return fail_frames(fail(false, "Unsupported BSON type for key '{}': {}", _key, (int) _type));
+	if (size == -1) {
+		_prefix_size = 0;
+		_phase = Phase::Prefix;
+		return true;
+	}
+	return begin_body(size, 0);
+}
+
+inline bool StreamDecoder::begin_sized()
+{
+	auto len = prefix();
+	if (len < 0)
+		return fail_frames(fail(false, "Negative value size for key '{}': {}", _key, len));
+	auto size = variable_size(_type, len);
+	if (size < 5 && (_type == BSON_TYPE_DOCUMENT || _type == BSON_TYPE_ARRAY))
+		return fail_frames(fail(false, "Invalid document size for key '{}': {}", _key, size));
+	if (_action == Action::Descend)
+		return descend(size);
+	return begin_body(size, sizeof(_prefix));
+}
+
+inline bool StreamDecoder::begin_body(size_t size, size_t consumed)
+{
+	if (!fits(size - consumed))
+		return fail_frames(fail(false, "Value of key '{}' out of document bounds", _key));
+	_remaining = size - consumed;
+	if (_action == Action::Skip) {
+		_phase = _remaining ? Phase::Skip : Phase::Type;
+		return true;
+	}
+
+	_stage.assign(sizeof(int32_t), 0);
+	_stage.push_back(_type);
+	_stage.insert(_stage.end(), _key.begin(), _key.end());
+	_stage.push_back(0);
+	_stage.insert(_stage.end(), _prefix, _prefix + consumed);
+	_phase = Phase::Value;
+	if (!_remaining)
+		return finish_leaf();
+	return true;
+}
+
+inline bool StreamDecoder::descend(size_t size)
+{
+	if (_start + size >= _stack.back().end)
+		return fail_frames(fail(false, "Document of key '{}' out of parent bounds", _key));
+	// Depth is counted below the message like in Decoder, nested mode has extra wrapper frame
+	auto depth = _stack.size() - (_stack.front().kind == Kind::Nested ? 1 : 0);
+	if (_dec.limits.depth && depth > _dec.limits.depth)
+		return fail_frames(fail(false, "Nesting depth limit {} exceeded", _dec.limits.depth));
+
+	Frame frame = {};
+	frame.end = _start + size;
+	frame.owner = _field;
+	frame.offset = _offset;
+	if (!_field || _field->type == Field::Message) {
+		frame.kind = Kind::Message;
+		frame.message = _field ? _field->type_msg : message;
+		frame.hint = frame.message->fields;
+		frame.seen = presence(frame.message);
+	} else if (_field->type == Field::Union) {
+		frame.kind = Kind::Union;
+		frame.field = _field;
+	} else if (_field->type == Field::Array) {
+		frame.kind = Kind::List;
+		frame.field = _field->type_array;
+		frame.owner_offset = _offset;
+		frame.offset = _offset + frame.field->offset;
+		frame.capacity = _field->count;
+	} else {
+		frame.kind = Kind::List;
+		frame.field = _field->type_ptr;
+		frame.owner_offset = _offset;
+
+		tll::scheme::generic_offset_ptr_t ptr = {};
+		ptr.entity = frame.field->size;
+		ptr.size = std::min((size - 5) / min_element_size(frame.field), _dec.limit_array());
+		if (!_dec.limit_bytes(ptr.size * ptr.entity)) {
+			error_copy(_dec);
+			return fail_frames(false);
+		}
+		auto view = tll::make_view(buffer).view(_offset);
+		if (tll::scheme::alloc_pointer(_field, view, ptr))
+			return fail_frames(fail(false, "Failed to allocate pointer of size {}", ptr.size));
+		frame.offset = _offset + ptr.offset;
+		frame.capacity = ptr.size;
+	}
+	_stack.push_back(frame);
+	_phase = Phase::Type;
+	return true;
+}
+
+inline bool StreamDecoder::finish_leaf()
+{
+	_phase = Phase::Type;
+	_stage.push_back(0);
+	int32_t len = _stage.size();
+	memcpy(_stage.data(), &len, sizeof(len));
+
+	bson_iter_t iter;
+	if (!bson_iter_init_from_data(&iter, _stage.data(), _stage.size()) || !bson_iter_next(&iter))
+		return fail_frames(fail(false, "Invalid BSON element '{}'", _key));
+
+	switch (_action) {
+	case Action::TypeKey: {
+		auto name = _dec.decode_string(&iter);
+		if (!name)
+			return fail(false, "Non-string type key {}", _key);
+		message = _info->lookup(*name);
+		if (!message)
+			return fail(false, "Message '{}' not found", *name);
+		buffer.resize(message->size);
+		_dec.limits_reset(message->size);
+		auto & frame = _stack.back();
+		frame.message = message;
+		frame.hint = message->fields;
+		frame.seen = presence(message);
+		return true;
+	}
+	case Action::SeqKey:
+		seq = _dec.decode_int(&iter);
+		if (!seq)
+			return fail(false, "Non-integer seq key {}: {}", _key, (int) _type);
+		return true;
+	case Action::Remainder:
+	case Action::Leaf: {
+		_dec.error_clear();
+		auto view = tll::make_view(buffer).view(_offset);
+		auto r = _action == Action::Leaf ? _dec.decode(&iter, _field, view) : _dec.decode_time_remainder(&iter, _field, view);
+		if (r)
+			return true;
+		error_copy(_dec);
+		error_stack.push_back(_field);
+		return fail_frames(false);
+	}
+	default:
+		return true;
+	}
+}
+
+inline bool StreamDecoder::end_frame()
+{
+	auto & frame = _stack.back();
+	if (_pos != frame.end)
+		return fail_frames(fail(false, "Document terminator at {}, expected at {}", _pos, frame.end));
+	switch (frame.kind) {
+	case Kind::Flat:
+		if (!message)
+			return fail(false, "No type key {} in BSON", _settings->type_key);
+		if (!_dec.check_required(message, frame.seen)) {
+			error_copy(_dec);
+			return false;
+		}
+		break;
+	case Kind::Message:
+		if (!_dec.check_required(frame.message, frame.seen)) {
+			error_copy(_dec);
+			return fail_frames(false);
+		}
+		break;
+	case Kind::Nested:
+		if (!message)
+			return fail(false, "No known type in BSON");
+		break;
+	case Kind::List: {
+		auto view = tll::make_view(buffer).view(frame.owner_offset);
+		if (frame.owner->type == Field::Array) {
+			tll::scheme::write_size(frame.owner->count_ptr, view, frame.count);
+			break;
+		}
+		auto ptr = tll::scheme::read_pointer(frame.owner, view);
+		if (!ptr)
+			return fail_frames(fail(false, "Invalid offset ptr version: {}", frame.owner->offset_ptr_version));
+		ptr->size = frame.count;
+		tll::scheme::write_pointer(frame.owner, view, *ptr);
+		if (buffer.size() == frame.offset + frame.capacity * frame.field->size)
+			buffer.resize(frame.offset + frame.count * frame.field->size);
+		break;
+	}
+	default:
+		break;
+	}
+	_stack.pop_back();
+	return true;
+}
+
+} // namespace tll::bson::libbson
+
+#endif//_TLL_BSON_STREAM_H
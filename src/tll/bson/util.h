@@ -3,18 +3,370 @@
 #ifndef _TLL_UTIL_BSON_UTIL_H
 #define _TLL_UTIL_BSON_UTIL_H
 
+#include <tll/scheme.h>
+#include <tll/scheme/util.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <random>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
 namespace tll::bson::util {
 
 struct Settings
 {
 	std::string type_key;
 	std::string seq_key;
+	/// Key of generated ObjectId, prepended to encoded documents, empty disables it
+	std::string id_key;
+	/// Row count key of columnar batch document
+	std::string count_key = "_tll_count";
+	/// Change-only encoding, delta documents hold key fields and fields changed since previous message
+	enum class Delta {
+		None,
+		Flat, // {seq: 100, type: name, delta_key: true, keys..., changed fields...}
+		Set, // {seq: 100, type: name, keys..., delta_key: {changed fields...}}, delta_key is $set
+	} delta = Delta::None;
+	/// Marker key of delta documents, it is skipped by decoder
+	std::string delta_key;
 	enum class Mode {
 		Flat, // {seq: 100, type: name, fields...}
 		Nested, // {seq: 100, name: {fields...}}
 	} mode = Mode::Flat;
+	/// Omit fields with zero or empty values
+	bool sparse = false;
+	/// Encode enums as strings
+	bool enum_string = false;
+	/// Encode bits as arrays of strings
+	bool bits_string = false;
+	/// Encode time points as BSON UTC datetime
+	bool time_datetime = false;
+	/// Keep sub-millisecond part of datetime in companion key
+	bool time_remainder = false;
+	enum class Fixed {
+		Int, // Raw mantissa
+		Decimal128, // Decimal128 with exponent from the scheme
+		Double, // Mantissa scaled by precision
+	} fixed = Fixed::Int;
+
+	static const Settings & defaults()
+	{
+		static const Settings settings;
+		return settings;
+	}
 };
 
+/// Decode limits for untrusted input, zero value disables the check
+struct Limits
+{
+	/// Maximum nesting depth of documents and arrays below message
+	unsigned depth = 0;
+	/// Maximum number of elements in pointer list
+	size_t array = 0;
+	/// Maximum size of decoded message including pointer data
+	size_t bytes = 0;
+	/// Maximum number of skipped unknown keys in one document
+	size_t unknown = 0;
+};
+
+/**
+ * Resizable container over caller provided memory, usable with tll::make_view
+ *
+ * Content is written directly into caller memory while it fits. When it is resized beyond
+ * capacity content moves to spill vector, caller memory is not used after that and overflow()
+ * reports that result did not fit. New space is zero filled like in std::vector.
+ */
+class SpanBuffer
+{
+	char * _data;
+	size_t _capacity;
+	size_t _size;
+	std::vector<char> * _spill;
+	bool _overflow = false;
+
+ public:
+	/// Buffer over ``capacity`` bytes of ``data`` with initial ``size``, that is not zero filled
+	SpanBuffer(void * data, size_t capacity, size_t size, std::vector<char> &spill)
+		: _data(static_cast<char *>(data)), _capacity(capacity), _size(std::min(size, capacity)), _spill(&spill) {}
+
+	char * data() { return _overflow ? _spill->data() : _data; }
+	const char * data() const { return _overflow ? _spill->data() : _data; }
+	size_t size() const { return _overflow ? _spill->size() : _size; }
+	bool overflow() const { return _overflow; }
+
+	void resize(size_t size)
+	{
+		if (_overflow) {
+			_spill->resize(size);
+		} else if (size <= _capacity) {
+			if (size > _size)
+				memset(_data + _size, 0, size - _size);
+			_size = size;
+		} else {
+			_spill->assign(_data, _data + _size);
+			_spill->resize(size);
+			_overflow = true;
+		}
+	}
+};
+
+/**
+ * Generator of BSON ObjectId values: 4 byte timestamp, 5 byte random value and 3 byte counter,
+ * all big-endian.
+ *
+ * Random value is generated once per process, low bytes are mixed with generator index so
+ * several encoders do not produce same ids with their own counters. Timestamp is taken from
+ * coarse clock and refreshed once per refresh_period ids, so it may lag behind for slow
+ * producers but ids stay unique since counter is always incremented. Generator is not thread
+ * safe, each encoder owns its instance.
+ */
+class ObjectId
+{
+	std::array<uint8_t, 12> _value = {};
+	uint32_t _counter = 0;
+
+	/// Number of ids generated with one timestamp reading, power of 2
+	static constexpr uint32_t refresh_period = 256;
+
+	static const std::array<uint8_t, 5> & process_random()
+	{
+		static const auto value = [] {
+			std::random_device dev;
+			std::array<uint8_t, 5> r;
+			for (auto & v : r)
+				v = dev();
+			return r;
+		}();
+		return value;
+	}
+
+	static uint32_t now()
+	{
+#ifdef CLOCK_REALTIME_COARSE
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+		return ts.tv_sec;
+#else
+		return time(nullptr);
+#endif
+	}
+
+ public:
+	ObjectId()
+	{
+		static std::atomic<unsigned> index = 0;
+		auto idx = index++;
+		auto & r = process_random();
+		std::copy(r.begin(), r.end(), _value.begin() + 4);
+		_value[7] ^= idx >> 8;
+		_value[8] ^= idx;
+		_counter = std::random_device()();
+		timestamp(now());
+	}
+
+	/// Next ObjectId, valid until next call
+	const std::array<uint8_t, 12> & next()
+	{
+		auto c = _counter++;
+		if ((c & (refresh_period - 1)) == 0)
+			timestamp(now());
+		_value[9] = c >> 16;
+		_value[10] = c >> 8;
+		_value[11] = c;
+		return _value;
+	}
+
+ private:
+	void timestamp(uint32_t ts)
+	{
+		_value[0] = ts >> 24;
+		_value[1] = ts >> 16;
+		_value[2] = ts >> 8;
+		_value[3] = ts;
+	}
+};
+
+/// Read integer field of any width
+template <typename Buf>
+long long read_int(const tll::scheme::Field * field, const Buf &data)
+{
+	using Field = tll::scheme::Field;
+	switch (field->type) {
+	case Field::Int8: return *data.template dataT<int8_t>();
+	case Field::Int16: return *data.template dataT<int16_t>();
+	case Field::Int32: return *data.template dataT<int32_t>();
+	case Field::Int64: return *data.template dataT<int64_t>();
+	case Field::UInt8: return *data.template dataT<uint8_t>();
+	case Field::UInt16: return *data.template dataT<uint16_t>();
+	case Field::UInt32: return *data.template dataT<uint32_t>();
+	case Field::UInt64: return *data.template dataT<uint64_t>();
+	default: return 0;
+	}
+}
+
+/// Write integer field of any width, value is truncated
+template <typename Buf>
+void write_int(const tll::scheme::Field * field, Buf data, long long v)
+{
+	using Field = tll::scheme::Field;
+	switch (field->type) {
+	case Field::Int8: *data.template dataT<int8_t>() = v; break;
+	case Field::Int16: *data.template dataT<int16_t>() = v; break;
+	case Field::Int32: *data.template dataT<int32_t>() = v; break;
+	case Field::Int64: *data.template dataT<int64_t>() = v; break;
+	case Field::UInt8: *data.template dataT<uint8_t>() = v; break;
+	case Field::UInt16: *data.template dataT<uint16_t>() = v; break;
+	case Field::UInt32: *data.template dataT<uint32_t>() = v; break;
+	case Field::UInt64: *data.template dataT<uint64_t>() = v; break;
+	default: break;
+	}
+}
+
+/// Check that memory is filled with zeroes, word at a time
+inline bool is_zero(const void * data, size_t size)
+{
+	auto ptr = static_cast<const unsigned char *>(data);
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), ptr += sizeof(uint64_t)) {
+		uint64_t v;
+		memcpy(&v, ptr, sizeof(v));
+		if (v)
+			return false;
+	}
+	for (; size; size--) {
+		if (*ptr++)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Check if field holds default value that is decoded from missing key:
+ * zero scalar, empty string or list, message with all default fields.
+ */
+template <typename Buf>
+bool is_default(const tll::scheme::Field * field, const Buf &data)
+{
+	using Field = tll::scheme::Field;
+	switch (field->type) {
+	case Field::Bytes:
+		if (field->sub_type == Field::ByteString)
+			return *data.template dataT<char>() == '\0';
+		return is_zero(data.data(), field->size);
+	case Field::Array:
+		return tll::scheme::read_size(field->count_ptr, data) == 0;
+	case Field::Pointer: {
+		auto ptr = tll::scheme::read_pointer(field, data);
+		return ptr && ptr->size == 0;
+	}
+	case Field::Message:
+		for (auto f = field->type_msg->fields; f; f = f->next) {
+			if (!is_default(f, data.view(f->offset)))
+				return false;
+		}
+		return true;
+	case Field::Union: {
+		auto type = tll::scheme::read_size(field->type_union->type_ptr, data.view(field->type_union->type_ptr->offset));
+		if (type != 0)
+			return false;
+		auto uf = field->type_union->fields;
+		return is_default(uf, data.view(uf->offset));
+	}
+	default:
+		return is_zero(data.data(), field->size);
+	}
+}
+
+/// Powers of 10 that fit into uint64_t
+inline constexpr uint64_t pow10[] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+	10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+	1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+	10000000000000000000ull,
+};
+
+/// Decimal128 in BID encoding, same layout as bson_decimal128_t
+struct Decimal128Words
+{
+	uint64_t low;
+	uint64_t high;
+};
+
+/// Exponent bias of Decimal128
+static constexpr int decimal128_bias = 6176;
+
+/// Build Decimal128 from fixed point value mantissa * 10^-precision without string conversion
+inline Decimal128Words fixed_to_decimal128(long long mantissa, unsigned precision)
+{
+	uint64_t sign = mantissa < 0;
+	uint64_t coef = sign ? -(uint64_t) mantissa : mantissa;
+	return { coef, (sign << 63) | ((uint64_t) (decimal128_bias - precision) << 49) };
+}
+
+/**
+ * Convert Decimal128 to fixed point mantissa with given precision
+ *
+ * Returns nullopt for special values, coefficients that do not fit into 64 bits and values that
+ * can not be represented exactly.
+ */
+inline std::optional<long long> decimal128_to_fixed(const Decimal128Words &d, unsigned precision)
+{
+	if (((d.high >> 61) & 3) == 3) // Infinity, NaN or large coefficient form
+		return std::nullopt;
+	if (d.high & ((1ull << 49) - 1)) // Coefficient does not fit into low word
+		return std::nullopt;
+	bool sign = d.high >> 63;
+	int shift = (int) ((d.high >> 49) & 0x3fff) - decimal128_bias + (int) precision;
+	uint64_t coef = d.low;
+	if (coef == 0)
+		return 0;
+	if (shift > 0) {
+		if (shift > 19 || coef > std::numeric_limits<uint64_t>::max() / pow10[shift])
+			return std::nullopt;
+		coef *= pow10[shift];
+	} else if (shift < 0) {
+		if (shift < -19 || coef % pow10[-shift])
+			return std::nullopt;
+		coef /= pow10[-shift];
+	}
+	if (coef > (uint64_t) std::numeric_limits<long long>::max() + sign)
+		return std::nullopt;
+	return sign ? (long long) -coef : (long long) coef;
+}
+
+/// Empty BSON document, used for raw document fields without data
+inline constexpr std::string_view empty_document = { "\x05\0\0\0\0", 5 };
+
+/**
+ * Get pre-encoded BSON document stored in memory of given size
+ *
+ * Only length prefix and trailing zero are checked, document body is not walked. Zero length
+ * prefix means that field is not filled and empty document is returned. Returns nullopt if
+ * document does not fit into the memory.
+ */
+inline std::optional<std::string_view> raw_document(const void * data, size_t size)
+{
+	if (size < sizeof(int32_t))
+		return size == 0 ? std::optional(empty_document) : std::nullopt;
+	int32_t len;
+	memcpy(&len, data, sizeof(len));
+	if (len == 0)
+		return empty_document;
+	if (len < 5 || (size_t) len > size)
+		return std::nullopt;
+	auto ptr = static_cast<const char *>(data);
+	if (ptr[len - 1] != '\0')
+		return std::nullopt;
+	return std::string_view(ptr, len);
+}
+
 template <typename I, typename Buf>
 std::string_view uint_to_string(I v, Buf &buf)
 {
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef _TLL_BSON_VIEW_H
+#define _TLL_BSON_VIEW_H
+
+#include <bson/bson.h>
+
+#include <tll/scheme.h>
+#include <tll/util/memoryview.h>
+
+#include "tll/bson/error-stack.h"
+#include "tll/bson/info.h"
+#include "tll/bson/libbson.h"
+#include "tll/bson/util.h"
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace tll::bson::view {
+
+class Document;
+class List;
+
+/**
+ * Lazy view of one message level of BSON document
+ *
+ * Keys of the level are indexed once when view is created: iterator of each known field is stored
+ * in flat table by FieldInfo::index, unknown keys are skipped. Values are converted only when
+ * getter is called, with the same rules as in full decode, so missing keys give default values.
+ * Nested messages and lists are indexed when they are requested.
+ *
+ * View refers to the BSON data and Document object it was created from, scheme must be bound.
+ */
+class Message
+{
+	friend class Document;
+	friend class List;
+
+	Document * _doc = nullptr;
+	const tll::scheme::Message * _message = nullptr;
+	/// Iterators of present keys, indexed by FieldInfo::index, raw is nullptr for missing ones
+	std::vector<bson_iter_t> _index;
+	/// Iterators of time point remainder companion keys
+	std::vector<bson_iter_t> _remainder;
+
+	bool init(Document * doc, const tll::scheme::Message * message, bson_iter_t * iter);
+
+ public:
+	Message() = default;
+
+	const tll::scheme::Message * message() const { return _message; }
+
+	/// Lookup field by name
+	const tll::scheme::Field * lookup(std::string_view name) const
+	{
+		for (auto f = _message->fields; f; f = f->next) {
+			if (f->name == name)
+				return f;
+		}
+		return nullptr;
+	}
+
+	/// Key of the field is present in the document
+	bool has(const tll::scheme::Field * field) const { return iter(field) != nullptr; }
+
+	/**
+	 * Get scalar value in the storage type of the field: integers with enum, bits, fixed or time
+	 * point subtypes, double or bson_decimal128_t. Size of ``T`` must match field size.
+	 */
+	template <typename T>
+	std::optional<T> get(const tll::scheme::Field * field);
+
+	/// Get string or bytes value without copy, strings are not null terminated
+	std::optional<std::string_view> get_string(const tll::scheme::Field * field);
+
+	/// Get view of sub-message
+	std::optional<Message> get_message(const tll::scheme::Field * field);
+
+	/// Get view of fixed array or pointer list
+	std::optional<List> get_list(const tll::scheme::Field * field);
+
+	template <typename T>
+	std::optional<T> get(std::string_view name) { return get<T>(lookup_or_fail(name)); }
+	std::optional<std::string_view> get_string(std::string_view name) { return get_string(lookup_or_fail(name)); }
+	std::optional<Message> get_message(std::string_view name);
+	std::optional<List> get_list(std::string_view name);
+
+ private:
+	const bson_iter_t * iter(const tll::scheme::Field * field) const
+	{
+		auto & i = _index[info(field)->index];
+		return i.raw ? &i : nullptr;
+	}
+
+	const tll::scheme::Field * lookup_or_fail(std::string_view name);
+};
+
+/// Lazy view of BSON array, elements are indexed when view is created
+class List
+{
+	friend class Message;
+	friend class Document;
+
+	Document * _doc = nullptr;
+	const tll::scheme::Field * _field = nullptr;
+	std::vector<bson_iter_t> _items;
+
+ public:
+	size_t size() const { return _items.size(); }
+
+	/// Element type
+	const tll::scheme::Field * field() const { return _field; }
+
+	template <typename T>
+	std::optional<T> get(size_t idx);
+	std::optional<std::string_view> get_string(size_t idx);
+	std::optional<Message> get_message(size_t idx);
+};
+
+/**
+ * Top level of BSON document, finds message by type key or nested document key like full decode
+ *
+ * Object can be reused for next documents, views created for previous document are invalidated.
+ */
+class Document : public ErrorStack
+{
+	friend class Message;
+	friend class List;
+
+	const util::Settings * _settings = &util::Settings::defaults();
+	libbson::Decoder _dec;
+	bson_t _bson;
+	/// Spill storage required by SpanBuffer, scalars always fit into value itself
+	std::vector<char> _spill;
+
+ public:
+	/// Seq from seq key, if it is present
+	std::optional<long long> seq;
+
+	/// Index document and return view of message level, nullopt on error
+	std::optional<Message> init(const util::Settings &settings, const SchemeInfo &info, const void * data, size_t size);
+
+	util::Limits & limits() { return _dec.limits; }
+
+ private:
+	/// Iterator over elements of sub-document or array
+	static bool recurse(const bson_iter_t * iter, bson_iter_t * child)
+	{
+		const uint8_t * data;
+		uint32_t len;
+		if (bson_iter_type(iter) == BSON_TYPE_ARRAY)
+			bson_iter_array(iter, &len, &data);
+		else
+			bson_iter_document(iter, &len, &data);
+		return bson_iter_init_from_data(child, data, len);
+	}
+
+	std::nullopt_t decoder_fail(const tll::scheme::Field * field)
+	{
+		error_copy(_dec);
+		return fail_field(std::nullopt, field);
+	}
+
+	/// Same type and size checks as in decoder, fixed size fields are limited with field size
+	std::optional<std::string_view> string(const bson_iter_t * iter, const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		switch (bson_iter_type(iter)) {
+		case BSON_TYPE_UTF8: {
+			uint32_t len;
+			auto ptr = bson_iter_utf8(iter, &len);
+			if (field->type == Field::Bytes && len > field->size)
+				return fail_field(fail(std::nullopt, "String for too long: {} > max {}", len, field->size), field);
+			return std::string_view(ptr, len);
+		}
+		case BSON_TYPE_BINARY: {
+			if (field->sub_type == Field::ByteString)
+				return fail_field(fail(std::nullopt, "Invalid BSON type for string: {}", bson_iter_type(iter)), field);
+			uint32_t len;
+			const uint8_t * ptr;
+			bson_subtype_t sub;
+			bson_iter_binary(iter, &sub, &len, &ptr);
+			if (field->type == Field::Bytes && len > field->size)
+				return fail_field(fail(std::nullopt, "Binary data too long: {} > max {}", len, field->size), field);
+			return std::string_view((const char *) ptr, len);
+		}
+		default:
+			return fail_field(fail(std::nullopt, "Invalid BSON type for string: {}", bson_iter_type(iter)), field);
+		}
+	}
+
+	template <typename T>
+	std::optional<T> scalar(const bson_iter_t * iter, const tll::scheme::Field * field, const bson_iter_t * remainder = nullptr)
+	{
+		using Field = tll::scheme::Field;
+		switch (field->type) {
+		case Field::Bytes: case Field::Array: case Field::Pointer: case Field::Message: case Field::Union:
+			return fail_field(fail(std::nullopt, "Field is not a scalar"), field);
+		default:
+			break;
+		}
+		if (sizeof(T) != field->size)
+			return fail_field(fail(std::nullopt, "Type size {} does not match field size {}", sizeof(T), field->size), field);
+		T v = {};
+		if (!iter)
+			return v;
+		// Conversion helpers of the decoder write straight into the value
+		util::SpanBuffer buf(&v, sizeof(v), sizeof(v), _spill);
+		auto data = tll::make_view(buf);
+		_dec.error_clear();
+		auto it = *iter;
+		if (!_dec.decode_plain(&it, field, data))
+			return decoder_fail(field);
+		if (remainder) {
+			it = *remainder;
+			if (!_dec.decode_time_remainder(&it, field, data))
+				return decoder_fail(field);
+		}
+		return v;
+	}
+
+	std::optional<Message> message(const bson_iter_t * iter, const tll::scheme::Field * field)
+	{
+		Message m;
+		if (!iter) {
+			m.init(this, field->type_msg, nullptr);
+			return m;
+		}
+		if (bson_iter_type(iter) != BSON_TYPE_DOCUMENT)
+			return fail_field(fail(std::nullopt, "Invalid BSON type for message: {}", bson_iter_type(iter)), field);
+		bson_iter_t child;
+		if (!recurse(iter, &child))
+			return fail_field(fail(std::nullopt, "Failed to init BSON document iterator"), field);
+		if (!m.init(this, field->type_msg, &child))
+			return fail_field(std::nullopt, field);
+		return m;
+	}
+
+	std::optional<List> list(const bson_iter_t * iter, const tll::scheme::Field * field)
+	{
+		using Field = tll::scheme::Field;
+		List l;
+		l._doc = this;
+		if (field->type == Field::Array)
+			l._field = field->type_array;
+		else if (field->type == Field::Pointer && field->sub_type != Field::ByteString)
+			l._field = field->type_ptr;
+		else
+			return fail_field(fail(std::nullopt, "Field is not a list"), field);
+		if (!iter)
+			return l;
+		if (bson_iter_type(iter) != BSON_TYPE_ARRAY)
+			return fail_field(fail(std::nullopt, "Invalid BSON type for array: {}", bson_iter_type(iter)), field);
+		bson_iter_t child;
+		if (!recurse(iter, &child))
+			return fail_field(fail(std::nullopt, "Failed to init BSON array iterator"), field);
+		while (bson_iter_next(&child))
+			l._items.push_back(child);
+		if (field->type == Field::Array && l._items.size() > field->count)
+			return fail_field(fail(std::nullopt, "Array size too large: {} > max {}", l._items.size(), field->count), field);
+		return l;
+	}
+};
+
+inline bool Message::init(Document * doc, const tll::scheme::Message * message, bson_iter_t * iter)
+{
+	_doc = doc;
+	_message = message;
+	auto mi = info(message);
+	_index.assign(mi->fields_size, bson_iter_t {});
+	_remainder.clear();
+	if (!iter)
+		return true;
+	while (bson_iter_next(iter)) {
+		std::string_view key = { bson_iter_key_unsafe(iter), bson_iter_key_len(iter) };
+		auto it = mi->index.find(key);
+		if (it == mi->index.end()) {
+			if (mi->time_rem_index.empty())
+				continue;
+			if (auto rt = mi->time_rem_index.find(key); rt != mi->time_rem_index.end()) {
+				_remainder.resize(mi->fields_size);
+				_remainder[info(rt->second)->index] = *iter;
+			}
+			continue;
+		}
+		auto & slot = _index[info(it->second)->index];
+		if (slot.raw)
+			return doc->fail(false, "Duplicate key '{}'", key);
+		slot = *iter;
+	}
+	return true;
+}
+
+template <typename T>
+std::optional<T> Message::get(const tll::scheme::Field * field)
+{
+	if (!field)
+		return std::nullopt;
+	const bson_iter_t * rem = nullptr;
+	if (_remainder.size() && _remainder[info(field)->index].raw)
+		rem = &_remainder[info(field)->index];
+	return _doc->scalar<T>(iter(field), field, rem);
+}
+
+inline std::optional<std::string_view> Message::get_string(const tll::scheme::Field * field)
+{
+	if (!field)
+		return std::nullopt;
+	auto i = iter(field);
+	if (!i)
+		return std::string_view();
+	return _doc->string(i, field);
+}
+
+inline std::optional<Message> Message::get_message(const tll::scheme::Field * field)
+{
+	if (!field)
+		return std::nullopt;
+	if (field->type != tll::scheme::Field::Message)
+		return _doc->fail_field(_doc->fail(std::nullopt, "Field is not a message"), field);
+	return _doc->message(iter(field), field);
+}
+
+inline std::optional<List> Message::get_list(const tll::scheme::Field * field)
+{
+	if (!field)
+		return std::nullopt;
+	return _doc->list(iter(field), field);
+}
+
+inline std::optional<Message> Message::get_message(std::string_view name) { return get_message(lookup_or_fail(name)); }
+inline std::optional<List> Message::get_list(std::string_view name) { return get_list(lookup_or_fail(name)); }
+
+inline const tll::scheme::Field * Message::lookup_or_fail(std::string_view name)
+{
+	if (auto f = lookup(name); f)
+		return f;
+	return _doc->fail(nullptr, "Field '{}' not found in message '{}'", name, _message->name);
+}
+
+template <typename T>
+std::optional<T> List::get(size_t idx)
+{
+	if (idx >= _items.size())
+		return _doc->fail(std::nullopt, "Index {} out of range, list size {}", idx, _items.size());
+	return _doc->scalar<T>(&_items[idx], _field);
+}
+
+inline std::optional<std::string_view> List::get_string(size_t idx)
+{
+	if (idx >= _items.size())
+		return _doc->fail(std::nullopt, "Index {} out of range, list size {}", idx, _items.size());
+	return _doc->string(&_items[idx], _field);
+}
+
+inline std::optional<Message> List::get_message(size_t idx)
+{
+	if (idx >= _items.size())
+		return _doc->fail(std::nullopt, "Index {} out of range, list size {}", idx, _items.size());
+	if (_field->type != tll::scheme::Field::Message)
+		return _doc->fail(std::nullopt, "List elements are not messages");
+	return _doc->message(&_items[idx], _field);
+}
+
+inline std::optional<Message> Document::init(const util::Settings &settings, const SchemeInfo &info, const void * data, size_t size)
+{
+	_settings = &settings;
+	seq.reset();
+	error_clear();
+	bson_iter_t iter;
+	if (!bson_init_static(&_bson, (const uint8_t *) data, size) || !bson_iter_init(&iter, &_bson))
+		return fail(std::nullopt, "Failed to bind BSON buffer");
+
+	const tll::scheme::Message * message = nullptr;
+	bson_iter_t body = {};
+	while (bson_iter_next(&iter)) {
+		std::string_view key = { bson_iter_key_unsafe(&iter), bson_iter_key_len(&iter) };
+		if (settings.seq_key.size() && key == settings.seq_key) {
+			if (auto r = _dec.decode_int(&iter); r)
+				seq = *r;
+			else
+				return fail(std::nullopt, "Non-integer seq key {}: {}", key, (int) bson_iter_type(&iter));
+		} else if (message) {
+			continue;
+		} else if (settings.mode == util::Settings::Mode::Flat) {
+			if (key != settings.type_key)
+				continue;
+			auto name = _dec.decode_string(&iter);
+			if (!name)
+				return fail(std::nullopt, "Non-string type key {}", key);
+			message = info.lookup(*name);
+			if (!message)
+				return fail(std::nullopt, "Message '{}' not found", *name);
+		} else {
+			auto m = info.lookup(key);
+			if (!m || m->msgid == 0)
+				continue;
+			if (bson_iter_type(&iter) != BSON_TYPE_DOCUMENT)
+				return fail(std::nullopt, "Non-document message '{}' key: {}", key, (int) bson_iter_type(&iter));
+			if (!recurse(&iter, &body))
+				return fail(std::nullopt, "Failed to init BSON document iterator");
+			message = m;
+		}
+	}
+	if (!message)
+		return fail(std::nullopt, "No known type in BSON");
+
+	// Flat message level is the document itself, service keys are not in the field index
+	if (settings.mode == util::Settings::Mode::Flat)
+		bson_iter_init(&body, &_bson);
+
+	Message m;
+	if (!m.init(this, message, &body))
+		return std::nullopt;
+	return m;
+}
+
+} // namespace tll::bson::view
+
+#endif//_TLL_BSON_VIEW_H
@@ -4,8 +4,12 @@
 import pytest
 
 import bson
+import datetime
+import struct
+import time
 from decimal import Decimal
 
+from tll.error import TLLError
 from tll.test_util import Accum
 
 @pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
@@ -107,3 +111,1192 @@ def test_nested(context, encoder):
 
     assert [(m.msgid, m.seq) for m in c.result] == [(10, 200), (20, 220)]
     assert c.unpack(c.result[-1]).as_dict() == {'f0': 'string'}
+
+def parse_op_msg(data):
+    size, request, response, opcode, flags = struct.unpack_from('<iiiiI', data)
+    assert size == len(data)
+    assert opcode == 2013
+    assert flags == 0
+    body, docs = None, []
+    off = 20
+    while off < size:
+        kind = data[off]
+        off += 1
+        slen, = struct.unpack_from('<i', data, off)
+        if kind == 0:
+            body = bson.decode(data[off:off + slen])
+        else:
+            assert kind == 1
+            end = off + slen
+            ident = data[off + 4:data.index(b'\0', off + 4)]
+            assert ident == b'documents'
+            doff = off + 4 + len(ident) + 1
+            while doff < end:
+                dlen, = struct.unpack_from('<i', data, doff)
+                docs.append(bson.decode(data[doff:doff + dlen]))
+                doff += dlen
+        off += slen
+    return request, body, docs
+
+def make_op_msg(body, response_to=0):
+    data = bson.encode(body)
+    return struct.pack('<iiiiI', 16 + 4 + 1 + len(data), 100, response_to, 2013, 0) + b'\0' + data
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_op_msg(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: M0
+  id: 10
+  fields:
+    - {name: f0, type: int32}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder,
+              framing='op-msg', **{'op-msg.collection': 'coll', 'op-msg.db': 'db', 'op-msg.batch-count': '2', 'op-msg.linger': '10ms'})
+    c.open()
+
+    assert c.state == c.State.Active
+
+    for i in range(3):
+        c.post({'f0': i}, name='M0', seq=100 + i)
+
+    assert len(r.result) == 1
+    request, body, docs = parse_op_msg(r.result[-1].data)
+    assert request == 1
+    assert body == {'insert': 'coll', '$db': 'db', 'ordered': True}
+    assert docs == [{'_tll_seq': 100 + i, '_tll_name': 'M0', 'f0': i} for i in range(2)]
+
+    c.process()
+    assert len(r.result) == 1
+
+    time.sleep(0.02)
+    c.process()
+    assert len(r.result) == 2
+    request, body, docs = parse_op_msg(r.result[-1].data)
+    assert request == 2
+    assert docs == [{'_tll_seq': 102, '_tll_name': 'M0', 'f0': 2}]
+
+    r.post(make_op_msg({'ok': 1.0, 'n': 2}, response_to=1))
+    r.post(make_op_msg({'ok': 0.0, 'errmsg': 'failed'}, response_to=2))
+    assert c.result == []
+    assert c.state == c.State.Active
+
+    c.post({'f0': 10}, name='M0', seq=110)
+    assert len(r.result) == 2
+    c.close()
+    assert len(r.result) == 3
+    request, body, docs = parse_op_msg(r.result[-1].data)
+    assert docs == [{'_tll_seq': 110, '_tll_name': 'M0', 'f0': 10}]
+
+def test_columnar(context):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int8}
+    - {name: s1, type: string}
+- name: M0
+  id: 10
+  fields:
+    - {name: f0, type: int32}
+    - {name: f1, type: double}
+    - {name: sub, type: Sub}
+    - {name: list, type: '*int16'}
+- name: M1
+  id: 20
+  fields:
+    - {name: f0, type: string}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context,
+              columnar='yes', **{'columnar.count': '3', 'columnar.linger': '1s'})
+    c.open()
+
+    assert c.state == c.State.Active
+
+    data = [{'f0': i, 'f1': i / 2, 'sub': {'s0': i, 's1': 'x' * i}, 'list': list(range(i))} for i in range(4)]
+    for i, d in enumerate(data):
+        c.post(d, name='M0', seq=100 + i)
+
+    assert len(r.result) == 1
+    d = bson.decode(r.result[-1].data)
+    assert d == {'_tll_seq': [100, 101, 102], '_tll_name': 'M0', '_tll_count': 3,
+                 'f0': [0, 1, 2],
+                 'f1': [0., 0.5, 1.],
+                 'sub': {'s0': [0, 1, 2], 's1': ['', 'x', 'xx']},
+                 'list': [[], [0], [0, 1]],
+                 }
+
+    c.post({'f0': 'string'}, name='M1', seq=200)
+    assert len(r.result) == 2
+    d = bson.decode(r.result[-1].data)
+    assert d['_tll_count'] == 1
+    assert d['_tll_seq'] == [103]
+    assert d['f0'] == [3]
+
+    c.close()
+    assert len(r.result) == 3
+    d = bson.decode(r.result[-1].data)
+    assert d == {'_tll_seq': [200], '_tll_name': 'M1', '_tll_count': 1, 'f0': ['string']}
+
+    c.open()
+
+    r.post(r.result[0].data)
+    assert [(m.msgid, m.seq) for m in c.result] == [(10, 100), (10, 101), (10, 102)]
+    for m, d in zip(c.result, data):
+        u = c.unpack(m)
+        assert (u.f0, u.f1, u.sub.s0, u.sub.s1, list(u.list)) == (d['f0'], d['f1'], d['sub']['s0'], d['sub']['s1'], d['list'])
+
+    r.post(bson.encode({'_tll_seq': 300, '_tll_name': 'M1', 'f0': 'single'}))
+    assert [(m.msgid, m.seq) for m in c.result[3:]] == [(20, 300)]
+    assert c.unpack(c.result[-1]).as_dict() == {'f0': 'single'}
+
+    # Count must match column lengths and can not exceed document size
+    for doc in [{'_tll_name': 'M1', '_tll_count': 1000000000000},
+                {'_tll_name': 'M1', '_tll_count': 1000000000000, 'f0': ['a']},
+                {'_tll_seq': [1], '_tll_name': 'M1', '_tll_count': 1000000000000},
+                {'_tll_seq': [1, 2], '_tll_name': 'M1', '_tll_count': 2, 'f0': ['a']},
+                {'_tll_seq': [1, 2], '_tll_name': 'M1', '_tll_count': 2, 'f0': ['a', 'b', 'c']},
+                {'_tll_name': 'M0', '_tll_count': 2, 'f0': [1, 2], 'sub': {'s0': [1]}},
+                ]:
+        with pytest.raises(TLLError):
+            r.post(bson.encode(doc))
+    assert len(c.result) == 4
+    assert int(c.config['info.errors.invalid']) == 3
+    assert int(c.config['info.errors.decode']) == 3
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_sparse(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int8}
+- name: Data
+  id: 10
+  unions:
+    Union: {union: [{name: i8, type: int8}, {name: s, type: string}]}
+  fields:
+    - {name: i32, type: int32}
+    - {name: d, type: double}
+    - {name: s, type: string}
+    - {name: b, type: byte8, options.type: string}
+    - {name: a, type: 'int8[4]'}
+    - {name: p, type: '*int8'}
+    - {name: m, type: Sub}
+    - {name: u, type: Union}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, sparse='yes')
+    c.open()
+
+    c.post({}, name='Data', seq=100)
+    assert bson.decode(r.result[-1].data) == {'_tll_name': 'Data', '_tll_seq': 100}
+
+    data = {'i32': 10, 'd': 1.5, 's': 'str', 'b': 'bytes', 'a': [1], 'p': [2], 'm': {'s0': 3}, 'u': {'s': 'x'}}
+    for k, v in data.items():
+        c.post({k: v}, name='Data', seq=100)
+        assert bson.decode(r.result[-1].data) == {'_tll_name': 'Data', '_tll_seq': 100, k: v}
+
+        r.post(r.result[-1].data)
+        assert c.unpack(c.result[-1]).as_dict()[k] == v
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+def test_key_alias(context, encoder, compose):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: sub_field, type: int8, options.bson.key: s}
+- name: LongMessageName
+  id: 10
+  options.bson.key: m
+  unions:
+    Union: {union: [{name: int_value, type: int8, options.bson.key: i}, {name: string_value, type: string, options.bson.key: s}]}
+  fields:
+    - {name: long_field_name, type: int32, options.bson.key: a1}
+    - {name: sub, type: Sub}
+    - {name: union, type: Union}
+    - {name: plain, type: int8}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, compose=compose)
+    c.open()
+
+    c.post({'long_field_name': 100, 'sub': {'sub_field': 10}, 'union': {'string_value': 'str'}, 'plain': 1}, name='LongMessageName', seq=100)
+    body = {'a1': 100, 'sub': {'s': 10}, 'union': {'s': 'str'}, 'plain': 1}
+    if compose == 'flat':
+        expected = {'_tll_name': 'm', '_tll_seq': 100, **body}
+    else:
+        expected = {'_tll_seq': 100, 'm': body}
+    assert bson.decode(r.result[-1].data) == expected
+
+    r.post(r.result[-1].data)
+    assert [(m.msgid, m.seq) for m in c.result] == [(10, 100)]
+    assert c.unpack(c.result[-1]).as_dict() == {'long_field_name': 100, 'sub': {'sub_field': 10}, 'union': {'string_value': 'str'}, 'plain': 1}
+
+    body = {'long_field_name': 200, 'sub': {'sub_field': 20}, 'union': {'int_value': 2}, 'plain': 2}
+    if compose == 'flat':
+        doc = {'_tll_name': 'LongMessageName', '_tll_seq': 200, **body}
+    else:
+        doc = {'_tll_seq': 200, 'LongMessageName': body}
+    r.post(bson.encode(doc))
+    assert [(m.msgid, m.seq) for m in c.result] == [(10, 100), (10, 200)]
+    assert c.unpack(c.result[-1]).as_dict() == body
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_symbolic(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  enums:
+    Enum: {type: int8, enum: {A: 0, B: 1, C: 2}}
+    Sparse: {type: int32, enum: {X: -100000, Y: 100000}}
+    Wide: {type: int64, enum: {Min: -9223372036854775808, Max: 9223372036854775807}}
+  bits:
+    Bits: {type: uint16, bits: {A: 0, B: 1, C: 2, W: {offset: 4, size: 3}}}
+  fields:
+    - {name: e, type: Enum}
+    - {name: s, type: Sparse}
+    - {name: b, type: Bits}
+    - {name: w, type: Wide}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, enum='string', bits='string')
+    c.open()
+
+    c.post({'e': 1, 's': 100000, 'b': 5 | (6 << 4), 'w': -9223372036854775808}, name='Data', seq=100)
+    d = bson.decode(r.result[-1].data)
+    assert d == {'_tll_name': 'Data', '_tll_seq': 100, 'e': 'B', 's': 'Y', 'b': ['A', 'C', {'W': 6}], 'w': 'Min'}
+
+    r.post(r.result[-1].data)
+    u = c.unpack(c.result[-1])
+    assert (int(u.e), int(u.s), int(u.b), int(u.w)) == (1, 100000, 5 | (6 << 4), -9223372036854775808)
+
+    r.post(bson.encode({'_tll_name': 'Data', '_tll_seq': 200, 'e': 2, 's': 'X', 'b': 2, 'w': 'Max'}))
+    u = c.unpack(c.result[-1])
+    assert (int(u.e), int(u.s), int(u.b), int(u.w)) == (2, -100000, 2, 9223372036854775807)
+
+    c.post({'e': 10}, name='Data', seq=100)
+    assert bson.decode(r.result[-1].data)['e'] == 10
+
+    count = len(c.result)
+    for body in [{'e': 'Z'}, {'b': ['D']}, {'b': ['W']}, {'b': [{'W': 8}]}, {'b': [{'X': 1}]}, {'w': 'Zero'}]:
+        with pytest.raises(TLLError):
+            r.post(bson.encode({'_tll_name': 'Data', **body}))
+    assert len(c.result) == count
+    assert int(c.config['info.errors.decode']) == 6
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_datetime(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: us, type: int64, options.type: time_point, options.resolution: us}
+    - {name: sec, type: int32, options.type: time_point, options.resolution: s}
+    - {name: ms, type: double, options.type: time_point, options.resolution: ms}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, time='datetime', **{'time.remainder': 'yes'})
+    c.open()
+
+    epoch = datetime.datetime(1970, 1, 1)
+    dt = datetime.datetime(2024, 5, 6, 7, 8, 9, 123000)
+    ms = (dt - epoch) // datetime.timedelta(milliseconds=1)
+
+    r.post(bson.encode({'_tll_name': 'Data', 'us_ns': 456000, 'us': dt, 'sec': dt, 'ms': dt}))
+    assert struct.unpack('<qid', c.result[-1].data[:20]) == (ms * 1000 + 456, ms // 1000, ms)
+
+    c.post(c.result[-1].data, msgid=10, seq=100)
+    d = bson.decode(r.result[-1].data)
+    assert d == {'_tll_name': 'Data', '_tll_seq': 100, 'us': dt, 'us_ns': 456000, 'sec': dt.replace(microsecond=0), 'ms': dt}
+
+    c.post(struct.pack('<qid', ms * 1000, 0, 0), msgid=10, seq=101)
+    d = bson.decode(r.result[-1].data)
+    assert 'us_ns' not in d
+    assert d['us'] == dt
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_datetime_remainder_nested(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: us, type: int64, options.type: time_point, options.resolution: us}
+- name: Data
+  id: 10
+  fields:
+    - {name: sub, type: Sub}
+    - {name: list, type: '*Sub'}
+'''
+    opts = {'encoder': encoder, 'time': 'datetime', 'time.remainder': 'yes'}
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, **opts)
+    c.open()
+
+    # Remainder is kept for time points of sub-messages, also in lists of sub-messages
+    body = struct.pack('<qII', 1000123456, 8, 0x08000001) + struct.pack('<q', 2000000789)
+    c.post(body, msgid=10, seq=100)
+    d = bson.decode(r.result[-1].data)
+    assert d['sub']['us_ns'] == 456000
+    assert d['list'][0]['us_ns'] == 789000
+    r.post(r.result[-1].data)
+    assert bytes(c.result[-1].data) == body
+    c.close()
+
+    # Time points without companion key are rejected instead of silent truncation
+    bad = [
+        ('list', "{name: f, type: '*us_t'}", {}),
+        ('array', "{name: f, type: 'us_t[4]'}", {}),
+        ('columnar', "{name: f, type: int64, options.type: time_point, options.resolution: us}", {'columnar': 'yes'}),
+    ]
+    for name, field, extra in bad:
+        s = f'''yamls://
+- name: ''
+  aliases:
+    - {{name: us_t, type: int64, options.type: time_point, options.resolution: us}}
+- name: Data
+  id: 10
+  fields:
+    - {field}
+'''
+        c = Accum(f'bson+direct://;name=bson-{name}', master=r, scheme=s, context=context, **opts, **extra)
+        try:
+            c.open()
+        except TLLError:
+            pass
+        assert c.state == c.State.Error
+
+    # Coarse resolution has no remainder and lists are allowed
+    s = '''yamls://
+- name: ''
+  aliases:
+    - {name: ms_t, type: int64, options.type: time_point, options.resolution: ms}
+- name: Data
+  id: 10
+  fields:
+    - {name: f, type: '*ms_t'}
+'''
+    c = Accum('bson+direct://;name=bson-ms', master=r, scheme=s, context=context, **opts)
+    c.open()
+    assert c.state == c.State.Active
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+@pytest.mark.parametrize("mode", ["decimal128", "double"])
+def test_fixed(context, encoder, mode):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f8, type: int64, options.type: fixed8}
+    - {name: f2, type: int32, options.type: fixed2}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, fixed=mode)
+    c.open()
+
+    c.post(struct.pack('<qi', -12345678901, 12345), msgid=10, seq=100)
+    d = bson.decode(r.result[-1].data)
+    if mode == 'decimal128':
+        assert str(d['f8'].to_decimal()) == '-123.45678901'
+        assert str(d['f2'].to_decimal()) == '123.45'
+    else:
+        assert d['f8'] == -123.45678901
+        assert d['f2'] == 123.45
+
+    r.post(r.result[-1].data)
+    assert struct.unpack('<qi', c.result[-1].data[:12]) == (-12345678901, 12345)
+
+    r.post(bson.encode({'_tll_name': 'Data', 'f8': bson.Decimal128('1.5'), 'f2': bson.Decimal128('100')}))
+    assert struct.unpack('<qi', c.result[-1].data[:12]) == (150000000, 10000)
+
+    # Doubles with scaling error are accepted, inexact ones are rejected like Decimal128
+    r.post(bson.encode({'_tll_name': 'Data', 'f8': 0.1, 'f2': 1.15}))
+    assert struct.unpack('<qi', c.result[-1].data[:12]) == (10000000, 115)
+
+    count = len(c.result)
+    for body in [{'f2': bson.Decimal128('0.001')}, {'f2': 1.2345}, {'f8': 1e-9}, {'f2': 1e30}]:
+        try:
+            r.post(bson.encode({'_tll_name': 'Data', **body}))
+        except TLLError:
+            pass
+    assert len(c.result) == count
+
+    for p in [20, 30]:
+        bad = f'''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {{name: f, type: int64, options.type: fixed{p}}}
+'''
+        # Precision is rejected on bind, or by scheme parser if it checks it too
+        try:
+            c = Accum(f'bson+direct://;name=bson-fixed{p}', master=r, scheme=bad, context=context, encoder=encoder, fixed=mode)
+            c.open()
+        except TLLError:
+            continue
+        assert c.state == c.State.Error
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+def test_raw_document(context, encoder):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: fixed, type: byte64, options.type: bson}
+    - {name: ptr, type: '*uint8', options.type: bson}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, encoder=encoder)
+    c.open()
+
+    inner = {'a': 10, 'b': 'string', 'c': {'d': [1, 2]}}
+    doc = {'_tll_name': 'Data', 'fixed': inner, 'ptr': inner}
+    r.post(bson.encode(doc))
+    u = c.unpack(c.result[-1])
+    assert bytes(u.fixed)[:len(bson.encode(inner))] == bson.encode(inner)
+    assert bytes(u.ptr) == bson.encode(inner)
+
+    c.post(c.result[-1].data, msgid=10, seq=100)
+    assert bson.decode(r.result[-1].data) == {'_tll_seq': 100, **doc}
+
+    c.post({}, name='Data', seq=101)
+    assert bson.decode(r.result[-1].data) == {'_tll_name': 'Data', '_tll_seq': 101, 'fixed': {}, 'ptr': {}}
+
+    count = len(r.result)
+    with pytest.raises(TLLError):
+        c.post({'fixed': b'\x41\0\0\0'}, name='Data', seq=102)
+    assert len(r.result) == count
+
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+@pytest.mark.parametrize("chunk", [1, 7, 1000])
+def test_stream(context, compose, chunk):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32}
+    - {name: s1, type: string}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+    - {name: list, type: '*Sub'}
+    - {name: array, type: 'int16[4]'}
+    - {name: sub, type: Sub}
+    - {name: str, type: string}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, compose=compose, stream='yes')
+    c.open()
+
+    docs = []
+    for i in range(3):
+        body = {'f0': i, 'list': [{'s0': j, 's1': 'x' * j} for j in range(i * 10)], 'array': [1, 2, i], 'sub': {'s0': i, 's1': 'sub'}, 'str': 'string' * i}
+        if compose == 'flat':
+            docs.append(({'_tll_seq': 100 + i, '_tll_name': 'Data', 'unknown': {'a': [1, 2]}, **body}, body))
+        else:
+            docs.append(({'_tll_seq': 100 + i, 'unknown': {'a': [1, 2]}, 'Data': body}, body))
+
+    data = b''.join(bson.encode(d) for d, _ in docs)
+    for i in range(0, len(data), chunk):
+        r.post(data[i:i + chunk])
+
+    assert [(m.msgid, m.seq) for m in c.result] == [(10, 100 + i) for i in range(3)]
+    for m, (_, body) in zip(c.result, docs):
+        assert c.unpack(m).as_dict() == body
+
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+@pytest.mark.parametrize("stream", ["no", "yes"])
+def test_limits(context, stream, compose):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32}
+- name: Data
+  id: 10
+  fields:
+    - {name: list, type: '*Sub'}
+    - {name: str, type: string}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context, stream=stream, compose=compose,
+              **{'limit.depth': '2', 'limit.array': '3', 'limit.bytes': '256', 'limit.unknown': '2'})
+    c.open()
+
+    def check(doc, ok):
+        count = len(c.result)
+        try:
+            if compose == 'flat':
+                r.post(bson.encode({'_tll_name': 'Data', **doc}))
+            else:
+                r.post(bson.encode({'Data': doc}))
+        except TLLError:
+            pass
+        assert len(c.result) == count + (1 if ok else 0)
+        if not ok and stream == 'yes':
+            c.close()
+            c.open()
+
+    check({'list': [{'s0': 1}] * 3, 'str': 'x' * 100, 'a': 1, 'b': 2}, True)
+    check({'list': [{'s0': 1}] * 4}, False)
+    check({'str': 'x' * 300}, False)
+    check({'a': 1, 'b': 2, 'c': 3}, False)
+    check({'list': [{'s0': 1, 'x': {'y': 1}}]}, True)
+    check({'list': [{'s0': 1, 'x': 1, 'y': 2, 'z': 3}]}, False)
+
+@pytest.mark.parametrize("policy", ['drop', 'log'])
+def test_on_error(context, policy):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32}
+- name: Data
+  id: 10
+  fields:
+    - {name: list, type: '*Sub'}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context,
+              **{'on-error': policy, 'limit.array': '3'})
+    c.open()
+
+    r.post(b'\x05\x00')
+    r.post(bson.encode({'_tll_name': 'Unknown'}))
+    r.post(bson.encode({'_tll_name': 'Data', 'list': [{'s0': 1}] * 4}))
+    r.post(bson.encode({'_tll_name': 'Data', 'list': [{'s0': 'x'}]}))
+    assert c.result == []
+
+    r.post(bson.encode({'_tll_name': 'Data', 'list': [{'s0': 1}] * 3}))
+    assert [m.msgid for m in c.result] == [10]
+
+    assert c.state == c.State.Active
+    assert int(c.config['info.errors.invalid']) == 1
+    assert int(c.config['info.errors.unknown']) == 1
+    assert int(c.config['info.errors.limit']) == 1
+    assert int(c.config['info.errors.decode']) == 1
+
+def bson_pairs(*pairs):
+    body = b''
+    for k, v in pairs:
+        if isinstance(v, list):
+            body += b'\x03' + k.encode() + b'\0' + bson_pairs(*v)
+        else:
+            body += bson.encode({k: v})[4:-1]
+    return struct.pack('<i', len(body) + 5) + body + b'\0'
+
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+@pytest.mark.parametrize("stream", ["no", "yes"])
+def test_required(context, compose, stream):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32, options.bson.required: yes}
+    - {name: s1, type: int32}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64, options.bson.required: yes}
+    - {name: f1, type: int64}
+    - {name: sub, type: Sub}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context,
+              compose=compose, stream=stream, **{'on-error': 'drop'})
+    c.open()
+
+    def check(pairs, ok):
+        if compose == 'flat':
+            data = bson_pairs(('_tll_name', 'Data'), *pairs)
+        else:
+            data = bson_pairs(('Data', pairs))
+        count = len(c.result)
+        try:
+            r.post(data)
+        except TLLError:
+            pass
+        assert len(c.result) == count + (1 if ok else 0)
+        if not ok and stream == 'yes':
+            c.close()
+            c.open()
+
+    check([('f0', 1), ('sub', [('s0', 1)])], True)
+    check([('f0', 1)], True)
+    check([('f1', 1)], False)
+    check([('f0', 1), ('sub', [('s1', 1)])], False)
+    check([('f0', 1), ('sub', [])], False)
+    check([('f0', 1), ('f0', 2)], False)
+    check([('f0', 1), ('sub', [('s0', 1), ('s1', 2), ('s0', 3)])], False)
+
+def test_shared_scheme(context):
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64, options.bson.key: x}
+'''
+    r = [Accum('direct://', name=f'raw{i}', context=context) for i in range(3)]
+    c = [Accum(f'bson+direct://;name=bson{i}', master=r[i], scheme=scheme, context=context) for i in range(3)]
+    for i in range(3):
+        r[i].open()
+        c[i].open()
+
+    c[0].close()
+    for i in range(3):
+        if i == 0:
+            c[i].open()
+        c[i].post({'f0': i}, name='Data', seq=100)
+        assert bson.decode(r[i].result[-1].data) == {'_tll_name': 'Data', '_tll_seq': 100, 'x': i}
+
+    assert len({c[i].config['info.scheme.info'] for i in range(3)}) == 1
+
+    other = Accum('bson+direct://;name=bson-other', master=r[0], scheme=scheme.replace('int64', 'int32'), context=context)
+    other.open()
+    assert other.config['info.scheme.info'] != c[0].config['info.scheme.info']
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+def test_workers(context, encoder, compose):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+    - {name: list, type: '*Sub'}
+'''
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context,
+              encoder=encoder, compose=compose, workers='3', **{'workers.depth': '16', 'on-error': 'drop'})
+    c.open()
+
+    def wait(channel, count):
+        for _ in range(1000):
+            if len(channel.result) >= count:
+                break
+            c.process()
+            time.sleep(0.001)
+        assert len(channel.result) == count
+
+    count = 100
+    for i in range(count):
+        c.post({'f0': i, 'list': [{'s0': j} for j in range(i % 7)]}, name='Data', seq=i)
+    wait(r, count)
+    assert [m.seq for m in r.result] == list(range(count))
+    for i, m in enumerate(r.result):
+        body = {'f0': i, 'list': [{'s0': j} for j in range(i % 7)]}
+        if compose == 'flat':
+            assert bson.decode(m.data) == {'_tll_seq': i, '_tll_name': 'Data', **body}
+        else:
+            assert bson.decode(m.data) == {'_tll_seq': i, 'Data': body}
+
+    for i, m in enumerate(r.result):
+        if i == 50:
+            r.post(b'\x05\x00')
+        r.post(m.data, seq=m.seq)
+    wait(c, count)
+    assert [m.seq for m in c.result] == list(range(count))
+    assert [c.unpack(m).f0 for m in c.result] == list(range(count))
+    assert int(c.config['info.errors.invalid']) == 1
+
+    # Unknown message and short body fail synchronously, broken pointer is counted when job is collected
+    with pytest.raises(TLLError):
+        c.post(b'\0' * 16, msgid=20)
+    with pytest.raises(TLLError):
+        c.post(b'\0' * 8, msgid=10)
+    c.post(struct.pack('<qII', 1, 0xffff, 0x04000010), msgid=10, seq=count)
+    c.post({'f0': count + 1}, name='Data', seq=count + 1)
+    wait(r, count + 1)
+    assert r.result[-1].seq == count + 1
+    assert int(c.config['info.errors.invalid']) == 2
+
+def test_workers_close_callback(context):
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+'''
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context)
+    c.open()
+
+    count = 10
+    for i in range(count):
+        c.post({'f0': i}, name='Data', seq=i)
+
+    rc = Accum('direct://', name='raw-client', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client', master=rc, scheme=scheme, context=context, workers='2')
+    d.open()
+
+    # Channel is closed from data callback delivered by collect loop, pending jobs are delivered on close
+    seqs = []
+    def callback(_, m):
+        if m.type != d.Type.Data:
+            return
+        seqs.append(m.seq)
+        if d.state == d.State.Active:
+            d.close()
+    d.callback_add(callback)
+
+    for m in r.result:
+        rc.post(m.data, seq=m.seq)
+    for _ in range(1000):
+        if d.state == d.State.Closed:
+            break
+        d.process()
+        time.sleep(0.001)
+    assert d.state == d.State.Closed
+    assert seqs == list(range(count))
+
+    d.open()
+    rc.post(r.result[0].data, seq=100)
+    for _ in range(1000):
+        if seqs[-1] == 100:
+            break
+        d.process()
+        time.sleep(0.001)
+    assert seqs[-1] == 100
+
+def test_encoder_auto(context):
+    scheme = '''yamls://
+- name: Sub
+  fields:
+    - {name: s0, type: int32}
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+    - {name: list, type: '*Sub'}
+    - {name: str, type: string}
+'''
+    result = {}
+    for encoder, workers in [('libbson', '0'), ('cppbson', '0'), ('auto', '0'), ('auto-workers', '2')]:
+        r = Accum('direct://', name=f'raw-{encoder}', context=context)
+        r.open()
+        c = Accum(f'bson+direct://;name=bson-{encoder}', master=r, scheme=scheme, context=context,
+                  encoder=encoder.split('-')[0], workers=workers, **{'encoder.samples': '4', 'encoder.period': '10'})
+        c.open()
+        for i in range(30):
+            c.post({'f0': i, 'list': [{'s0': j} for j in range(i % 5)], 'str': 'x' * i}, name='Data', seq=i)
+        for _ in range(1000):
+            if len(r.result) == 30:
+                break
+            c.process()
+            time.sleep(0.001)
+        result[encoder] = [m.data.tobytes() for m in r.result]
+        if encoder.startswith('auto'):
+            assert c.config['info.encoder.Data'] in ('libbson', 'cppbson')
+
+    assert result['auto'] == result['libbson']
+    assert result['auto'] == result['cppbson']
+    assert result['auto-workers'] == result['libbson']
+
+def test_flat_key_order(context):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+    - {name: f1, type: int64}
+'''
+    c = Accum('bson+direct://;direct.dump=text+hex;name=bson', master=r, scheme=scheme, context=context)
+    c.open()
+
+    r.post(bson_pairs(('f0', 10), ('unknown', 'x'), ('_tll_name', 'Data'), ('f1', 20), ('_tll_seq', 100)))
+    assert [(m.msgid, m.seq) for m in c.result] == [(10, 100)]
+    assert c.unpack(c.result[-1]).as_dict() == {'f0': 10, 'f1': 20}
+
+@pytest.mark.parametrize("workers", ["0", "2"])
+def test_scheme_reload(context, workers):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+'''
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, workers=workers)
+    control = []
+    c.callback_add(lambda _, m: control.append(m.msgid) if m.type == c.Type.Control else None)
+    c.open()
+
+    def wait(f):
+        for _ in range(1000):
+            c.process()
+            if f():
+                return
+            time.sleep(0.001)
+        assert f()
+
+    c.post({'f0': 1}, name='Data', seq=1)
+    wait(lambda: len(r.result) == 1)
+
+    c.post({'url': scheme.replace('int64}', 'int64}\n    - {name: f1, type: int32}')}, name='SchemeReload', type=c.Type.Control)
+    with pytest.raises(TLLError):
+        c.post({'url': scheme}, name='SchemeReload', type=c.Type.Control)
+    wait(lambda: int(c.config['info.scheme.reloads']) == 1)
+
+    c.post({'f0': 2, 'f1': 20}, name='Data', seq=2)
+    wait(lambda: len(r.result) == 2)
+    assert [bson.decode(m.data) for m in r.result] == [
+        {'_tll_name': 'Data', '_tll_seq': 1, 'f0': 1},
+        {'_tll_name': 'Data', '_tll_seq': 2, 'f0': 2, 'f1': 20},
+    ]
+
+    with pytest.raises(TLLError):
+        c.post({'url': 'yamls://[{name: Data, fields: [{name: f0, type: unknown}]}]'}, name='SchemeReload', type=c.Type.Control)
+    c.post({'url': 'yamls://[{name: Data, fields: [{name: f0, type: int64, options.bson.required: maybe}]}]'}, name='SchemeReload', type=c.Type.Control)
+    for _ in range(100):
+        c.process()
+        time.sleep(0.001)
+    assert int(c.config['info.scheme.reloads']) == 1
+    assert c.state == c.State.Active
+    assert control == [11]
+
+@pytest.mark.parametrize("workers", ["0", "2"])
+def test_scheme_reload_in_flight(context, workers):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+'''
+    wide = scheme.replace('int64}', 'int64}\n    - {name: f1, type: int32}')
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, workers=workers)
+    c.open()
+    rc = Accum('direct://', name='raw-client', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client', master=rc, scheme=scheme, context=context, workers=workers)
+    d.open()
+    old = c.config['info.scheme.info']
+
+    def wait(channel, f):
+        for _ in range(1000):
+            channel.process()
+            if f():
+                return
+            time.sleep(0.001)
+        assert f()
+
+    # Jobs posted before reload are still in the pool when new scheme is applied
+    count = 50
+    for i in range(count):
+        c.post({'f0': i}, name='Data', seq=i)
+        rc.post(bson.encode({'_tll_name': 'Data', '_tll_seq': i, 'f0': i, 'f1': i}), seq=i)
+    c.post({'url': wide}, name='SchemeReload', type=c.Type.Control)
+    d.post({'url': wide}, name='SchemeReload', type=d.Type.Control)
+    time.sleep(0.1)
+    wait(c, lambda: int(c.config['info.scheme.reloads']) == 1)
+    wait(d, lambda: int(d.config['info.scheme.reloads']) == 1)
+    assert c.config['info.scheme.info'] != old
+
+    for i in range(count, 2 * count):
+        c.post({'f0': i, 'f1': i}, name='Data', seq=i)
+        rc.post(bson.encode({'_tll_name': 'Data', '_tll_seq': i, 'f0': i, 'f1': i}), seq=i)
+    wait(c, lambda: len(r.result) == 2 * count)
+    wait(d, lambda: len(d.result) == 2 * count)
+
+    assert [bson.decode(m.data) for m in r.result] == \
+        [{'_tll_name': 'Data', '_tll_seq': i, 'f0': i} for i in range(count)] + \
+        [{'_tll_name': 'Data', '_tll_seq': i, 'f0': i, 'f1': i} for i in range(count, 2 * count)]
+    assert [m.seq for m in d.result] == list(range(2 * count))
+    assert [m.size for m in d.result[:count]] == [8] * count
+    assert [m.size for m in d.result[count:]] == [12] * count
+    assert [d.unpack(m).as_dict() for m in d.result[count:]] == [{'f0': i, 'f1': i} for i in range(count, 2 * count)]
+
+@pytest.mark.parametrize("encoder", ["libbson", "cppbson"])
+@pytest.mark.parametrize("stream", ["no", "yes"])
+def test_object_id(context, encoder, stream):
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: f0, type: int64}
+'''
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, encoder=encoder, stream=stream, **{'id-key': '_id'})
+    c.open()
+
+    start = int(time.time())
+    for i in range(3):
+        c.post({'f0': i}, name='Data', seq=i)
+    docs = [bson.decode(m.data) for m in r.result]
+    assert [list(d.keys()) for d in docs] == [['_id', '_tll_seq', '_tll_name', 'f0']] * 3
+    ids = [d['_id'] for d in docs]
+    assert len(set(ids)) == 3
+    for oid in ids:
+        assert isinstance(oid, bson.ObjectId)
+        assert start - 1 <= int(oid.generation_time.timestamp()) <= time.time() + 1
+    assert [oid.binary[4:9] for oid in ids] == [ids[0].binary[4:9]] * 3
+    counter = [int.from_bytes(oid.binary[9:], 'big') for oid in ids]
+    assert [(x - counter[0]) % 0x1000000 for x in counter] == [0, 1, 2]
+
+    for m in r.result:
+        r.post(m.data, seq=m.seq)
+    assert [(m.seq, c.unpack(m).f0) for m in c.result] == [(i, i) for i in range(3)]
+
+@pytest.mark.parametrize("delta", ["flat", "set"])
+def test_delta(context, delta):
+    scheme = '''yamls://
+- name: Data
+  id: 10
+  fields:
+    - {name: id, type: int32}
+    - {name: f0, type: int64}
+    - {name: f1, type: double}
+    - {name: s, type: string}
+    - {name: list, type: '*int32'}
+'''
+    opts = {'delta': delta, 'delta.key': 'id', 'delta.snapshot': '3'}
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, **opts)
+    c.open()
+    rc = Accum('direct://', name='raw-client', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client', master=rc, scheme=scheme, context=context, **opts, **{'on-error': 'drop'})
+
+    posted = [
+        (1, {'id': 1, 'f0': 10, 'f1': 1.5, 's': 'a', 'list': [1, 2]}),
+        (2, {'id': 2, 'f0': 20, 'f1': 2.5, 's': 'b', 'list': []}),
+        (3, {'id': 1, 'f0': 11, 'f1': 1.5, 's': 'a', 'list': [1, 2]}),
+        (4, {'id': 1, 'f0': 11, 'f1': 1.5, 's': 'c', 'list': [1, 2, 3]}),
+        (5, {'id': 2, 'f0': 20, 'f1': 0, 's': 'b', 'list': []}),
+        (6, {'id': 1, 'f0': 12, 'f1': 1.5, 's': 'c', 'list': [1, 2, 3]}),
+    ]
+    for seq, body in posted:
+        c.post(body, name='Data', seq=seq)
+
+    docs = [bson.decode(m.data) for m in r.result]
+    head = {'_tll_seq': 3, '_tll_name': 'Data'}
+    if delta == 'flat':
+        assert docs[2] == {**head, '_tll_delta': True, 'id': 1, 'f0': 11}
+        assert docs[3] == {**head, '_tll_seq': 4, '_tll_delta': True, 'id': 1, 's': 'c', 'list': [1, 2, 3]}
+        assert docs[4] == {**head, '_tll_seq': 5, '_tll_delta': True, 'id': 2, 'f1': 0}
+    else:
+        assert docs[2] == {**head, 'id': 1, '$set': {'f0': 11}}
+        assert docs[3] == {**head, '_tll_seq': 4, 'id': 1, '$set': {'s': 'c', 'list': [1, 2, 3]}}
+        assert docs[4] == {**head, '_tll_seq': 5, 'id': 2, '$set': {'f1': 0}}
+    assert docs[5] == {**head, '_tll_seq': 6, **posted[5][1]}
+    assert int(c.config['info.delta.snapshots']) == 3
+    assert int(c.config['info.delta.updates']) == 3
+
+    d.open()
+    for m in r.result[2:5]:
+        rc.post(m.data, seq=m.seq)
+    assert [m.seq for m in d.result] == []
+    assert int(d.config['info.errors.decode']) == 3
+
+    d.close()
+    d.open()
+    for m in r.result:
+        rc.post(m.data, seq=m.seq)
+    assert [m.seq for m in d.result] == [1, 2, 3, 4, 5, 6]
+    for m, (_, body) in zip(d.result, posted):
+        assert d.unpack(m).as_dict() == body
+
+    # Changed pointer fields do not leave stale data in retained message
+    opts['delta.snapshot'] = '0'
+    r = Accum('direct://', name='raw-nosnap', context=context)
+    r.open()
+    c = Accum('bson+direct://;name=bson-nosnap', master=r, scheme=scheme, context=context, **opts)
+    c.open()
+    rc = Accum('direct://', name='raw-client-nosnap', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client-nosnap', master=rc, scheme=scheme, context=context, **opts)
+    d.open()
+    for i in range(100):
+        c.post({'id': 1, 'f0': i, 's': 'xyz'[i % 3] * 10, 'list': [i, i + 1]}, name='Data', seq=i)
+    assert int(c.config['info.delta.snapshots']) == 1
+    for m in r.result:
+        rc.post(m.data, seq=m.seq)
+    assert len(d.result) == 100
+    assert d.result[-1].size == d.result[0].size
+    assert d.unpack(d.result[-1]).as_dict() == {'id': 1, 'f0': 99, 'f1': 0, 's': 'x' * 10, 'list': [99, 100]}
+
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+@pytest.mark.parametrize("workers", ["0", "2"])
+def test_filter(context, compose, workers):
+    scheme = '''yamls://
+- name: Header
+  enums:
+    Kind: {type: int8, enum: {A: 1, B: 2}}
+  fields:
+    - {name: id0, type: int32}
+    - {name: kind, type: Kind}
+- name: Data
+  id: 10
+  fields:
+    - {name: header, type: Header}
+    - {name: s, type: string}
+    - {name: f2, type: int32, options.type: fixed2}
+- name: Other
+  id: 20
+  fields:
+    - {name: s, type: string}
+'''
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, compose=compose, enum='string')
+    c.open()
+
+    posted = [
+        ('Data', {'header': {'id0': 100, 'kind': 'A'}, 's': 'AAA', 'f2': Decimal('1.5')}),
+        ('Data', {'header': {'id0': 100, 'kind': 'B'}, 's': 'BBB', 'f2': Decimal('1.5')}),
+        ('Data', {'header': {'id0': 200, 'kind': 'A'}, 's': 'AAA', 'f2': Decimal('1.5')}),
+        ('Data', {'header': {'id0': 100, 'kind': 'A'}, 's': 'AAA', 'f2': Decimal('2.5')}),
+        ('Data', {'s': 'AAA'}),
+        ('Other', {'s': 'AAA'}),
+    ]
+    for seq, (name, body) in enumerate(posted):
+        c.post(body, name=name, seq=seq)
+
+    expr = "header.id0 == 100 && (s == 'AAA' || header.kind == B) && !(f2 > 2)"
+    rc = Accum('direct://', name='raw-client', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client', master=rc, scheme=scheme, context=context, compose=compose, workers=workers, filter=expr)
+    d.open()
+    for m in r.result:
+        rc.post(m.data, seq=m.seq)
+    for _ in range(100):
+        if len(d.result) == 3:
+            break
+        d.process()
+        time.sleep(0.001)
+    # Other message has no header field, result of expression is unknown and it is passed
+    assert [m.seq for m in d.result] == [0, 1, 5]
+    assert int(d.config['info.filter.dropped']) == 3
+    d.close()
+
+    # Resolved false operand of && decides result even if other path is missing
+    d = Accum('bson+direct://;name=bson-client-known', master=rc, scheme=scheme, context=context, compose=compose, workers=workers, filter="s == 'BBB' && header.id0 == 100")
+    d.open()
+    for m in r.result:
+        rc.post(m.data, seq=m.seq)
+    for _ in range(100):
+        if len(d.result) == 1:
+            break
+        d.process()
+        time.sleep(0.001)
+    assert [m.seq for m in d.result] == [1]
+    assert int(d.config['info.filter.dropped']) == 5
+
+    # Value that can not be converted into field type is unknown, document is passed to decoder
+    d = Accum('bson+direct://;name=bson-client-invalid', master=rc, scheme=scheme, context=context, compose=compose, workers=workers, filter="!(header.id0 == 100)")
+    d.open()
+    body = {'header': {'id0': 'invalid'}, 's': 'AAA'}
+    if compose == 'flat':
+        doc = {'_tll_name': 'Data', '_tll_seq': 300, **body}
+    else:
+        doc = {'_tll_seq': 300, 'Data': body}
+    try:
+        rc.post(bson.encode(doc))
+    except TLLError:
+        pass
+    for _ in range(100):
+        if int(d.config['info.errors.decode']) == 1:
+            break
+        d.process()
+        time.sleep(0.001)
+    assert int(d.config['info.errors.decode']) == 1
+    assert int(d.config['info.filter.dropped']) == 0
+
+    for i, expr in enumerate(["header.id0 ==", "header.id0 == 1 &&", "(s == 'a'", "s < 'a' b"]):
+        with pytest.raises(TLLError):
+            Accum(f'bson+direct://;name=bson-invalid-{i}', master=rc, scheme=scheme, context=context, filter=expr)
+    for i, expr in enumerate(["s == 1", "missing == 1", "header.kind == C", "f2 == 0.001", "header == 1"]):
+        d = Accum(f'bson+direct://;name=bson-unbound-{i}', master=rc, scheme=scheme, context=context, filter=expr)
+        try:
+            d.open()
+        except TLLError:
+            pass
+        assert d.state == d.State.Error
+
+@pytest.mark.parametrize("compose", ["flat", "nested"])
+@pytest.mark.parametrize("workers", ["0", "2"])
+def test_route(context, compose, workers):
+    scheme = '''yamls://
+- name: Header
+  fields:
+    - {name: dest, type: int32}
+    - {name: ts, type: int64, options.type: time_point, options.resolution: us}
+- name: Data
+  id: 10
+  fields:
+    - {name: header, type: Header}
+    - {name: s, type: string}
+- name: Other
+  id: 20
+  fields:
+    - {name: s, type: string}
+'''
+    r = Accum('direct://', name='raw', context=context)
+    r.open()
+    c = Accum('bson+direct://;name=bson', master=r, scheme=scheme, context=context, compose=compose, workers=workers,
+              **{'addr-key': 'header.dest', 'time-key': 'header.ts'})
+    c.open()
+
+    c.post({'header': {'dest': 10, 'ts': 1000}, 's': 'AAA'}, name='Data', seq=0, addr=1, time=2)
+    c.post({'s': 'BBB'}, name='Other', seq=1, addr=1, time=2)
+    for _ in range(100):
+        if len(r.result) == 2:
+            break
+        c.process()
+        time.sleep(0.001)
+    assert [(m.seq, m.addr, m.time.value) for m in r.result] == [(0, 10, 1000000), (1, 1, 2)]
+
+    rc = Accum('direct://', name='raw-client', master=r, context=context)
+    d = Accum('bson+direct://;name=bson-client', master=rc, scheme=scheme, context=context, compose=compose, workers=workers,
+              **{'addr-key': 'header.dest', 'time-key': 'header.ts'})
+    d.open()
+    for m in r.result:
+        rc.post(m.data, seq=m.seq, addr=3, time=4)
+    for _ in range(100):
+        if len(d.result) == 2:
+            break
+        d.process()
+        time.sleep(0.001)
+    assert [(m.seq, m.addr, m.time.value) for m in d.result] == [(0, 10, 1000000), (1, 3, 4)]
+
+    for i, key in enumerate([{'addr-key': 'missing'}, {'addr-key': 's'}, {'addr-key': 's.dest'}, {'time-key': 'header'}]):
+        d = Accum(f'bson+direct://;name=bson-unbound-{i}', master=rc, scheme=scheme, context=context, **key)
+        try:
+            d.open()
+        except TLLError:
+            pass
+        assert d.state == d.State.Error